@@ -0,0 +1,242 @@
+/**
+ * Microbenchmarks for the editor's core primitives: `make bench`.
+ *
+ * Builds synthetic corpora in memory (short lines, long lines, tab-heavy,
+ * comment-heavy and a big one of 1M+ rows, ./bench N for N rows) and
+ * times, on each, the primitives every perf change goes through. Reports
+ * ns per op, MB/s of text processed and allocations per op.
+ *
+ * ccode.c is included whole, without its main(), with malloc() and
+ * friends counted on the way.
+ */
+
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t bench_allocs;
+
+static void *bench_malloc(size_t n) {
+    bench_allocs++;
+    return malloc(n);
+}
+
+static void *bench_calloc(size_t n, size_t size) {
+    bench_allocs++;
+    return calloc(n, size);
+}
+
+static void *bench_realloc(void *p, size_t n) {
+    bench_allocs++;
+    return realloc(p, n);
+}
+
+static char *bench_strdup(const char *s) {
+    bench_allocs++;
+    return strdup(s);
+}
+
+#define malloc(n) bench_malloc(n)
+#define calloc(n, size) bench_calloc(n, size)
+#define realloc(p, n) bench_realloc(p, n)
+#define strdup(s) bench_strdup(s)
+
+#undef _DEFAULT_SOURCE // features.h set it to 1, ccode.c defines it again
+#define CCODE_NO_MAIN
+#include "ccode.c"
+
+#define BENCH_MIN_MS 200.0 // repeated benchmarks run at least this long
+#define BENCH_FRAMES 500
+
+/*** Corpora ***/
+
+static uint64_t bench_state;
+
+static uint64_t bench_rand() {
+    bench_state ^= bench_state << 13;
+    bench_state ^= bench_state >> 7;
+    bench_state ^= bench_state << 17;
+    return bench_state;
+}
+
+static const char *bench_words[] = {
+    "int", "return", "row", "buffer", "if", "for", "while", "char", "size",
+    "E.numrows", "0x1f", "42", "\"text\"", "memcpy(dst,", "src)", "->chars",
+    "struct", "editor_row", "*p", "=", "+", "==", "{", "}", "(void)", "len;",
+};
+#define BENCH_NWORDS (sizeof(bench_words) / sizeof(bench_words[0]))
+
+// Appends words separated by sep to line until it is at least len long
+static int bench_fill(char *line, int at, int len, char sep) {
+    while (at < len) {
+        const char *w = bench_words[bench_rand() % BENCH_NWORDS];
+        int n = strlen(w);
+        memcpy(line + at, w, n);
+        at += n;
+        line[at++] = sep;
+    }
+    return at;
+}
+
+static int gen_short(char *line) {
+    return bench_fill(line, 0, bench_rand() % 24, ' ');
+}
+
+static int gen_long(char *line) {
+    return bench_fill(line, 0, 500 + bench_rand() % 2500, ' ');
+}
+
+static int gen_tabs(char *line) {
+    int at = 1 + bench_rand() % 4;
+    memset(line, '\t', at);
+    return bench_fill(line, at, at + 8 + bench_rand() % 48, bench_rand() % 2 ? '\t' : ' ');
+}
+
+// C with a block comment now and then, line comments and strings
+static int gen_comments(char *line) {
+    static int in_block;
+    int at = 0;
+
+    if (in_block > 0) {
+        at = bench_fill(line, 0, 10 + bench_rand() % 50, ' ');
+        if (--in_block == 0) {
+            memcpy(line + at, " */", 3);
+            at += 3;
+        }
+        return at;
+    }
+    switch (bench_rand() % 8) {
+        case 0:
+            in_block = 1 + bench_rand() % 6;
+            memcpy(line, "/* ", 3);
+            return bench_fill(line, 3, 20 + bench_rand() % 40, ' ');
+        case 1:
+        case 2:
+            memcpy(line, "    // ", 7);
+            return bench_fill(line, 7, 20 + bench_rand() % 40, ' ');
+        default:
+            memcpy(line, "    ", 4);
+            at = bench_fill(line, 4, 10 + bench_rand() % 40, ' ');
+            memcpy(line + at, "\"a // string\";", 14);
+            return at + 14;
+    }
+}
+
+struct corpus {
+    const char *name;
+    int (*gen)(char *line);
+    int rows;
+};
+
+/*** Benchmarks ***/
+
+static void bench_report(const char *name, long ops, double ms, double bytes, size_t allocs) {
+    printf("  %-24s %10ld %12.1f %10.1f %10.2f\n", name, ops, ms * 1e6 / ops,
+           bytes / (1 << 20) / (ms / 1e3), (double)allocs / ops);
+}
+
+static void bench_corpus(struct corpus *c) {
+    double t;
+    size_t allocs;
+
+    // the buffer starts empty, so every row goes through insert_row()
+    row_splice(0, E.numrows, NULL, 0, NULL);
+    bench_state = 88172645463325252ULL;
+    char *text = malloc((size_t)c->rows * 3100);
+    int *lens = malloc(sizeof(int) * c->rows);
+    size_t size = 0;
+    for (int j = 0; j < c->rows; j++) {
+        lens[j] = c->gen(text + size);
+        size += lens[j];
+    }
+    printf("%s: %d rows, %.1f MB\n", c->name, c->rows, size / 1048576.0);
+    printf("  %-24s %10s %12s %10s %10s\n", "", "ops", "ns/op", "MB/s", "allocs/op");
+
+    allocs = bench_allocs;
+    t = headless_now();
+    for (size_t j = 0, off = 0; j < (size_t)c->rows; off += lens[j++])
+        insert_row(E.numrows, text + off, lens[j]);
+    bench_report("insert_row", c->rows, headless_now() - t, size, bench_allocs - allocs);
+    free(text);
+    free(lens);
+
+    allocs = bench_allocs;
+    t = headless_now();
+    for (int j = 0; j < E.numrows; j++)
+        update_row(&E.row[j]);
+    bench_report("update_row", E.numrows, headless_now() - t, size, bench_allocs - allocs);
+
+    allocs = bench_allocs;
+    t = headless_now();
+    for (int j = 0; j < E.numrows; j++)
+        update_syntax_highlight(&E.row[j]);
+    bench_report("update_syntax_highlight", E.numrows, headless_now() - t, size,
+                 bench_allocs - allocs);
+
+    // a query that is nowhere, so every call scans every row
+    long calls = 0;
+    allocs = bench_allocs;
+    t = headless_now();
+    do {
+        find_callback("no such text", 0);
+        find_callback("no such text", '\x1b');
+        calls++;
+    } while (headless_now() - t < BENCH_MIN_MS);
+    bench_report("find_callback scan", calls * E.numrows, headless_now() - t,
+                 (double)calls * size, bench_allocs - allocs);
+
+    int len = 0;
+    calls = 0;
+    allocs = bench_allocs;
+    t = headless_now();
+    do {
+        free(rows_to_string(&len));
+        calls++;
+    } while (headless_now() - t < BENCH_MIN_MS);
+    bench_report("rows_to_string", calls, headless_now() - t, (double)calls * len,
+                 bench_allocs - allocs);
+
+    // frames at cursor positions spread over the file, drawn into the null sink
+    size_t bytes = D.steps[0].bytes;
+    allocs = bench_allocs;
+    t = headless_now();
+    for (int k = 0; k < BENCH_FRAMES; k++) {
+        E.cursor_y = (int)((long long)k * 7919 % E.numrows);
+        E.cursor_x = 0;
+        refresh_screen();
+    }
+    bench_report("refresh_screen", BENCH_FRAMES, headless_now() - t,
+                 D.steps[0].bytes - bytes, bench_allocs - allocs);
+    putchar('\n');
+}
+
+int main(int argc, char *argv[]) {
+    int big = argc > 1 ? atoi(argv[1]) : 1000000;
+    struct corpus corpora[] = {
+        { "short lines", gen_short, 200000 },
+        { "long lines", gen_long, 10000 },
+        { "tab-heavy", gen_tabs, 200000 },
+        { "comment-heavy", gen_comments, 200000 },
+        { "big", gen_comments, big > 0 ? big : 1000000 },
+    };
+
+    // a headless editor with a 120x40 screen and its frames discarded
+    D.enabled = 1;
+    D.rows = 40;
+    D.cols = 120;
+    D.sink = SINK_NULL;
+    D.steps = calloc(1, sizeof(struct script_step));
+    D.nsteps = 1;
+    init();
+    buffers_init();
+    E.filename = strdup("bench.c");
+    select_highlight();
+
+    for (size_t j = 0; j < sizeof(corpora) / sizeof(corpora[0]); j++)
+        bench_corpus(&corpora[j]);
+    return 0;
+}
@@ -7,14 +7,27 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -32,6 +45,8 @@
 #define CCODE_TAB_STOP 4
 #define CCODE_QUIT_TIMES 3
 #define LINENUM_WIDTH 5
+#define CCODE_CACHE_BUDGET (64 << 20) // render caches kept for background buffers
+#define VIEW_STRIDE 1024 // lines between two checkpoints of the viewer's line index
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -46,7 +61,13 @@ enum key_config
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    ALT_ARROW_UP,
+    ALT_ARROW_DOWN,
+    SHIFT_ARROW_LEFT,
+    SHIFT_ARROW_RIGHT,
+    SHIFT_ARROW_UP,
+    SHIFT_ARROW_DOWN
 };
 
 enum highlight_config {
@@ -76,6 +97,18 @@ struct syntax_config {
     int flags;
 };
 
+// nesting summary of a row's brackets, see the Brackets section
+struct bracket_sum {
+    int delta; // opening minus closing brackets
+    int min;   // lowest depth reached reading forwards, <= 0
+    int rmin;  // lowest depth reached reading backwards, <= 0
+};
+
+// byte, character and word counts, see the Statistics section
+struct text_stats {
+    long long bytes, chars, words;
+};
+
 // editor row
 typedef struct editor_row {
     int index;
@@ -85,8 +118,63 @@ typedef struct editor_row {
     char *render;
     unsigned char *highlight;
     int hl_open_comment; // highlight_
+    int *shared; // refcount when chars are shared copy-on-write, see row_own()
+    int br_known; // br is up to date with chars and the highlight
+    struct bracket_sum br;
+    int fold; // rows hidden under this one by a closed fold, see Folding
+    int nbytes, nchars, nwords; // counts of chars and the newline, see row_count()
+    int in_words; // its words are in E.word_nodes, see Completion
+    uint64_t hash; // line_hash() of chars, kept with the counts
+    uint64_t saved; // hash when the file was loaded or saved, 0 if added since
+    int removed; // saved lines were deleted below it (1), above it (2), see Change marks
+    int moved; // rows it was moved down (up if negative) by row_move() and rows_permute()
 } editor_row;
 
+enum undo_type {
+    UNDO_INSERT,
+    UNDO_DELETE,
+    UNDO_SPLIT,
+    UNDO_JOIN,
+    UNDO_ROWS,
+    UNDO_MOVE,
+    UNDO_LINES,
+    UNDO_FILTER,
+    UNDO_SORT
+};
+
+typedef struct undo_t {
+    enum undo_type type;
+    int x, y;
+    char *text;
+    int len;            // UNDO_ROWS: number of entries in rows, UNDO_MOVE: rows moved
+    editor_row *rows;   // UNDO_ROWS: rows to put back at y
+    int count;          // UNDO_ROWS: rows now at y that they replace, UNDO_MOVE: where they went
+    int *lines;         // UNDO_LINES: index of the row each entry in rows is swapped with,
+                        // UNDO_FILTER: index each deleted row had before the deletion,
+                        // UNDO_SORT: the old offset from y of each of the len rows
+} undo_t;
+
+#define MAX_UNDO 1000
+
+// tail -f style state for a file that keeps growing under us, or a pipe
+struct follow_state {
+    int enabled;
+    int fd;         // kept open so we only pread() the appended bytes
+    int pipe;       // fd is a non-blocking pipe (ccode -), read() until EOF
+    int inotify_fd;
+    int watch;
+    off_t offset;   // bytes of the file already turned into rows
+    int open_tail;  // last row had no '\n' yet, appended bytes continue it
+    int unread;     // bytes may have been appended before the watch, see follow_start()
+    int new_from;   // first row added by the last poll, drawn with a green gutter
+};
+
+// an extra cursor, see the Multiple cursors section
+struct cursor {
+    int x, y;
+    int primary;
+};
+
 struct editor_settings
 {
     int cursor_x, cursor_y;
@@ -96,37 +184,229 @@ struct editor_settings
     int screenrows;
     int screencols;
     int numrows;
+    int rowcap; // allocated slots in row, grown geometrically
     editor_row *row;
     int dirty; // If file has been modified since opening or saving
     char *filename;
     char status_prompt[85];
     time_t status_prompt_time;
     struct syntax_config *syntax;
+    struct follow_state follow;
+    undo_t *undo_stack; // MAX_UNDO entries each, kept per buffer
+    int undo_len;
+    undo_t *redo_stack;
+    int redo_len;
+    int sel_active; // selection from (sel_x, sel_y) to the cursor
+    int sel_x, sel_y;
+    int sel_block; // the selection is a rectangle, see block_range()
+    struct cursor *cursors; // extra cursors, sorted by position
+    int ncursors;
+    int cursorcap;
+    int cursors_undo; // undo_len right after the last batched edit
+    int hl_stale; // first row whose highlight may be out of date, see highlight_stale()
+    struct bracket_sum *br_tree; // segment tree over the rows' br, see brackets_build()
+    int br_cap;   // leaves in br_tree
+    int br_valid; // leaves of br_tree before this row match the rows, see brackets_drop()
+    unsigned br_gen; // bumped whenever a row's br is counted
+    struct {
+        int y, rx, found, my, mrx;
+        unsigned gen;
+    } br_pair; // the bracket pair at the cursor, see bracket_pair()
+    int folded;     // some row may hold a closed fold
+    struct fold_node *fold_tree; // cover of each row by closed folds, see folds_build()
+    int fold_cap;   // leaves in fold_tree
+    int fold_built; // fold_tree matches the rows, cleared when rows move
+    struct text_stats stats; // totals of the rows' counts
+    struct text_stats *stats_tree; // Fenwick tree over the rows' counts
+    int stats_built; // stats_tree matches the rows, cleared when rows move
+    unsigned stats_gen; // bumped when counts change or rows move
+    struct {
+        int sx, sy, ex, ey;
+        unsigned gen;
+        struct text_stats st;
+    } sel_stats; // counts of the selection, see selection_stats()
+    struct word_node *word_nodes; // trie of the rows' words, see Completion
+    int word_count; // nodes in use, 0 until the first word
+    int word_cap;
+    int word_next; // rows before it are all in the trie, see words_idle()
     struct termios terminal_settings;
 };
 struct editor_settings E;
 
-enum undo_type {
-    UNDO_INSERT,
-    UNDO_DELETE,
-    UNDO_SPLIT,
-    UNDO_JOIN
+/**
+ * Open buffers. The active one lives in E (so the rest of the editor keeps
+ * using E directly) and its slot here is stale until we switch away; the
+ * background ones are parked in their slot. Switching is a struct copy.
+ */
+struct editor_buffer {
+    struct editor_settings state;
+    int loaded;           // background buffers are read on first switch
+    size_t cache_bytes;   // render + highlight bytes held while in background
+    unsigned long last_used;
 };
 
-typedef struct undo_t {
-    enum undo_type type;
-    int x, y;
-    char *text;
-    int len;
-} undo_t;
+struct buffer_list {
+    struct editor_buffer *list;
+    int count;
+    int current;
+    unsigned long clock;
+};
+struct buffer_list B;
 
-#define MAX_UNDO 1000
+/**
+ * Internal clipboard, one for all buffers. Its text is the rows joined by
+ * '\n'; whole lines share their chars with the rows they were taken from.
+ */
+struct clipboard {
+    editor_row *rows;
+    int numrows;
+    int block; // a column block, pasted one line per row
+};
+struct clipboard C;
+
+/**
+ * Keyboard macro, ^T records and ^U replays. While replaying, keys come
+ * from keys[] instead of the terminal and nothing is drawn.
+ */
+struct macro_state {
+    int *keys;
+    int len, cap;
+    int recording;
+    int replaying;
+    int pos;        // next key to replay
+    int from, tail; // rows touched by the replay, see macro_touched()
+};
+struct macro_state M;
+
+/**
+ * Read-only viewer (-R). The file is mmapped and never split into rows,
+ * only the lines on screen are decoded. A background thread records the
+ * offset of every VIEW_STRIDE-th line, so jumping to a line is a binary
+ * search plus a scan of at most VIEW_STRIDE lines.
+ */
+struct viewer_state {
+    int enabled;
+    char *map;
+    size_t size;
+    off_t *checkpoints;   // checkpoints[k] = offset of line k * VIEW_STRIDE
+    size_t ncheck;
+    size_t checkcap;
+    size_t scanned;       // bytes covered by the index so far
+    long lines;           // newlines seen in the scanned part
+    int index_done;
+    int cached;           // the complete index came from the sidecar
+    pthread_mutex_t lock; // guards the index fields above
+    pthread_t indexer;
+    int fd;
+    struct stat st;       // as of opening, what the sidecar is keyed on
+    size_t top;           // offset of the first line on screen
+    long top_line;        // its line number, -1 while not known yet
+};
+struct viewer_state V;
+
+/**
+ * Hex view (-x). The file is mapped private and writable, so overwriting a
+ * byte only copies its page; the offsets we changed are kept sorted and
+ * written back with pwrite() on save.
+ */
+struct hex_state {
+    int enabled;
+    int fd;
+    int writable;
+    char *map;
+    size_t size;
+    size_t *modified;   // sorted offsets of bytes that differ from the file
+    size_t nmodified;
+    size_t modcap;
+    size_t cursor;      // offset of the byte under the cursor
+    int nibble;         // 1 after the high nibble of the cursor byte was typed
+    int ascii;          // typing goes to the character column instead
+    size_t top;         // first row on screen
+    int bytes_per_row;
+    int offset_width;   // hex digits used for the offset column
+};
+struct hex_state H;
+
+/**
+ * Symbol index for ^]: the functions, structs, typedefs and defines of
+ * the C files under the working directory. It is kept in ~/.cache/ccode
+ * with the mtime and size of every file, so only changed files are
+ * scanned again.
+ */
+struct symbol {
+    uint64_t mask;      // characters of the name, see symbol_mask()
+    uint32_t name;      // offset of the name in names
+    uint32_t file;
+    uint32_t line;
+    uint16_t len;
+    char kind;          // 'f'unction, 's'truct, 't'ypedef or 'd'efine
+};
+
+struct symbol_file {
+    char *path;         // relative to the working directory
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+    uint32_t first;     // its symbols are syms[first, first + count)
+    uint32_t count;
+};
+
+#define SYMBOL_SHOW 64 // best matches the prompt cycles through
+
+struct symbol_state {
+    int loaded;
+    struct symbol_file *files;  // sorted by path
+    int nfiles;
+    struct symbol *syms;
+    int nsyms;
+    char *names;
+    char *folded;       // names in lowercase, for matching
+    size_t nameslen;
+    int *cand;          // every symbol matching cand_query
+    int ncand;
+    char *cand_query;
+    int show[SYMBOL_SHOW];  // the best of them, best first
+    int nshow;
+    int pick;           // the one Enter jumps to
+};
+struct symbol_state S;
+
+/**
+ * Headless mode (-s script): no terminal at all. The screen has the size
+ * given with -g, keys come from the script, frames go to a sink instead
+ * of stdout, and the time each step of the script took is reported.
+ */
+enum headless_sink {
+    SINK_NULL,
+    SINK_FILE,
+    SINK_HASH
+};
+
+struct script_step {
+    char *line;         // as written in the script, for the report
+    int *keys;
+    int nkeys;
+    int idle;           // editor_idle() calls to make instead of keys
+    double ms;          // from its first key until the next was asked for
+    double render_ms;   // the part of it spent in refresh_screen()
+    int frames;
+    size_t bytes;
+};
 
-undo_t undo_stack[MAX_UNDO];
-int undo_len = 0;
+struct headless_state {
+    int enabled;
+    int rows, cols;
+    enum headless_sink sink;
+    int fd;             // SINK_FILE
+    uint64_t hash;      // SINK_HASH, of every byte drawn
+    struct script_step *steps; // steps[0] is loading the files
+    int nsteps;
+    int step;           // the one running
+    int pos;            // its next key
+    double started;     // when it started
+};
+struct headless_state D;
 
-undo_t redo_stack[MAX_UNDO];
-int redo_len = 0;
 
 /* Filetypes */
 
@@ -160,12 +440,38 @@ struct syntax_config HLDB[] = {
 void set_prompt_message(const char *fmt, ...);
 void refresh_screen();
 char *get_user_input(char *prompt, void (*callback)(char *, int));
+int editor_idle();
+int editor_wait_fd();
+void init_buffer();
+void update_row(editor_row *row);
+void row_render(editor_row *row);
+long index_cache_lines(const char *filename);
+struct abuf;
+void viewer_draw(struct abuf *ab);
+void move_cursor(int key);
+void block_paste();
+void process_keypress();
+int macro_touched(int from, int to);
+void macro_record(int c);
+void rows_permute(int at, int n, const int *order, int inverse);
+void brackets_count(editor_row *row);
+int row_cx_to_rx(editor_row *row, int cx);
+int row_rx_to_cx(editor_row *row, int rx);
+int selection_range(int *sx, int *sy, int *ex, int *ey);
+void hex_draw(struct abuf *ab);
+void hex_cursor_position(int *y, int *x);
+int viewer_idle();
+void symbol_find();
+void diff_show();
+uint64_t fnv1a(uint64_t h, const void *data, size_t len);
+void screen_write(const char *s, size_t len);
+int headless_key();
 
 /*** Terminal ***/
 void die(const char *s)
 {
-    write(STDOUT_FILENO, "\x1b[2j]", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+    screen_write("\x1b[2j]", 4);
+    screen_write("\x1b[H", 3);
 
     perror(s);
     exit(1);
@@ -196,13 +502,35 @@ void enable_rawmode()
         die("tcsetattr");
 }
 
-int read_keypress()
+int read_terminal_key()
 {
     int nread;
     char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
+    while (1) {
+        /**
+         * Wait for a key, but also for whatever background work is waiting
+         * on (a pipe we stream from, inotify). Timeouts give periodic work
+         * like the viewer's progress a chance to run too.
+         */
+        struct pollfd fds[2] = {
+            { STDIN_FILENO, POLLIN, 0 },
+            { editor_wait_fd(), POLLIN, 0 }
+        };
+        int ready = poll(fds, fds[1].fd == -1 ? 1 : 2, 100);
+        if (ready == -1 && errno != EINTR && errno != EAGAIN)
+            die("poll");
+        if (ready <= 0 || !(fds[0].revents & POLLIN)) {
+            if (editor_idle())
+                refresh_screen();
+            continue;
+        }
+
+        nread = read(STDIN_FILENO, &c, 1);
+        if (nread == 1)
+            break;
         if (nread == -1 && errno != EAGAIN)
             die("read");
+    }
 
     if (c == '\x1b')
     {
@@ -239,6 +567,27 @@ int read_keypress()
                         return END_KEY;
                     }
                 }
+                else if (seq[2] == ';')
+                {
+                    // ESC [ 1 ; <modifier> <key>, modifier 2 is Shift, 3 is Alt
+                    char mod, key;
+                    if (read(STDIN_FILENO, &mod, 1) != 1)
+                        return '\x1b';
+                    if (read(STDIN_FILENO, &key, 1) != 1)
+                        return '\x1b';
+                    if (mod == '3' && key == 'A')
+                        return ALT_ARROW_UP;
+                    if (mod == '3' && key == 'B')
+                        return ALT_ARROW_DOWN;
+                    if (mod == '2') {
+                        switch (key) {
+                        case 'A': return SHIFT_ARROW_UP;
+                        case 'B': return SHIFT_ARROW_DOWN;
+                        case 'C': return SHIFT_ARROW_RIGHT;
+                        case 'D': return SHIFT_ARROW_LEFT;
+                        }
+                    }
+                }
             }
             else
             {
@@ -325,16 +674,240 @@ int get_windows_size(int *rows, int *cols)
     }
 }
 
+/**
+ * Returns the next key: from the macro being replayed (ESC once it runs
+ * out, to end any prompt it left open), or else from the terminal,
+ * recording it if a macro is being recorded.
+ */
+int read_keypress()
+{
+    if (M.replaying)
+        return M.pos < M.len ? M.keys[M.pos++] : '\x1b';
+
+    int c = D.enabled ? headless_key() : read_terminal_key();
+    if (M.recording)
+        macro_record(c);
+    return c;
+}
+
+/*** Headless ***/
+
+// Keys a script can name, besides C-x for Ctrl and single characters
+struct script_key {
+    const char *name;
+    int key;
+} script_keys[] = {
+    { "Up", ARROW_UP }, { "Down", ARROW_DOWN },
+    { "Left", ARROW_LEFT }, { "Right", ARROW_RIGHT },
+    { "Home", HOME_KEY }, { "End", END_KEY },
+    { "PageUp", PAGE_UP }, { "PageDown", PAGE_DOWN },
+    { "Delete", DELETE_KEY }, { "Backspace", BACKSPACE },
+    { "Enter", '\r' }, { "Tab", '\t' }, { "Esc", '\x1b' }, { "Space", ' ' },
+    { "Alt-Up", ALT_ARROW_UP }, { "Alt-Down", ALT_ARROW_DOWN },
+    { "Shift-Up", SHIFT_ARROW_UP }, { "Shift-Down", SHIFT_ARROW_DOWN },
+    { "Shift-Left", SHIFT_ARROW_LEFT }, { "Shift-Right", SHIFT_ARROW_RIGHT },
+};
+
+double headless_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+int script_key(const char *name) {
+    if (name[0] == 'C' && name[1] == '-' && name[2] != '\0') {
+        if (strcmp(name + 2, "Space") == 0) return CTRL_KEY(' ');
+        if (name[3] == '\0') return CTRL_KEY(tolower((unsigned char)name[2]));
+        return -1;
+    }
+    if (name[0] != '\0' && name[1] == '\0') return (unsigned char)name[0];
+    for (size_t j = 0; j < sizeof(script_keys) / sizeof(script_keys[0]); j++)
+        if (strcmp(name, script_keys[j].name) == 0) return script_keys[j].key;
+    return -1;
+}
+
+void script_push(struct script_step *st, int key, int *cap) {
+    if (st->nkeys == *cap) {
+        *cap = *cap ? *cap * 2 : 16;
+        st->keys = realloc(st->keys, sizeof(int) * *cap);
+    }
+    st->keys[st->nkeys++] = key;
+}
+
+/**
+ * Reads a script, one step per line:
+ *
+ *   type TEXT          types TEXT
+ *   key NAME[*N] ...   presses keys: Up, Enter, C-f, Shift-Left, x, ...
+ *   idle [N]           runs the idle work N times (1), as if no key came
+ *
+ * Blank lines and lines starting with # are skipped. Exits on errors.
+ */
+void script_load(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    int cap = 16, lineno = 0;
+    D.steps = calloc(cap, sizeof(struct script_step));
+    D.steps[0].line = strdup("(load)");
+    D.nsteps = 1;
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &linecap, fp)) != -1) {
+        lineno++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+        if (len == 0 || line[0] == '#') continue;
+
+        if (D.nsteps == cap) {
+            D.steps = realloc(D.steps, sizeof(struct script_step) * cap * 2);
+            memset(&D.steps[cap], 0, sizeof(struct script_step) * cap);
+            cap *= 2;
+        }
+        struct script_step *st = &D.steps[D.nsteps++];
+        int keycap = 0;
+        st->line = strdup(line);
+
+        if (strncmp(line, "type ", 5) == 0) {
+            for (char *p = line + 5; *p; p++)
+                script_push(st, (unsigned char)*p, &keycap);
+        } else if (strncmp(line, "key ", 4) == 0) {
+            for (char *name = strtok(line + 4, " "); name; name = strtok(NULL, " ")) {
+                int times = 1;
+                char *star = strchr(name, '*');
+                if (star && star != name) {
+                    *star = '\0';
+                    times = atoi(star + 1);
+                }
+                int key = script_key(name);
+                if (key == -1) {
+                    fprintf(stderr, "%s:%d: unknown key %s\n", path, lineno, name);
+                    exit(1);
+                }
+                while (times-- > 0)
+                    script_push(st, key, &keycap);
+            }
+        } else if (strncmp(line, "idle", 4) == 0 && (line[4] == '\0' || line[4] == ' ')) {
+            st->idle = line[4] ? atoi(line + 5) : 1;
+        } else {
+            fprintf(stderr, "%s:%d: expected type, key or idle\n", path, lineno);
+            exit(1);
+        }
+    }
+    free(line);
+    fclose(fp);
+}
+
+// Where frames go: -o null (the default), hash or a file name
+void headless_sink(const char *sink) {
+    if (sink == NULL || strcmp(sink, "null") == 0) {
+        D.sink = SINK_NULL;
+    } else if (strcmp(sink, "hash") == 0) {
+        D.sink = SINK_HASH;
+        D.hash = 14695981039346656037ULL;
+    } else {
+        D.sink = SINK_FILE;
+        D.fd = open(sink, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (D.fd == -1) {
+            fprintf(stderr, "%s: %s\n", sink, strerror(errno));
+            exit(1);
+        }
+    }
+}
+
+// Everything that would go to the terminal comes through here
+void screen_write(const char *s, size_t len) {
+    if (!D.enabled) {
+        write(STDOUT_FILENO, s, len);
+        return;
+    }
+    D.steps[D.step].bytes += len;
+    if (D.sink == SINK_HASH)
+        D.hash = fnv1a(D.hash, s, len);
+    else if (D.sink == SINK_FILE && write(D.fd, s, len) != (ssize_t)len)
+        die("write");
+}
+
+// Called when exiting: the steps run so far, with their times
+void headless_report() {
+    if (D.step < D.nsteps && D.steps[D.step].ms == 0)
+        D.steps[D.step].ms = headless_now() - D.started;
+
+    struct script_step total = { 0 };
+    printf("%5s %8s %12s %12s %7s %12s  %s\n",
+           "step", "keys", "ms", "render ms", "frames", "bytes", "");
+    for (int j = 0; j <= D.step && j < D.nsteps; j++) {
+        struct script_step *st = &D.steps[j];
+        printf("%5d %8d %12.3f %12.3f %7d %12zu  %s\n", j, st->nkeys, st->ms,
+               st->render_ms, st->frames, st->bytes, st->line);
+        total.nkeys += st->nkeys;
+        total.ms += st->ms;
+        total.render_ms += st->render_ms;
+        total.frames += st->frames;
+        total.bytes += st->bytes;
+    }
+    printf("%5s %8d %12.3f %12.3f %7d %12zu\n", "total", total.nkeys, total.ms,
+           total.render_ms, total.frames, total.bytes);
+    if (D.sink == SINK_HASH)
+        printf("frames hash %016llx\n", (unsigned long long)D.hash);
+    if (D.sink == SINK_FILE)
+        close(D.fd);
+}
+
+/**
+ * The next key of the script. Asking for the key after a step's last one
+ * ends that step, so its time covers the keys and the frames drawn for
+ * them. Idle steps run in between; the editor exits after the last step.
+ */
+int headless_key() {
+    struct script_step *st = &D.steps[D.step];
+
+    while (D.pos == st->nkeys) {
+        double now = headless_now();
+        st->ms = now - D.started;
+        if (D.step + 1 == D.nsteps) exit(0);
+
+        st = &D.steps[++D.step];
+        D.pos = 0;
+        D.started = now;
+        for (int j = 0; j < st->idle; j++)
+            if (editor_idle()) refresh_screen();
+    }
+    return st->keys[D.pos++];
+}
+
+// Counts a frame refresh_screen() drew since started
+void headless_frame(double started) {
+    D.steps[D.step].frames++;
+    D.steps[D.step].render_ms += headless_now() - started;
+}
+
 /*** syntax highlight ***/
 int is_separator(int c) {
     return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-void update_syntax_highlight(editor_row *row) {
+/**
+ * Highlights one row, starting from the comment state the previous row
+ * ended in. Returns 1 if the state this row ends in changed, which means
+ * the next row has to be highlighted again as well.
+ */
+int highlight_row(editor_row *row) {
+    // The caches of an evicted row are gone (see buffer_evict), rebuild them
+    if (row->render == NULL)
+        row_render(row);
+
     row->highlight = realloc(row->highlight, row->rsize);
     memset(row->highlight, HL_NORMAL, row->rsize);
 
-    if (E.syntax == NULL) return;
+    if (E.syntax == NULL) {
+        brackets_count(row);
+        return 0;
+    }
 
     char **keywords = E.syntax->keywords;
 
@@ -448,9 +1021,35 @@ void update_syntax_highlight(editor_row *row) {
      */
     int changed = (row->hl_open_comment != in_comment);
     row->hl_open_comment = in_comment;
-    if (changed && row->index + 1 < E.numrows) {
-        update_syntax_highlight(&E.row[row->index + 1]);
-    }
+    brackets_count(row);
+    return changed;
+}
+
+// Highlights a row and the rows after it for as long as the comment state changes
+void update_syntax_highlight(editor_row *row) {
+    while (highlight_row(row) && row->index + 1 < E.numrows)
+        row = &E.row[row->index + 1];
+}
+
+/**
+ * Bulk commands don't highlight the rows they change, they mark them with
+ * highlight_stale() and draw_rows() calls highlight_catch_up() for the rows
+ * it is about to show. Rows after the screen stay stale until scrolled to.
+ */
+void highlight_stale(int from) {
+    if (from < E.hl_stale) E.hl_stale = from;
+}
+
+void highlight_catch_up(int to) {
+    if (to > E.numrows) to = E.numrows;
+    if (E.hl_stale >= to) return;
+
+    // without syntax rules rows don't depend on each other, and rows
+    // that lost their render are rebuilt by draw_rows() anyway
+    if (E.syntax != NULL)
+        for (int j = E.hl_stale; j < to; j++)
+            highlight_row(&E.row[j]);
+    E.hl_stale = (to < E.numrows) ? to : INT_MAX;
 }
 
 /** returns the color code(foreground), reference:
@@ -485,9 +1084,10 @@ void select_highlight() {
                 (!is_type && strstr(E.filename, s->filematch[i]))) {
                 E.syntax = s;
 
+                // One pass from the top, each row sees the final state of the one before
                 int fileditor_row ;
                 for (fileditor_row = 0; fileditor_row < E.numrows; fileditor_row++) {
-                    update_syntax_highlight(&E.row[fileditor_row]);
+                    highlight_row(&E.row[fileditor_row]);
                 }
 
                 return;
@@ -497,664 +1097,6224 @@ void select_highlight() {
     }
 }
 
-/*** row operations ***/
+/*** Brackets ***/
 
-int row_cx_to_rx(editor_row *row, int cx) {
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t')
-            rx += (CCODE_TAB_STOP - 1) - (rx % CCODE_TAB_STOP);
-        rx++;
-    }
-    return rx;
+/**
+ * Every row keeps a summary of its brackets (the ones the lexer left as
+ * code, not strings or comments): how much it changes the nesting depth,
+ * and how low the depth dips reading it forwards (min) and backwards
+ * (rmin). A segment tree over those summaries finds the row where a
+ * bracket's partner is in O(log n); only that row and the bracket's own
+ * are scanned. highlight_row() refreshes a row's summary and its leaf,
+ * anything that moves rows around drops the leaves from the first row it
+ * moved (brackets_drop()) and the next query rebuilds only those, with
+ * the nodes above them. Rows below a bulk change may still be waiting for
+ * their highlight (see highlight_stale()): a query catches up the rows it
+ * actually read and looks again, so a bracket near the cursor never costs
+ * highlighting the rest of the file.
+ */
+int bracket_is_code(editor_row *row, int rx) {
+    unsigned char hl = row->highlight ? row->highlight[rx] : HL_NORMAL;
+    return hl == HL_NORMAL || hl == HL_FIND;
 }
 
-// Convert the render index into a chars index
-int row_rx_to_cx(editor_row *row, int rx) {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t')
-            cur_rx += (CCODE_TAB_STOP - 1) - (cur_rx % CCODE_TAB_STOP);
-        cur_rx++;
+int bracket_dir(char c) {
+    if (c == '(' || c == '[' || c == '{') return 1;
+    if (c == ')' || c == ']' || c == '}') return -1;
+    return 0;
+}
 
-        if (cur_rx > rx) return cx;
-    }
-    return cx;
+struct bracket_sum bracket_join(struct bracket_sum a, struct bracket_sum b) {
+    struct bracket_sum s;
+    s.delta = a.delta + b.delta;
+    s.min = (a.delta + b.min < a.min) ? a.delta + b.min : a.min;
+    s.rmin = (a.rmin - b.delta < b.rmin) ? a.rmin - b.delta : b.rmin;
+    return s;
 }
 
-void update_row(editor_row *row) {
-    int tabs = 0;
-    int j;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            tabs++;
-        }
-    }
+// Updates the tree leaf of row `at` and the nodes above it
+void brackets_set(int at, struct bracket_sum sum) {
+    int node = E.br_cap + at;
+    E.br_tree[node] = sum;
+    for (node /= 2; node >= 1; node /= 2)
+        E.br_tree[node] = bracket_join(E.br_tree[2 * node], E.br_tree[2 * node + 1]);
+}
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(CCODE_TAB_STOP - 1) + 1);
+// Called by highlight_row() once render and highlight are up to date
+void brackets_count(editor_row *row) {
+    struct bracket_sum sum = { 0, 0, 0 };
+    int depth = 0;
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % CCODE_TAB_STOP != 0) row->render[idx++] = ' ';
-        } else {
-            row->render[idx++] = row->chars[j];
-        }
+    for (int i = 0; i < row->rsize; i++) {
+        int d = bracket_dir(row->render[i]);
+        if (d == 0 || !bracket_is_code(row, i)) continue;
+        depth += d;
+        if (depth < sum.min) sum.min = depth;
+    }
+    sum.delta = depth;
+    // reading backwards, closing brackets go up and opening ones down
+    depth = 0;
+    for (int i = row->rsize - 1; i >= 0; i--) {
+        int d = bracket_dir(row->render[i]);
+        if (d == 0 || !bracket_is_code(row, i)) continue;
+        depth -= d;
+        if (depth < sum.rmin) sum.rmin = depth;
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
 
-    update_syntax_highlight(row);
+    int changed = !row->br_known || memcmp(&sum, &row->br, sizeof(sum)) != 0;
+    row->br = sum;
+    row->br_known = 1;
+    E.br_gen++;
+    if (changed && row->index < E.br_valid && row == &E.row[row->index])
+        brackets_set(row->index, sum);
 }
 
-void insert_row(int at, char *s, size_t len) {
-    if (at < 0 || at > E.numrows) return;
+// Rows from `from` on moved or changed: their leaves are rebuilt on next use
+void brackets_drop(int from) {
+    if (from < E.br_valid) E.br_valid = from < 0 ? 0 : from;
+}
 
-    E.row = realloc(E.row, sizeof(editor_row) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(editor_row) * (E.numrows - at));
-    for (int j = at + 1; j <= E.numrows; j++) {
-        E.row[j].index++;
+void brackets_build() {
+    int cap = 1;
+    while (cap < E.numrows) cap *= 2;
+    if (cap != E.br_cap) {
+        if (cap > E.br_cap) {
+            free(E.br_tree);
+            E.br_tree = malloc(sizeof(struct bracket_sum) * 2 * cap);
+        }
+        E.br_cap = cap;
+        E.br_valid = 0; // another shape, every node moves
     }
+    if (E.br_valid >= E.numrows && E.br_valid > 0) return;
 
-    E.row[at].index = at;
-
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+    for (int j = E.br_valid; j < cap; j++) {
+        struct bracket_sum none = { 0, 0, 0 };
+        if (j < E.numrows && !E.row[j].br_known)
+            highlight_row(&E.row[j]);
+        E.br_tree[cap + j] = (j < E.numrows) ? E.row[j].br : none;
+    }
+    // the nodes above the rebuilt leaves, one level at a time
+    for (int lo = (cap + E.br_valid) / 2, hi = cap - 1; hi >= 1; lo /= 2, hi /= 2)
+        for (int node = lo; node <= hi; node++)
+            E.br_tree[node] = bracket_join(E.br_tree[2 * node], E.br_tree[2 * node + 1]);
+    E.br_valid = E.numrows;
+}
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].highlight = NULL;
-    E.row[at].hl_open_comment = 0;
-    update_row(&E.row[at]);
+/**
+ * The first row at or after `from` in which the depth, starting at `depth`
+ * before `from`, drops to 0. Returns -1 if there is none.
+ */
+int brackets_find_forward(int node, int lo, int hi, int from, int *depth) {
+    if (hi <= from) return -1;
+    if (lo >= from && *depth + E.br_tree[node].min > 0) {
+        *depth += E.br_tree[node].delta;
+        return -1;
+    }
+    if (hi - lo == 1) return lo;
 
-    E.numrows++;
-    E.dirty++;
+    int mid = (lo + hi) / 2;
+    int found = brackets_find_forward(2 * node, lo, mid, from, depth);
+    return found != -1 ? found : brackets_find_forward(2 * node + 1, mid, hi, from, depth);
 }
 
-void free_row(editor_row *row) {
-    free(row->render);
-    free(row->chars);
-    free(row->highlight);
+// Like brackets_find_forward(), but reading rows from `from` back to row 0
+int brackets_find_backward(int node, int lo, int hi, int from, int *depth) {
+    if (lo > from) return -1;
+    if (hi - 1 <= from && *depth + E.br_tree[node].rmin > 0) {
+        *depth -= E.br_tree[node].delta;
+        return -1;
+    }
+    if (hi - lo == 1) return lo;
+
+    int mid = (lo + hi) / 2;
+    int found = brackets_find_backward(2 * node + 1, mid, hi, from, depth);
+    return found != -1 ? found : brackets_find_backward(2 * node, lo, mid, from, depth);
 }
 
 /**
- * Deletes a row at the specified index.
- * First we validate the at index. Then we free the memory owned by the row
- * using free_row(). We then use memmove() to overwrite the deleted row
- * struct with the rest of the rows that come after it, and decrement numrows.
- * Finally, we increment E.dirty.
- *
- * @param int at The index of the row to delete.
+ * Scans the render of row from rx in direction dir (1 or -1) with the
+ * given depth until a bracket brings it to 0. Returns that rx, or -1.
  */
-void delete_row(int at) {
-    if (at < 0 || at >= E.numrows) return;
+int brackets_scan(editor_row *row, int rx, int dir, int *depth) {
+    if (row->render == NULL || row->highlight == NULL)
+        highlight_row(row);
+    for (; rx >= 0 && rx < row->rsize; rx += dir) {
+        int d = bracket_dir(row->render[rx]);
+        if (d == 0 || !bracket_is_code(row, rx)) continue;
+        *depth += (d == dir) ? 1 : -1;
+        if (*depth == 0) return rx;
+    }
+    return -1;
+}
 
-    free_row(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(editor_row) * (E.numrows - at - 1));
+/**
+ * Finds the bracket that closes the depth-1 block entered just before
+ * (y, rx) reading in direction dir: the partner of a bracket when rx is
+ * next to it, the enclosing block's bracket otherwise.
+ */
+int brackets_search(int y, int rx, int dir, int *my, int *mrx) {
+    if (y < 0 || y >= E.numrows) return 0;
+
+    int depth = 1;
+    int found = brackets_scan(&E.row[y], rx, dir, &depth);
+    if (found != -1) {
+        *my = y;
+        *mrx = found;
+        return 1;
+    }
 
-    for (int j = at; j < E.numrows - 1; j++) {
-        E.row[j].index--;
+    int at, start = depth;
+    for (;;) {
+        brackets_build();
+        depth = start;
+        at = (dir > 0)
+            ? brackets_find_forward(1, 0, E.br_cap, y + 1, &depth)
+            : brackets_find_backward(1, 0, E.br_cap, y - 1, &depth);
+        if (at >= E.numrows) at = -1;
+        // rows up to the last one read must have their final highlight
+        int to = (at == -1 && dir > 0) ? E.numrows : (at > y ? at : y) + 1;
+        if (E.hl_stale >= to) break;
+        highlight_catch_up(to);
     }
+    if (at == -1) return 0;
+    editor_row *row = &E.row[at];
+    found = brackets_scan(row, dir > 0 ? 0 : row->rsize - 1, dir, &depth);
+    if (found == -1) return 0;
+    *my = at;
+    *mrx = found;
+    return 1;
+}
 
-    E.numrows--;
-    E.dirty++;
+// If (y, rx) holds a bracket of code, finds its partner
+int bracket_partner(int y, int rx, int *my, int *mrx) {
+    if (y >= E.numrows) return 0;
+
+    editor_row *row = &E.row[y];
+    if (row->render == NULL || row->highlight == NULL)
+        highlight_row(row);
+    if (rx >= row->rsize || !bracket_is_code(row, rx)) return 0;
+
+    int dir = bracket_dir(row->render[rx]);
+    return dir != 0 && brackets_search(y, rx + dir, dir, my, mrx);
 }
 
 /**
- * Inserts a character into a row at the specified position.
- *
- * This function uses memmove() to safely handle overlapping source and
- * destination arrays. It validates the insertion index, allowing insertion
- * at the end of the string, then allocates additional memory for the
- * character and the null terminator, shifts existing chars to make
- * room for the new char, and updates the row size. Finally, it assigns
- * the character to the specified position and updates the row's render and
- * size fields.
- *
- * @param editor_row The row where the character will be inserted.
- * @param at The index at which to insert the character.
- * @param c The character to be inserted.
+ * The pair draw_rows() shows for the cursor. It is looked up again only
+ * when the cursor moves, a row is highlighted (every edit does that) or
+ * rows move, not on every frame.
  */
-void insert_char_in_row(editor_row *row, int at, int c) {
-    if (at < 0 || at > row->size)
-        at = row->size;
-
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    update_row(row);
-    E.dirty++;
+int bracket_pair(int *y1, int *rx1, int *y2, int *rx2) {
+    if (E.cursor_y >= E.numrows) return 0;
+
+    int rx = row_cx_to_rx(&E.row[E.cursor_y], E.cursor_x);
+    if (E.br_pair.y != E.cursor_y || E.br_pair.rx != rx ||
+        E.br_pair.gen != E.br_gen || E.br_valid < E.numrows) {
+        E.br_pair.found = bracket_partner(E.cursor_y, rx, &E.br_pair.my, &E.br_pair.mrx);
+        E.br_pair.y = E.cursor_y;
+        E.br_pair.rx = rx;
+        E.br_pair.gen = E.br_gen;
+    }
+    if (!E.br_pair.found) return 0;
+    *y1 = E.br_pair.y;
+    *rx1 = E.br_pair.rx;
+    *y2 = E.br_pair.my;
+    *rx2 = E.br_pair.mrx;
+    return 1;
 }
 
 /**
- * Appends a string to a row.
- *
- * This function reallocates memory for the row's chars field, copying the
- * specified string to the end of the row's existing chars, updating the
- * row's size, and adding a null terminator. It then updates the row's
- * render and size fields and increments dirty flag.
- *
- * @param row The row to which the string will be appended.
- * @param s The string to append.
- * @param len The length of the string to append.
+ * ^J: jumps to the bracket matching the one under the cursor, or to the
+ * opening bracket of the block the cursor is in.
  */
-void row_add_string(editor_row *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-
-    row->size += len;
-    row->chars[row->size] = '\0';
+void bracket_jump() {
+    if (E.cursor_y >= E.numrows) return;
 
-    update_row(row);
-    E.dirty++;
+    editor_row *row = &E.row[E.cursor_y];
+    int rx = row_cx_to_rx(row, E.cursor_x), y, mrx;
+    if (!bracket_partner(E.cursor_y, rx, &y, &mrx) &&
+        !brackets_search(E.cursor_y, rx - 1, -1, &y, &mrx)) {
+        set_prompt_message("No matching bracket");
+        return;
+    }
+    E.cursor_y = y;
+    E.cursor_x = row_rx_to_cx(&E.row[y], mrx);
 }
 
+/*** Folding ***/
+
 /**
- * Deletes a character from a row at the specified position.
- *
- * This function validates the deletion index, allowing deletion at the
- * end of the string, then uses memmove() to safely handle overlapping
- * source and destination arrays. It shifts existing chars to overwrite
- * the deleted char, decrements the row size, and updates the row's render
- * and size fields.
+ * A closed fold is stored in the row it starts on: row->fold is how many
+ * rows after it are hidden. Folds may nest. A segment tree over the rows
+ * counts how many closed folds cover each of them (range adds, no
+ * push-down) and keeps the minimum cover and how many rows have it, so
+ * the number of visible rows in any subtree is known without visiting
+ * it. Moving between visible rows, which is all scrolling, drawing and
+ * cursor movement need, is then O(log n) however much is folded.
  *
- * @param row The row from which to delete the character.
- * @param at The index of the character to delete.
+ * Like the bracket tree it is dropped when rows move (E.fold_built = 0)
+ * and rebuilt from the rows' fold fields in O(n) on next use. Without any
+ * folds (E.folded == 0) there is no tree and every row is visible.
  */
-void row_delete_char(editor_row *row, int at) {
-    if (at < 0 || at >= row->size) return;
+struct fold_node {
+    int add; // closed folds covering all of this node's rows
+    int min; // least cover of a row in this node, counting add
+    int cnt; // rows with that cover
+};
 
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    update_row(row);
-    E.dirty++;
+void fold_pull(int node) {
+    struct fold_node *t = E.fold_tree, *l = &t[2 * node], *r = &t[2 * node + 1];
+    int min = l->min < r->min ? l->min : r->min;
+    t[node].cnt = (l->min == min ? l->cnt : 0) + (r->min == min ? r->cnt : 0);
+    t[node].min = min + t[node].add;
 }
 
-/*** editor operations ***/
+// Visible rows under node, given the folds covering all of it from above
+int fold_count(int node, int above) {
+    return (above + E.fold_tree[node].min == 0) ? E.fold_tree[node].cnt : 0;
+}
 
-void undo_operation() {
-    if (undo_len == 0) return;
+// Adds v to the cover of rows [from, to)
+void fold_cover(int node, int lo, int hi, int from, int to, int v) {
+    if (to <= lo || hi <= from) return;
+    if (from <= lo && hi <= to) {
+        E.fold_tree[node].add += v;
+        E.fold_tree[node].min += v;
+        return;
+    }
+    int mid = (lo + hi) / 2;
+    fold_cover(2 * node, lo, mid, from, to, v);
+    fold_cover(2 * node + 1, mid, hi, from, to, v);
+    fold_pull(node);
+}
 
-    undo_t op = undo_stack[--undo_len];
-    redo_stack[redo_len++] = op;
+void folds_build() {
+    if (E.fold_built || !E.folded) return;
 
-    E.cursor_x = op.x;
-    E.cursor_y = op.y;
+    int cap = 1;
+    while (cap < E.numrows) cap *= 2;
+    if (cap > E.fold_cap) {
+        free(E.fold_tree);
+        E.fold_tree = malloc(sizeof(struct fold_node) * 2 * cap);
+    }
+    E.fold_cap = cap;
+
+    // the cover of each row from a running sum over where folds start and end
+    int *delta = calloc(cap + 1, sizeof(int));
+    int folds = 0;
+    for (int j = 0; j < E.numrows; j++) {
+        int n = E.row[j].fold;
+        if (n <= 0) continue;
+        if (n > E.numrows - 1 - j) n = E.row[j].fold = E.numrows - 1 - j;
+        delta[j + 1]++;
+        delta[j + 1 + n]--;
+        folds++;
+    }
+    int cover = 0;
+    for (int j = 0; j < cap; j++) {
+        cover += delta[j];
+        // padding past the last row counts as hidden
+        int c = (j < E.numrows) ? cover : 1;
+        E.fold_tree[cap + j] = (struct fold_node){ c, c, 1 };
+    }
+    free(delta);
+    for (int node = cap - 1; node >= 1; node--) {
+        E.fold_tree[node].add = 0;
+        fold_pull(node);
+    }
+    E.folded = folds > 0;
+    E.fold_built = E.folded;
+}
 
-    switch (op.type) {
-        case UNDO_INSERT:
-            for (int i = 0; i < op.len; i++) {
-                if (E.cursor_y == E.numrows)
-                    insert_row(E.numrows, "", 0);
-                insert_char_in_row(&E.row[E.cursor_y], E.cursor_x + i, op.text[i]);
-            }
-            E.cursor_x += op.len;
-            break;
+// How many visible rows come before row y
+int fold_rank(int y) {
+    folds_build();
+    if (!E.folded) return y;
+    if (y >= E.fold_cap) return fold_count(1, 0);
+
+    int node = 1, lo = 0, hi = E.fold_cap, above = 0, rank = 0;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        above += E.fold_tree[node].add;
+        if (y >= mid) {
+            rank += fold_count(2 * node, above);
+            node = 2 * node + 1;
+            lo = mid;
+        } else {
+            node = 2 * node;
+            hi = mid;
+        }
+    }
+    return rank;
+}
 
-        case UNDO_DELETE:
-            for (int i = 0; i < op.len; i++) {
-                row_delete_char(&E.row[E.cursor_y], E.cursor_x);
-            }
-            break;
+// The k-th visible row (from 0), or E.numrows if there are fewer
+int fold_row(int k) {
+    folds_build();
+    if (k < 0) k = 0;
+    if (!E.folded) return k < E.numrows ? k : E.numrows;
+    if (k >= fold_count(1, 0)) return E.numrows;
+
+    int node = 1, lo = 0, hi = E.fold_cap, above = 0;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        above += E.fold_tree[node].add;
+        int left = fold_count(2 * node, above);
+        if (k < left) {
+            node = 2 * node;
+            hi = mid;
+        } else {
+            k -= left;
+            node = 2 * node + 1;
+            lo = mid;
+        }
+    }
+    return lo;
+}
 
-        default:
-            break;
+int fold_hidden(int y) {
+    folds_build();
+    if (!E.folded || y >= E.numrows) return 0;
+
+    int node = 1, lo = 0, hi = E.fold_cap, cover = 0;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        cover += E.fold_tree[node].add;
+        if (y >= mid) {
+            node = 2 * node + 1;
+            lo = mid;
+        } else {
+            node = 2 * node;
+            hi = mid;
+        }
     }
+    return cover + E.fold_tree[node].add > 0;
 }
 
-void redo_operation() {
-    if (redo_len == 0) return;
+// The visible row n visible rows away from y, kept inside the buffer
+int fold_step(int y, int n) {
+    int k = fold_rank(y) + n;
+    int last = fold_rank(E.numrows) - 1;
+    if (k > last) k = last;
+    return fold_row(k < 0 ? 0 : k);
+}
+
+// Closes a fold of n rows after y, or opens the one there when n is 0
+void fold_set(int y, int n) {
+    if (y < 0 || y >= E.numrows) return;
+    if (n > E.numrows - 1 - y) n = E.numrows - 1 - y;
+
+    folds_build();
+    int old = E.row[y].fold;
+    E.row[y].fold = n;
+    if (!E.fold_built) {
+        E.folded = n > 0;
+        return; // built with the new fold on first use
+    }
+    if (old > 0)
+        fold_cover(1, 0, E.fold_cap, y + 1, y + 1 + old, -1);
+    if (n > 0)
+        fold_cover(1, 0, E.fold_cap, y + 1, y + 1 + n, 1);
+}
 
-    undo_t op = redo_stack[--redo_len];
-    undo_stack[undo_len++] = op;
+// Opens every fold that hides row y
+void fold_reveal(int y) {
+    for (int j = y - 1; j >= 0 && fold_hidden(y); j--)
+        if (E.row[j].fold > 0 && j + E.row[j].fold >= y)
+            fold_set(j, 0);
+}
 
-    E.cursor_x = op.x;
-    E.cursor_y = op.y;
+int row_indent(editor_row *row) {
+    int indent = 0;
+    for (int j = 0; j < row->size; j++) {
+        if (row->chars[j] == ' ') indent++;
+        else if (row->chars[j] == '\t') indent += CCODE_TAB_STOP - indent % CCODE_TAB_STOP;
+        else return indent;
+    }
+    return -1; // blank
+}
 
-    switch (op.type) {
-        case UNDO_DELETE:
-            for (int i = 0; i < op.len; i++) {
-                if (E.cursor_y == E.numrows)
-                    insert_row(E.numrows, "", 0);
-                insert_char_in_row(&E.row[E.cursor_y], E.cursor_x + i, op.text ? op.text[i] : '?');
+// Rows after y that are indented deeper than y, up to the last non-blank one
+int fold_indent_len(int y) {
+    int indent = row_indent(&E.row[y]), last = y;
+    if (indent < 0) return 0;
+    for (int j = y + 1; j < E.numrows; j++) {
+        int d = row_indent(&E.row[j]);
+        if (d < 0) continue;
+        if (d <= indent) break;
+        last = j;
+    }
+    return last - y;
+}
+
+// Rows between y and the line closing the first bracket y leaves open
+int fold_brace_len(int y) {
+    editor_row *row = &E.row[y];
+    brackets_build();
+    for (int rx = 0; rx < row->rsize; rx++) {
+        int my, mrx;
+        if (bracket_dir(row->render[rx]) == 1 && bracket_is_code(row, rx) &&
+            brackets_search(y, rx + 1, 1, &my, &mrx) && my > y + 1)
+            return my - y - 1;
+    }
+    return 0;
+}
+
+/**
+ * ^A: opens the fold at the cursor, or folds the block the line opens:
+ * up to the line with its closing bracket, or else the lines indented
+ * deeper than it.
+ */
+void fold_toggle() {
+    int y = E.cursor_y;
+    if (y >= E.numrows) return;
+
+    if (E.row[y].fold > 0) {
+        fold_set(y, 0);
+        return;
+    }
+    int n = fold_brace_len(y);
+    if (n == 0) n = fold_indent_len(y);
+    if (n == 0) {
+        set_prompt_message("Nothing to fold here");
+        return;
+    }
+    fold_set(y, n);
+}
+
+/**
+ * Closes a fold on every line that opens a block, nested ones included:
+ * by brackets in one pass with a stack, or by indentation.
+ */
+void fold_all(int by_indent) {
+    int *stack = malloc(sizeof(int) * 64), cap = 64, depth = 0;
+    int *indents = by_indent ? malloc(sizeof(int) * 64) : NULL;
+    int last = -1;
+
+    if (!by_indent) highlight_catch_up(E.numrows);
+    for (int y = 0; y < E.numrows; y++) {
+        editor_row *row = &E.row[y];
+        if (by_indent) {
+            int indent = row_indent(row);
+            if (indent < 0) continue;
+            while (depth > 0 && indents[depth - 1] >= indent) {
+                int s = stack[--depth];
+                if (last > s) E.row[s].fold = last - s;
             }
-            E.cursor_x += op.len;
-            break;
+            if (depth == cap) {
+                cap *= 2;
+                stack = realloc(stack, sizeof(int) * cap);
+                indents = realloc(indents, sizeof(int) * cap);
+            }
+            indents[depth] = indent;
+            stack[depth++] = y;
+            last = y;
+            continue;
+        }
 
-        case UNDO_INSERT:
-            for (int i = 0; i < op.len; i++) {
-                row_delete_char(&E.row[E.cursor_y], E.cursor_x);
+        if (row->render == NULL) row_render(row);
+        for (int rx = 0; rx < row->rsize; rx++) {
+            int d = bracket_dir(row->render[rx]);
+            if (d == 0 || !bracket_is_code(row, rx)) continue;
+            if (d == 1) {
+                if (depth == cap) stack = realloc(stack, sizeof(int) * (cap *= 2));
+                stack[depth++] = y;
+            } else if (depth > 0) {
+                int s = stack[--depth];
+                if (y - s - 1 > E.row[s].fold) E.row[s].fold = y - s - 1;
             }
-            break;
+        }
+    }
+    while (by_indent && depth > 0) {
+        int s = stack[--depth];
+        if (last > s) E.row[s].fold = last - s;
+    }
+    free(stack);
+    free(indents);
 
-        default:
-            break;
+    E.folded = 1;
+    E.fold_built = 0;
+    if (fold_rank(E.numrows) == E.numrows)
+        set_prompt_message("Nothing to fold");
+}
+
+void unfold_all() {
+    for (int j = 0; j < E.numrows; j++)
+        E.row[j].fold = 0;
+    E.folded = 0;
+    E.fold_built = 0;
+}
+
+/*** Completion ***/
+
+/**
+ * ^Space completes the word before the cursor from the words of the open
+ * buffers. Each buffer keeps them in a trie with a count per word, and
+ * every row knows whether its words are in it. An edit takes a row's
+ * words out while its old text is still there (row_own(), stats_add())
+ * and puts them back when the row is updated (update_row()), so a
+ * keystroke costs one pass over one row. Rows that arrive or change in
+ * bulk, a load, a big paste or a :s, are added by words_idle() while no
+ * key is pressed (stats_add(), words_lines()).
+ */
+#define WORD_MIN 3          // shorter words aren't worth completing
+#define WORD_MAX 64
+#define WORDS_EAGER 64      // rows added at once, more wait for words_idle()
+#define WORDS_SLICE_MS 20   // time words_idle() takes at most
+#define COMPLETE_MAX 32     // completions ^Space cycles through
+
+struct word_node {
+    int child;      // first child, 0 for none
+    int next;       // next sibling, siblings are sorted by ch
+    int count;      // occurrences of the word ending here
+    int below;      // occurrences of the words in this subtree
+    unsigned char ch;
+};
+
+int word_char(int c) {
+    return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+int word_node_new(unsigned char ch, int next) {
+    if (E.word_count == E.word_cap) {
+        E.word_cap = E.word_cap ? E.word_cap * 2 : 1024;
+        E.word_nodes = realloc(E.word_nodes, sizeof(struct word_node) * E.word_cap);
     }
+    E.word_nodes[E.word_count] = (struct word_node){ 0, next, 0, 0, ch };
+    return E.word_count++;
 }
 
-void insert_char(int c) {
-    if(E.cursor_y == E.numrows)
-        insert_row(E.numrows, "", 0);
+// Adds count occurrences of word to the trie, a negative count takes them out
+void words_add(const char *word, int len, int count) {
+    if (E.word_count == 0) word_node_new(0, 0); // the root
+
+    int node = 0;
+    E.word_nodes[0].below += count;
+    for (int j = 0; j < len; j++) {
+        unsigned char c = word[j];
+        int prev = 0, cur = E.word_nodes[node].child;
+        while (cur && E.word_nodes[cur].ch < c) {
+            prev = cur;
+            cur = E.word_nodes[cur].next;
+        }
+        if (cur == 0 || E.word_nodes[cur].ch != c) {
+            int fresh = word_node_new(c, cur);
+            if (prev) E.word_nodes[prev].next = fresh;
+            else E.word_nodes[node].child = fresh;
+            cur = fresh;
+        }
+        E.word_nodes[cur].below += count;
+        node = cur;
+    }
+    E.word_nodes[node].count += count;
+}
 
-    char *copy = malloc(2);
-    copy[0] = c;
-    copy[1] = '\0';
+// Adds (sign 1) or takes out (-1) the words of a row
+void words_row(editor_row *row, int sign) {
+    if (row->in_words == (sign > 0)) return;
+    for (int j = 0; j < row->size;) {
+        if (!word_char((unsigned char)row->chars[j])) {
+            j++;
+            continue;
+        }
+        int start = j;
+        while (j < row->size && word_char((unsigned char)row->chars[j])) j++;
+        if (j - start >= WORD_MIN && j - start <= WORD_MAX && !isdigit((unsigned char)row->chars[start]))
+            words_add(&row->chars[start], j - start, sign);
+    }
+    row->in_words = (sign > 0);
+}
 
-    // UNDO for insert: we store DELETE at current position
-    if (undo_len < MAX_UNDO) {
-        undo_stack[undo_len++] = (undo_t){ UNDO_DELETE, E.cursor_x, E.cursor_y, copy, 1 };
-        redo_len = 0;
+// Adds the rows that aren't in the trie yet, for at most WORDS_SLICE_MS unless all is set
+void words_sweep(int all) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (E.word_next < E.numrows) {
+        words_row(&E.row[E.word_next++], 1);
+        if (!all && (E.word_next & 4095) == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 >= WORDS_SLICE_MS)
+                break;
+        }
     }
+}
 
-    insert_char_in_row(&E.row[E.cursor_y], E.cursor_x, c);
-    E.cursor_x++;
+void words_idle() {
+    if (E.word_next < E.numrows) words_sweep(0);
 }
 
-void insert_new_line() {
-    if (E.cursor_x == 0) {
-        insert_row(E.cursor_y, "", 0);
-    } else {
-        editor_row *row = &E.row[E.cursor_y];
-        insert_row(E.cursor_y + 1, &row->chars[E.cursor_x], row->size - E.cursor_x);
-        row = &E.row[E.cursor_y];
-        row->size = E.cursor_x;
-        row->chars = realloc(row->chars, row->size + 1);
-        row->chars[row->size] = '\0';
-        update_row(row);
+// Puts back the words of the rows at the sorted indexes in lines, many of them later
+void words_lines(int *lines, int n) {
+    if (n > WORDS_EAGER) {
+        if (lines[0] < E.word_next) E.word_next = lines[0];
+        return;
     }
-    E.cursor_y++;
-    E.cursor_x = 0;
+    for (int k = 0; k < n; k++)
+        words_row(&E.row[lines[k]], 1);
 }
 
 /**
- * Deletes a character to the left of the cursor.
- *
- * If the cursor’s past the end of the file, then there is nothing to delete,
- * and we return immediately. Otherwise, we get the editor_row the cursor is on,
- * and if there is a character to the left of the cursor, we delete it and
- * move the cursor one to the left.
+ * Appends to out the words in the subtree of node that are longer than
+ * the len chars already in word, in order, until out holds COMPLETE_MAX.
+ * Words already in out (from another buffer) are skipped.
  */
-void delete_char() {
-    if (E.cursor_y == E.numrows) return;
-    if(E.cursor_x == 0 && E.cursor_y == 0) return;
+void words_collect(struct word_node *nodes, int node, char *word, int len, int plen,
+                   char (*out)[WORD_MAX + 1], int *n) {
+    if (nodes[node].count > 0 && len > plen) {
+        word[len] = '\0';
+        int k = 0;
+        while (k < *n && strcmp(out[k], word) != 0) k++;
+        if (k == *n) strcpy(out[(*n)++], word);
+    }
+    if (len == WORD_MAX) return;
+    for (int c = nodes[node].child; c && *n < COMPLETE_MAX; c = nodes[c].next) {
+        if (nodes[c].below <= 0) continue;
+        word[len] = nodes[c].ch;
+        words_collect(nodes, c, word, len + 1, plen, out, n);
+    }
+}
 
-    editor_row *row = &E.row[E.cursor_y];
-    if (E.cursor_x > 0) {
-        // store deleted character
-        char deleted = row->chars[E.cursor_x - 1];
-        char *copy = malloc(2);
-        copy[0] = deleted;
-        copy[1] = '\0';
+// Completions of prefix from the trie of one buffer
+void words_complete(struct word_node *nodes, int count, const char *prefix, int plen,
+                    char (*out)[WORD_MAX + 1], int *n) {
+    if (count == 0) return;
+    int node = 0;
+    for (int j = 0; j < plen && node != -1; j++) {
+        int c = nodes[node].child;
+        while (c && nodes[c].ch < (unsigned char)prefix[j]) c = nodes[c].next;
+        node = (c && nodes[c].ch == (unsigned char)prefix[j]) ? c : -1;
+    }
+    if (node == -1) return;
+
+    char word[WORD_MAX + 1];
+    memcpy(word, prefix, plen);
+    words_collect(nodes, node, word, plen, plen, out, n);
+}
+
+/*** Statistics ***/
 
-        if (undo_len < MAX_UNDO) {
-            undo_stack[undo_len++] = (undo_t){ UNDO_INSERT, E.cursor_x - 1, E.cursor_y, copy, 1 };
-            redo_len = 0;
+/**
+ * Every row keeps its byte, character and word counts, and E.stats the
+ * totals, adjusted by whatever adds, removes or edits rows: the status
+ * bar reads them at no cost however big the file is. Counts over a
+ * range of rows, for the selection, come from a Fenwick tree over the
+ * rows' counts, kept up to date by edits within a row and rebuilt in
+ * O(n), from the stored counts, after rows move. Bytes and characters
+ * include the newline, like wc.
+ */
+int row_in_buffer(editor_row *row) {
+    return row->index >= 0 && row->index < E.numrows && row == &E.row[row->index];
+}
+
+void text_count(const char *s, int len, struct text_stats *st) {
+    int words = 0, chars = 0, space = 1;
+    for (int j = 0; j < len; j++) {
+        unsigned char c = s[j];
+        if ((c & 0xc0) != 0x80) chars++; // not a UTF-8 continuation byte
+        int blank = isspace(c);
+        if (space && !blank) words++;
+        space = blank;
+    }
+    st->bytes = len;
+    st->chars = chars;
+    st->words = words;
+}
+
+/**
+ * 64-bit hash of a row's text, read a word at a time; the Diff section
+ * compares them. Never 0, which marks an added row (see Change marks).
+ */
+uint64_t line_hash(const char *s, size_t len) {
+    uint64_t h = len * 0x9e3779b97f4a7c15ULL, w;
+    size_t j = 0;
+
+    for (; j + 8 <= len; j += 8) {
+        memcpy(&w, s + j, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, s + j, len - j);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 29;
+    h *= 0xff51afd7ed558ccdULL;
+    return (h ^ (h >> 32)) | 1;
+}
+
+// Counts the chars of a row, leaving E.stats alone
+void row_count(editor_row *row) {
+    struct text_stats st;
+    text_count(row->chars, row->size, &st);
+    row->nbytes = st.bytes + 1;
+    row->nchars = st.chars + 1;
+    row->nwords = st.words;
+    row->hash = line_hash(row->chars, row->size);
+}
+
+/**
+ * Adds (sign 1) or takes away (-1) the counts of n rows from the totals.
+ * Their words go the same way, only many added rows are left to
+ * words_idle().
+ */
+void stats_add(editor_row *rows, int n, int sign) {
+    for (int j = 0; j < n; j++) {
+        E.stats.bytes += sign * rows[j].nbytes;
+        E.stats.chars += sign * rows[j].nchars;
+        E.stats.words += sign * rows[j].nwords;
+        if (sign < 0 || n <= WORDS_EAGER) words_row(&rows[j], sign);
+    }
+    if (sign > 0 && n > WORDS_EAGER) E.word_next = 0;
+}
+
+// Counts a row of the buffer again after its chars changed
+void row_recount(editor_row *row) {
+    E.stats_gen++;
+    struct text_stats d = { -row->nbytes, -row->nchars, -row->nwords };
+    row_count(row);
+    d.bytes += row->nbytes;
+    d.chars += row->nchars;
+    d.words += row->nwords;
+    E.stats.bytes += d.bytes;
+    E.stats.chars += d.chars;
+    E.stats.words += d.words;
+
+    if (!E.stats_built) return;
+    for (int i = row->index + 1; i <= E.numrows; i += i & -i) {
+        E.stats_tree[i].bytes += d.bytes;
+        E.stats_tree[i].chars += d.chars;
+        E.stats_tree[i].words += d.words;
+    }
+}
+
+void stats_build() {
+    if (E.stats_built) return;
+
+    E.stats_tree = realloc(E.stats_tree, sizeof(struct text_stats) * (E.numrows + 1));
+    memset(E.stats_tree, 0, sizeof(struct text_stats) * (E.numrows + 1));
+    for (int i = 1; i <= E.numrows; i++) {
+        struct text_stats *t = &E.stats_tree[i];
+        t->bytes += E.row[i - 1].nbytes;
+        t->chars += E.row[i - 1].nchars;
+        t->words += E.row[i - 1].nwords;
+        int up = i + (i & -i);
+        if (up <= E.numrows) {
+            E.stats_tree[up].bytes += t->bytes;
+            E.stats_tree[up].chars += t->chars;
+            E.stats_tree[up].words += t->words;
         }
-        row_delete_char(row, E.cursor_x - 1);
-        E.cursor_x--;
-    } else {
-        E.cursor_x = E.row[E.cursor_y - 1].size;
-        row_add_string(&E.row[E.cursor_y - 1], row->chars, row->size);
-        delete_row(E.cursor_y);
-        E.cursor_y--;
     }
+    E.stats_built = 1;
 }
 
+// Totals of rows [0, y)
+void stats_prefix(int y, struct text_stats *st) {
+    stats_build();
+    memset(st, 0, sizeof(*st));
+    for (int i = y; i > 0; i -= i & -i) {
+        st->bytes += E.stats_tree[i].bytes;
+        st->chars += E.stats_tree[i].chars;
+        st->words += E.stats_tree[i].words;
+    }
+}
 
-/*** file i/o ***/
+// Byte offset of column x of row y, in O(log n) once the tree is built
+long long row_offset(int y, int x) {
+    struct text_stats st;
+    stats_prefix(y, &st);
+    return st.bytes + x;
+}
 
 /**
- * Converts the rows of the editor into a single string.
- *
- * This function calculates the total length of a concatenated string
- * from multiple rows of text, including newline characters at the end
- * of each row. It saves the total length into `buflen` to inform the
- * caller of the string's length.
- *
- * After allocating the required memory, it loops through the rows,
- * using `memcpy()` to copy the contents of each row to the buffer,
- * appending a newline character after each row.
- *
- * The function returns the buffer, and it is the caller's responsibility
- * to free the allocated memory.
- *
- * @param buflen Pointer where the total length of the resulting string will be stored.
- * @return Pointer to the newly allocated string.
+ * Finds the row holding byte offset off and its column there by walking
+ * down the tree: each step skips a power-of-two run of rows that ends at
+ * or before off. A newline maps to the end of its row, offsets past the
+ * end of the text to the end of the last row.
  */
-char *rows_to_string(int *buflen) {
-    int totallen = 0;
-    int j;
+int offset_row(long long off, int *x) {
+    *x = 0;
+    if (E.numrows == 0 || off < 0) return 0;
+
+    stats_build();
+    int y = 0, step = 1;
+    while (step * 2 <= E.numrows) step *= 2;
+    for (; step > 0; step /= 2) {
+        if (y + step <= E.numrows && E.stats_tree[y + step].bytes <= off) {
+            y += step;
+            off -= E.stats_tree[y].bytes;
+        }
+    }
+    if (y == E.numrows) {
+        y--;
+        off = E.row[y].size;
+    }
+    *x = off < E.row[y].size ? off : E.row[y].size;
+    return y;
+}
 
-    for (j = 0; j < E.numrows; j++)
-        totallen += E.row[j].size + 1;
-    *buflen = totallen;
+/**
+ * Counts of the selection: the partial first and last rows are counted
+ * directly, the rows between them from the tree. Cached until the
+ * selection or the text changes.
+ */
+int selection_stats(struct text_stats *st, int *lines) {
+    int sx, sy, ex, ey;
+    if (!selection_range(&sx, &sy, &ex, &ey)) return 0;
+
+    if (E.sel_stats.sx != sx || E.sel_stats.sy != sy || E.sel_stats.ex != ex ||
+        E.sel_stats.ey != ey || E.sel_stats.gen != E.stats_gen) {
+        struct text_stats part, to;
+        if (sy == ey) {
+            text_count(&E.row[sy].chars[sx], ex - sx, &E.sel_stats.st);
+        } else {
+            text_count(&E.row[sy].chars[sx], E.row[sy].size - sx, &E.sel_stats.st);
+            E.sel_stats.st.bytes++;
+            E.sel_stats.st.chars++;
+            stats_prefix(sy + 1, &part);
+            stats_prefix(ey, &to);
+            E.sel_stats.st.bytes += to.bytes - part.bytes;
+            E.sel_stats.st.chars += to.chars - part.chars;
+            E.sel_stats.st.words += to.words - part.words;
+            text_count(E.row[ey].chars, ex, &part);
+            E.sel_stats.st.bytes += part.bytes;
+            E.sel_stats.st.chars += part.chars;
+            E.sel_stats.st.words += part.words;
+        }
+        E.sel_stats.sx = sx;
+        E.sel_stats.sy = sy;
+        E.sel_stats.ex = ex;
+        E.sel_stats.ey = ey;
+        E.sel_stats.gen = E.stats_gen;
+    }
+    *st = E.sel_stats.st;
+    *lines = ey - sy + 1;
+    return 1;
+}
 
-    char *buf = malloc(totallen);
-    char *p = buf;
+/*** Change marks ***/
+
+/**
+ * The gutter marks rows that differ from the file as last loaded or
+ * saved: '+' added, '~' modified, '_' saved lines deleted below the row
+ * ('^' above it, at the top). Each row keeps the hash it had then in
+ * saved and compares it with the hash row_count() keeps current, so an
+ * edit costs nothing extra and drawing a mark is a comparison. Deletions
+ * are marked on the row next to the gap when whatever takes rows out
+ * leaves fewer saved lines than it found, and cleared when saved lines
+ * come back there (undo). Rows that changed places count as modified
+ * until moving them back (or undo) brings their moved offset to 0.
+ */
+char row_mark(editor_row *row) {
+    if (row->saved == 0) return '+';
+    if (row->saved != row->hash || row->moved != 0) return '~';
+    if (row->removed & 1) return '_';
+    if (row->removed & 2) return '^';
+    return ' ';
+}
+
+// Rows [from, to) now match the file
+void rows_saved(int from, int to) {
+    for (int j = from; j < to; j++) {
+        E.row[j].saved = E.row[j].hash;
+        E.row[j].removed = 0;
+        E.row[j].moved = 0;
+    }
+}
+
+/**
+ * Before rows [at, at + ndel) are replaced by nins rows: the marks at the
+ * edges of the old rows go to the new ones. Returns 1 when a gap opens
+ * there (fewer saved lines, or marks that had nowhere to go), -1 when
+ * saved lines came back and one closes, 0 otherwise.
+ */
+int marks_splice(int at, int ndel, editor_row *rows, int nins) {
+    int lines = 0, gap = 0;
+    for (int j = 0; j < nins; j++)
+        lines += rows[j].saved != 0;
+    for (int j = 0; j < ndel; j++) {
+        int removed = E.row[at + j].removed;
+        lines -= E.row[at + j].saved != 0;
+        if (nins > 0 && j == 0) {
+            rows[0].removed |= removed & 2;
+            removed &= ~2;
+        }
+        if (nins > 0 && j == ndel - 1) {
+            rows[nins - 1].removed |= removed & 1;
+            removed &= ~1;
+        }
+        gap |= removed != 0;
+    }
+    if (gap || lines < 0) return 1;
+    return lines > 0 ? -1 : 0;
+}
+
+/**
+ * Marks (or clears) a gap in the saved lines between rows above and
+ * below: on the row above it, or on the row below it at the top.
+ */
+void marks_gap(int above, int below, int set) {
+    int y = above >= 0 ? above : below;
+    int bit = above >= 0 ? 1 : 2;
+    if (y < 0 || y >= E.numrows) return;
+    if (set)
+        E.row[y].removed |= bit;
+    else
+        E.row[y].removed &= ~bit;
+}
+
+/*** row operations ***/
+
+int row_cx_to_rx(editor_row *row, int cx) {
+    int rx = 0;
+    int j;
+    for (j = 0; j < cx; j++) {
+        if (row->chars[j] == '\t')
+            rx += (CCODE_TAB_STOP - 1) - (rx % CCODE_TAB_STOP);
+        rx++;
+    }
+    return rx;
+}
+
+// Convert the render index into a chars index
+int row_rx_to_cx(editor_row *row, int rx) {
+    int cur_rx = 0;
+    int cx;
+    for (cx = 0; cx < row->size; cx++) {
+        if (row->chars[cx] == '\t')
+            cur_rx += (CCODE_TAB_STOP - 1) - (cur_rx % CCODE_TAB_STOP);
+        cur_rx++;
+
+        if (cur_rx > rx) return cx;
+    }
+    return cx;
+}
+
+// Rebuilds the render field of a row from its chars, expanding tabs
+void row_render(editor_row *row) {
+    int tabs = 0;
+    int j;
+    for (j = 0; j < row->size; j++) {
+        if (row->chars[j] == '\t') {
+            tabs++;
+        }
+    }
+
+    free(row->render);
+    row->render = malloc(row->size + tabs*(CCODE_TAB_STOP - 1) + 1);
+
+    int idx = 0;
+    for (j = 0; j < row->size; j++) {
+        if (row->chars[j] == '\t') {
+            row->render[idx++] = ' ';
+            while (idx % CCODE_TAB_STOP != 0) row->render[idx++] = ' ';
+        } else {
+            row->render[idx++] = row->chars[j];
+        }
+    }
+    row->render[idx] = '\0';
+    row->rsize = idx;
+}
+
+void update_row(editor_row *row) {
+    if (row_in_buffer(row)) {
+        row_recount(row);
+        words_row(row, 1);
+    }
+    row_render(row);
+    if (macro_touched(row->index, row->index + 1)) {
+        // highlighted once the replay ends, blank until then
+        row->highlight = realloc(row->highlight, row->rsize);
+        memset(row->highlight, HL_NORMAL, row->rsize);
+        row->br_known = 0;
+        brackets_drop(row->index);
+        return;
+    }
+    update_syntax_highlight(row);
+}
+
+/**
+ * Renders and highlights rows [from, to) in a single forward pass, then
+ * lets the row after the range catch up with a changed comment state.
+ * Used after bulk operations instead of an update_row() per row, which
+ * could rehighlight the rows below the range once for every row in it.
+ */
+void update_row_range(int from, int to) {
+    if (macro_touched(from, to)) return;
+
+    // Without syntax rules no row depends on the one above it, so rows
+    // stay unrendered until they are drawn or searched, like the rows of
+    // an evicted buffer.
+    if (E.syntax == NULL) return;
+
+    // Rows that come in with their render intact (moved, or put back by
+    // undo) keep it, highlight_row() renders the rest.
+    for (int j = from; j < to; j++)
+        highlight_row(&E.row[j]);
+    if (to < E.numrows)
+        update_syntax_highlight(&E.row[to]);
+}
+
+void free_row(editor_row *row) {
+    free(row->render);
+    free(row->highlight);
+    if (row->shared && --*row->shared > 0)
+        return; // another row still uses the chars
+    free(row->shared);
+    free(row->chars);
+}
+
+/**
+ * Rows can share their chars copy-on-write (the clipboard and undo records
+ * hold whole lines this way, see row_share()). Anything that modifies chars
+ * in place calls this first: a shared buffer is copied, and the last owner
+ * simply drops the refcount. The row's words leave the completion trie
+ * while they can still be read.
+ */
+void row_own(editor_row *row) {
+    words_row(row, -1); // back once it is counted again
+    if (row->shared == NULL) return;
+
+    if (*row->shared > 1) {
+        char *chars = malloc(row->size + 1);
+        memcpy(chars, row->chars, row->size + 1);
+        (*row->shared)--;
+        row->chars = chars;
+    } else {
+        free(row->shared);
+    }
+    row->shared = NULL;
+}
+
+/**
+ * Returns a new row with the same text as row, sharing its chars instead
+ * of copying them. The copy starts unrendered, render and highlight are
+ * per row and rebuilt on demand.
+ */
+editor_row row_share(editor_row *row) {
+    if (row->shared == NULL) {
+        row->shared = malloc(sizeof(int));
+        *row->shared = 1;
+    }
+    (*row->shared)++;
+
+    editor_row copy = *row;
+    copy.rsize = 0;
+    copy.render = NULL;
+    copy.highlight = NULL;
+    copy.br_known = 0;
+    copy.fold = 0;
+    copy.in_words = 0;
+    return copy;
+}
+
+/**
+ * Gives a row new chars, moving its old struct to *saved for an
+ * UNDO_LINES record. The caller renders it again and puts its words back
+ * (see lines_updated()).
+ */
+void row_swap_chars(editor_row *row, char *chars, int size, editor_row *saved) {
+    words_row(row, -1);
+    *saved = *row;
+    row->chars = chars;
+    row->size = size;
+    row->rsize = 0;
+    row->render = NULL;
+    row->highlight = NULL;
+    row->shared = NULL;
+    row->br_known = 0;
+    if (row_in_buffer(row)) {
+        brackets_drop(row->index);
+        row_recount(row);
+    }
+}
+
+/**
+ * Returns a new row with chars [0, alen) of a followed by chars [bfrom,
+ * bto) of b. When the result is all of a or all of b it shares that row's
+ * chars, so only partial lines are ever copied.
+ */
+editor_row row_join(editor_row *a, int alen, editor_row *b, int bfrom, int bto) {
+    if (alen == 0 && bfrom == 0 && bto > 0 && bto == b->size)
+        return row_share(b);
+    if (alen > 0 && bfrom == bto && alen == a->size)
+        return row_share(a);
+
+    editor_row row = { 0 };
+    row.size = alen + (bto - bfrom);
+    row.chars = malloc(row.size + 1);
+    memcpy(row.chars, a->chars, alen);
+    memcpy(row.chars + alen, b->chars + bfrom, bto - bfrom);
+    row.chars[row.size] = '\0';
+    return row;
+}
+
+/**
+ * Row indexes changed from `from` on: the trees keyed by them are rebuilt
+ * when next used (the bracket tree only from there).
+ */
+void row_trees_drop(int from) {
+    brackets_drop(from);
+    E.fold_built = 0;
+    E.stats_built = 0;
+    E.stats_gen++;
+}
+
+/**
+ * Replaces ndel rows at `at` with the nins rows in `rows`. This is the one
+ * primitive every structural change goes through: the rows after the range
+ * are shifted with a single memmove and their indexes fixed in one pass,
+ * so removing or adding a block of K rows costs O(N) instead of O(K * N).
+ *
+ * The inserted row structs (and their chars) are moved into E.row, the
+ * caller only frees the `rows` array itself. The new rows are rendered and
+ * highlighted in one pass, together with the row after them in case the
+ * comment state changed.
+ *
+ * @param at Index of the first row to replace.
+ * @param ndel Number of rows to remove, clamped to the end of the buffer.
+ * @param rows The rows to insert (may be NULL when nins is 0).
+ * @param nins Number of rows to insert.
+ * @param removed If not NULL, receives a new array owning the removed
+ *        rows; otherwise they are freed.
+ */
+void row_splice(int at, int ndel, editor_row *rows, int nins, editor_row **removed) {
+    if (at < 0 || at > E.numrows) return;
+    if (ndel < 0) ndel = 0;
+    if (ndel > E.numrows - at) ndel = E.numrows - at;
+
+    int gap = marks_splice(at, ndel, rows, nins);
+    stats_add(&E.row[at], ndel, -1);
+    for (int j = 0; j < nins; j++)
+        row_count(&rows[j]);
+    stats_add(rows, nins, 1);
+
+    if (removed) {
+        *removed = malloc(sizeof(editor_row) * (ndel > 0 ? ndel : 1));
+        memcpy(*removed, &E.row[at], sizeof(editor_row) * ndel);
+        for (int j = 0; j < ndel; j++)
+            (*removed)[j].fold = 0; // folds stay with the buffer
+    } else {
+        for (int j = at; j < at + ndel; j++)
+            free_row(&E.row[j]);
+    }
+
+    int numrows = E.numrows - ndel + nins;
+    if (numrows > E.rowcap) {
+        if (E.rowcap == 0) E.rowcap = 64;
+        while (E.rowcap < numrows) E.rowcap *= 2;
+        E.row = realloc(E.row, sizeof(editor_row) * E.rowcap);
+    }
+
+    if (ndel != nins)
+        memmove(&E.row[at + nins], &E.row[at + ndel],
+                sizeof(editor_row) * (E.numrows - at - ndel));
+    if (nins > 0)
+        memcpy(&E.row[at], rows, sizeof(editor_row) * nins);
+    E.numrows = numrows;
+    row_trees_drop(at);
+
+    if (E.hl_stale != INT_MAX && at < E.hl_stale)
+        highlight_stale(at); // the stale rows moved
+    int renumber_to = (ndel == nins) ? at + nins : E.numrows;
+    for (int j = at; j < renumber_to; j++)
+        E.row[j].index = j;
+    if (gap)
+        marks_gap(at - 1, at + nins, gap > 0);
+
+    update_row_range(at, at + nins);
+    E.dirty++;
+}
+
+/**
+ * Moves the n rows at `from` so that they start at `to` (an index in the
+ * buffer as it is after the move). Only the rows in between shift, with
+ * one memmove.
+ */
+void row_move(int from, int n, int to) {
+    if (n <= 0 || from < 0 || to < 0 || from + n > E.numrows || to + n > E.numrows || from == to)
+        return;
+
+    editor_row *block = malloc(sizeof(editor_row) * n);
+    memcpy(block, &E.row[from], sizeof(editor_row) * n);
+    if (to < from)
+        memmove(&E.row[to + n], &E.row[to], sizeof(editor_row) * (from - to));
+    else
+        memmove(&E.row[from], &E.row[from + n], sizeof(editor_row) * (to - from));
+    memcpy(&E.row[to], block, sizeof(editor_row) * n);
+    free(block);
+
+    int lo = from < to ? from : to;
+    int hi = (from < to ? to : from) + n;
+    row_trees_drop(lo);
+    if (E.hl_stale != INT_MAX && lo < E.hl_stale)
+        highlight_stale(lo);
+    for (int j = lo; j < hi; j++) {
+        E.row[j].index = j;
+        if (j >= to && j < to + n)
+            E.row[j].moved += to - from;
+        else
+            E.row[j].moved += to < from ? n : -n;
+    }
+
+    update_row_range(lo, hi);
+    E.dirty++;
+}
+
+// A new, unrendered row holding a copy of s
+editor_row row_from(const char *s, size_t len) {
+    editor_row row = { 0 };
+    row.size = len;
+    row.chars = malloc(len + 1);
+    memcpy(row.chars, s, len);
+    row.chars[len] = '\0';
+    return row;
+}
+
+void insert_row(int at, char *s, size_t len) {
+    if (at < 0 || at > E.numrows) return;
+
+    editor_row row = row_from(s, len);
+    row_splice(at, 0, &row, 1, NULL);
+}
+
+/**
+ * Deletes a row at the specified index.
+ * The row's memory is freed and the rows after it are shifted up by
+ * row_splice(), which also decrements numrows and increments E.dirty.
+ *
+ * @param int at The index of the row to delete.
+ */
+void delete_row(int at) {
+    if (at < 0 || at >= E.numrows) return;
+
+    row_splice(at, 1, NULL, 0, NULL);
+}
+
+/**
+ * Inserts a character into a row at the specified position.
+ *
+ * This function uses memmove() to safely handle overlapping source and
+ * destination arrays. It validates the insertion index, allowing insertion
+ * at the end of the string, then allocates additional memory for the
+ * character and the null terminator, shifts existing chars to make
+ * room for the new char, and updates the row size. Finally, it assigns
+ * the character to the specified position and updates the row's render and
+ * size fields.
+ *
+ * @param editor_row The row where the character will be inserted.
+ * @param at The index at which to insert the character.
+ * @param c The character to be inserted.
+ */
+void insert_char_in_row(editor_row *row, int at, int c) {
+    if (at < 0 || at > row->size)
+        at = row->size;
+
+    row_own(row);
+    row->chars = realloc(row->chars, row->size + 2);
+    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+    row->size++;
+    row->chars[at] = c;
+    update_row(row);
+    E.dirty++;
+}
+
+/**
+ * Appends a string to a row.
+ *
+ * This function reallocates memory for the row's chars field, copying the
+ * specified string to the end of the row's existing chars, updating the
+ * row's size, and adding a null terminator. It then updates the row's
+ * render and size fields and increments dirty flag.
+ *
+ * @param row The row to which the string will be appended.
+ * @param s The string to append.
+ * @param len The length of the string to append.
+ */
+void row_add_string(editor_row *row, char *s, size_t len) {
+    row_own(row);
+    row->chars = realloc(row->chars, row->size + len + 1);
+    memcpy(&row->chars[row->size], s, len);
+
+    row->size += len;
+    row->chars[row->size] = '\0';
+
+    update_row(row);
+    E.dirty++;
+}
+
+/**
+ * Deletes a character from a row at the specified position.
+ *
+ * This function validates the deletion index, allowing deletion at the
+ * end of the string, then uses memmove() to safely handle overlapping
+ * source and destination arrays. It shifts existing chars to overwrite
+ * the deleted char, decrements the row size, and updates the row's render
+ * and size fields.
+ *
+ * @param row The row from which to delete the character.
+ * @param at The index of the character to delete.
+ */
+void row_delete_char(editor_row *row, int at) {
+    if (at < 0 || at >= row->size) return;
+
+    row_own(row);
+    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+    row->size--;
+    update_row(row);
+    E.dirty++;
+}
+
+/*** editor operations ***/
+
+void undo_free(undo_t *op) {
+    free(op->text);
+    free(op->lines);
+    for (int j = 0; op->rows && j < op->len; j++)
+        free_row(&op->rows[j]);
+    free(op->rows);
+}
+
+// Records op (taking ownership of its text/rows) and forgets the redo history
+void undo_push(undo_t op) {
+    // a replayed macro is undone as a whole, see macro_replay()
+    if (E.undo_len >= MAX_UNDO || M.replaying) {
+        undo_free(&op);
+        return;
+    }
+    E.undo_stack[E.undo_len++] = op;
+    while (E.redo_len > 0)
+        undo_free(&E.redo_stack[--E.redo_len]);
+}
+
+/**
+ * Applies an UNDO_ROWS record: the op->count rows at op->y are swapped
+ * with the saved op->rows. Row structs only change owner, no text is
+ * copied. Afterwards op holds the rows that were taken out, so the same
+ * call applied again (redo) reverses it.
+ */
+void undo_swap_rows(undo_t *op) {
+    editor_row *taken;
+    int ntaken = op->count < E.numrows - op->y ? op->count : E.numrows - op->y;
+
+    row_splice(op->y, op->count, op->rows, op->len, &taken);
+    free(op->rows);
+
+    op->rows = taken;
+    op->count = op->len;
+    op->len = ntaken;
+}
+
+/**
+ * Rehighlights the rows at the sorted indexes in lines, letting a changed
+ * comment state run on into the rows that follow each of them.
+ */
+void rows_rehighlight(int *lines, int n) {
+    if (n == 0 || macro_touched(lines[0], lines[n - 1] + 1)) return;
+    if (E.syntax == NULL) return; // see update_row_range()
+    for (int k = 0; k < n; k++) {
+        int next = lines[k] + 1;
+        if (highlight_row(&E.row[lines[k]]) && next < E.numrows &&
+            (k + 1 == n || lines[k + 1] != next))
+            update_syntax_highlight(&E.row[next]);
+    }
+}
+
+// Highlights rows given new chars by row_swap_chars()
+void lines_updated(int *lines, int n) {
+    words_lines(lines, n);
+    rows_rehighlight(lines, n);
+    E.dirty++;
+}
+
+/**
+ * Applies an UNDO_LINES record: each row at op->lines[k] trades places with
+ * op->rows[k]. Like undo_swap_rows() it is its own inverse, and the rows
+ * keep their render. Their highlight is refreshed when drawn, as after the
+ * :s or block edit that made the record, and the words of many rows are
+ * left to words_idle().
+ */
+void undo_swap_lines(undo_t *op) {
+    stats_add(op->rows, op->len, 1);
+    for (int k = 0; k < op->len; k++) {
+        editor_row row = E.row[op->lines[k]];
+        stats_add(&row, 1, -1);
+        E.row[op->lines[k]] = op->rows[k];
+        E.row[op->lines[k]].index = op->lines[k];
+        op->rows[k] = row;
+    }
+    row_trees_drop(op->lines[0]);
+    if (op->len > 0 && !macro_touched(op->lines[0], op->lines[op->len - 1] + 1))
+        highlight_stale(op->lines[0]);
+    E.dirty++;
+}
+
+/**
+ * Applies an UNDO_FILTER record: puts the rows it holds back at their old
+ * indexes (restore), or takes them out again. Both build the new row
+ * array in one pass. The record owns op->rows only while they are out.
+ */
+void undo_filter(undo_t *op, int restore) {
+    int n = restore ? E.numrows + op->len : E.numrows - op->len;
+    editor_row *rows = malloc(sizeof(editor_row) * (n > 0 ? n : 1));
+    int k = 0, src = 0;
+
+    if (restore) {
+        stats_add(op->rows, op->len, 1);
+        for (int j = 0; j < n; j++) {
+            rows[j] = (k < op->len && op->lines[k] == j) ? op->rows[k++] : E.row[src++];
+            rows[j].index = j;
+        }
+        // the gaps before each run of rows put back are closed again
+        for (k = 0; k < op->len; k++) {
+            int from = op->lines[k], to = from + 1;
+            while (k + 1 < op->len && op->lines[k + 1] == to) k++, to++;
+            if (from > 0) rows[from - 1].removed &= ~1;
+            else if (to < n) rows[to].removed &= ~2;
+        }
+        free(op->rows);
+        op->rows = NULL;
+    } else {
+        op->rows = malloc(sizeof(editor_row) * op->len);
+        for (int j = 0; j < E.numrows; j++) {
+            if (k < op->len && op->lines[k] == j) {
+                op->rows[k] = E.row[j];
+                op->rows[k++].fold = 0;
+            } else {
+                rows[src] = E.row[j];
+                rows[src].index = src;
+                src++;
+            }
+        }
+        stats_add(op->rows, op->len, -1);
+    }
+
+    free(E.row);
+    E.row = rows;
+    E.numrows = n;
+    E.rowcap = n > 0 ? n : 1;
+    if (!restore)
+        for (k = 0; k < op->len; k++)
+            if (op->rows[k].saved || op->rows[k].removed)
+                marks_gap(op->lines[k] - k - 1, op->lines[k] - k, 1);
+    row_trees_drop(op->lines[0]);
+    E.dirty++;
+    highlight_stale(op->lines[0]);
+}
+
+void undo_operation() {
+    if (E.undo_len == 0) return;
+
+    undo_t op = E.undo_stack[--E.undo_len];
+    E.redo_stack[E.redo_len++] = op;
+
+    E.cursor_x = op.x;
+    E.cursor_y = op.y;
+
+    switch (op.type) {
+        case UNDO_INSERT:
+            for (int i = 0; i < op.len; i++) {
+                if (E.cursor_y == E.numrows)
+                    insert_row(E.numrows, "", 0);
+                insert_char_in_row(&E.row[E.cursor_y], E.cursor_x + i, op.text[i]);
+            }
+            E.cursor_x += op.len;
+            break;
+
+        case UNDO_DELETE:
+            for (int i = 0; i < op.len; i++) {
+                row_delete_char(&E.row[E.cursor_y], E.cursor_x);
+            }
+            break;
+
+        case UNDO_ROWS:
+            undo_swap_rows(&E.redo_stack[E.redo_len - 1]);
+            break;
+
+        case UNDO_LINES:
+            undo_swap_lines(&E.redo_stack[E.redo_len - 1]);
+            break;
+
+        case UNDO_FILTER:
+            undo_filter(&E.redo_stack[E.redo_len - 1], 1);
+            break;
+
+        case UNDO_SORT:
+            rows_permute(op.y, op.len, op.lines, 1);
+            break;
+
+        case UNDO_MOVE:
+            row_move(op.count, op.len, op.y);
+            break;
+
+        default:
+            break;
+    }
+}
+
+void redo_operation() {
+    if (E.redo_len == 0) return;
+
+    undo_t op = E.redo_stack[--E.redo_len];
+    E.undo_stack[E.undo_len++] = op;
+
+    E.cursor_x = op.x;
+    E.cursor_y = op.y;
+
+    switch (op.type) {
+        case UNDO_DELETE:
+            for (int i = 0; i < op.len; i++) {
+                if (E.cursor_y == E.numrows)
+                    insert_row(E.numrows, "", 0);
+                insert_char_in_row(&E.row[E.cursor_y], E.cursor_x + i, op.text ? op.text[i] : '?');
+            }
+            E.cursor_x += op.len;
+            break;
+
+        case UNDO_INSERT:
+            for (int i = 0; i < op.len; i++) {
+                row_delete_char(&E.row[E.cursor_y], E.cursor_x);
+            }
+            break;
+
+        case UNDO_ROWS:
+            undo_swap_rows(&E.undo_stack[E.undo_len - 1]);
+            break;
+
+        case UNDO_LINES:
+            undo_swap_lines(&E.undo_stack[E.undo_len - 1]);
+            break;
+
+        case UNDO_FILTER:
+            undo_filter(&E.undo_stack[E.undo_len - 1], 0);
+            break;
+
+        case UNDO_SORT:
+            rows_permute(op.y, op.len, op.lines, 0);
+            break;
+
+        case UNDO_MOVE:
+            row_move(op.y, op.len, op.count);
+            E.cursor_y = op.count;
+            break;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * Deletes n whole rows starting at `at` with a single splice. The removed
+ * rows go into one undo record as they are, undo puts them back without
+ * copying any text.
+ */
+void delete_lines(int at, int n) {
+    if (at >= E.numrows || n <= 0) return;
+    if (n > E.numrows - at) n = E.numrows - at;
+
+    editor_row *removed;
+    row_splice(at, n, NULL, 0, &removed);
+    undo_push((undo_t){ UNDO_ROWS, 0, at, NULL, n, removed, 0, NULL });
+
+    E.cursor_y = at;
+    E.cursor_x = 0;
+}
+
+/**
+ * Deletes every row j with drop[j] set, building the new row array in one
+ * pass, and records them as one UNDO_FILTER entry. Returns how many went.
+ */
+int remove_marked_rows(const unsigned char *drop) {
+    int n = E.numrows;
+    editor_row *kept = malloc(sizeof(editor_row) * (n > 0 ? n : 1));
+    editor_row *removed = malloc(sizeof(editor_row) * (n > 0 ? n : 1));
+    int *lines = malloc(sizeof(int) * (n > 0 ? n : 1));
+    int nkept = 0, nremoved = 0;
+
+    for (int j = 0; j < n; j++) {
+        if (!drop[j]) {
+            kept[nkept] = E.row[j];
+            kept[nkept].index = nkept;
+            nkept++;
+        } else {
+            removed[nremoved] = E.row[j];
+            removed[nremoved].fold = 0;
+            lines[nremoved++] = j;
+        }
+    }
+
+    if (nremoved == 0) {
+        free(kept);
+        free(removed);
+        free(lines);
+        return 0;
+    }
+
+    free(E.row);
+    E.row = kept;
+    E.rowcap = n > 0 ? n : 1;
+    E.numrows = nkept;
+    row_trees_drop(lines[0]);
+    E.dirty++;
+    // the row that followed the last one removed is now nremoved rows up
+    macro_touched(lines[0], lines[nremoved - 1] - (nremoved - 1));
+    highlight_stale(lines[0]);
+
+    stats_add(removed, nremoved, -1);
+    for (int k = 0; k < nremoved; k++)
+        if (removed[k].saved || removed[k].removed)
+            marks_gap(lines[k] - k - 1, lines[k] - k, 1);
+    removed = realloc(removed, sizeof(editor_row) * nremoved);
+    lines = realloc(lines, sizeof(int) * nremoved);
+    undo_push((undo_t){ UNDO_FILTER, 0, lines[0], NULL, nremoved, removed, 0, lines });
+    return nremoved;
+}
+
+// Moves n rows from `from` to `to` as one undoable step
+void move_lines(int from, int n, int to) {
+    if (to < 0 || to + n > E.numrows || from + n > E.numrows) return;
+
+    row_move(from, n, to);
+    undo_push((undo_t){ UNDO_MOVE, 0, from, NULL, n, NULL, to, NULL });
+}
+
+void insert_char(int c) {
+    if(E.cursor_y == E.numrows)
+        insert_row(E.numrows, "", 0);
+
+    char *copy = malloc(2);
+    copy[0] = c;
+    copy[1] = '\0';
+
+    // UNDO for insert: we store DELETE at current position
+    undo_push((undo_t){ UNDO_DELETE, E.cursor_x, E.cursor_y, copy, 1, NULL, 0, NULL });
+
+    insert_char_in_row(&E.row[E.cursor_y], E.cursor_x, c);
+    E.cursor_x++;
+}
+
+void insert_new_line() {
+    if (E.cursor_x == 0) {
+        insert_row(E.cursor_y, "", 0);
+    } else {
+        editor_row *row = &E.row[E.cursor_y];
+        insert_row(E.cursor_y + 1, &row->chars[E.cursor_x], row->size - E.cursor_x);
+        row = &E.row[E.cursor_y];
+        row_own(row);
+        row->size = E.cursor_x;
+        row->chars = realloc(row->chars, row->size + 1);
+        row->chars[row->size] = '\0';
+        update_row(row);
+    }
+    E.cursor_y++;
+    E.cursor_x = 0;
+}
+
+/**
+ * Deletes a character to the left of the cursor.
+ *
+ * If the cursor’s past the end of the file, then there is nothing to delete,
+ * and we return immediately. Otherwise, we get the editor_row the cursor is on,
+ * and if there is a character to the left of the cursor, we delete it and
+ * move the cursor one to the left.
+ */
+void delete_char() {
+    if (E.cursor_y == E.numrows) return;
+    if(E.cursor_x == 0 && E.cursor_y == 0) return;
+
+    editor_row *row = &E.row[E.cursor_y];
+    if (E.cursor_x > 0) {
+        // store deleted character
+        char deleted = row->chars[E.cursor_x - 1];
+        char *copy = malloc(2);
+        copy[0] = deleted;
+        copy[1] = '\0';
+
+        undo_push((undo_t){ UNDO_INSERT, E.cursor_x - 1, E.cursor_y, copy, 1, NULL, 0, NULL });
+        row_delete_char(row, E.cursor_x - 1);
+        E.cursor_x--;
+    } else {
+        E.cursor_x = E.row[E.cursor_y - 1].size;
+        row_add_string(&E.row[E.cursor_y - 1], row->chars, row->size);
+        delete_row(E.cursor_y);
+        E.cursor_y--;
+    }
+}
+
+/**
+ * Replaces the word before the cursor with its first completion, and
+ * pressed again right away with the next one, the word as typed coming
+ * back after the last. Completions come from the active buffer first,
+ * then from the other loaded ones. A run of ^Space is one undo step.
+ */
+struct completion {
+    int y, x;           // start of the word being completed
+    int end;            // the cursor after the last replacement
+    int dirty;          // E.dirty then, anything else typed changes it
+    int undo;           // undo_len then
+    int pick, n;
+    char prefix[WORD_MAX + 1];
+    char words[COMPLETE_MAX][WORD_MAX + 1];
+};
+struct completion K;
+
+void word_complete() {
+    if (E.cursor_y >= E.numrows) return;
+    editor_row *row = &E.row[E.cursor_y];
+    int again = K.n > 0 && K.y == E.cursor_y && K.end == E.cursor_x && K.dirty == E.dirty;
+
+    if (again) {
+        K.pick = (K.pick + 1) % (K.n + 1);
+    } else {
+        int x = E.cursor_x;
+        while (x > 0 && word_char((unsigned char)row->chars[x - 1])) x--;
+        int plen = E.cursor_x - x;
+        if (plen == 0 || plen > WORD_MAX) {
+            set_prompt_message("No word before the cursor");
+            return;
+        }
+
+        words_sweep(1);
+        memcpy(K.prefix, &row->chars[x], plen);
+        K.prefix[plen] = '\0';
+        K.n = 0;
+        words_complete(E.word_nodes, E.word_count, K.prefix, plen, K.words, &K.n);
+        for (int j = 0; j < B.count; j++)
+            if (j != B.current && B.list[j].loaded)
+                words_complete(B.list[j].state.word_nodes, B.list[j].state.word_count,
+                               K.prefix, plen, K.words, &K.n);
+        if (K.n == 0) {
+            set_prompt_message("No completions for %s", K.prefix);
+            return;
+        }
+        K.y = E.cursor_y;
+        K.x = x;
+        K.pick = 0;
+    }
+
+    // splice the pick (or the word as typed) over [K.x, cursor)
+    const char *word = K.pick < K.n ? K.words[K.pick] : K.prefix;
+    int wlen = strlen(word);
+    int size = row->size - (E.cursor_x - K.x) + wlen;
+    char *chars = malloc(size + 1);
+    memcpy(chars, row->chars, K.x);
+    memcpy(&chars[K.x], word, wlen);
+    memcpy(&chars[K.x + wlen], &row->chars[E.cursor_x], row->size - E.cursor_x + 1);
+
+    int *lines = malloc(sizeof(int));
+    editor_row *saved = malloc(sizeof(editor_row));
+    lines[0] = E.cursor_y;
+    row_swap_chars(row, chars, size, saved);
+    lines_updated(lines, 1);
+    if (again && K.undo == E.undo_len) {
+        // the record of the first ^Space already has the row as typed
+        free_row(saved);
+        free(saved);
+        free(lines);
+    } else {
+        undo_push((undo_t){ UNDO_LINES, E.cursor_x, E.cursor_y, NULL, 1, saved, 0, lines });
+    }
+
+    E.cursor_x = K.x + wlen;
+    K.end = E.cursor_x;
+    K.dirty = E.dirty;
+    K.undo = E.undo_len;
+    if (K.pick < K.n)
+        set_prompt_message("Completion %d of %d%s", K.pick + 1, K.n, K.n == COMPLETE_MAX ? "+" : "");
+    else
+        set_prompt_message("Back to %s", K.prefix);
+}
+
+/*** Selection ***/
+
+/**
+ * Gets the selection between the mark and the cursor in document order,
+ * the end being exclusive and clamped to the end of the last row.
+ * Returns 0 when nothing is selected.
+ */
+int selection_range(int *sx, int *sy, int *ex, int *ey) {
+    if (!E.sel_active || E.sel_block) return 0;
+
+    int ax = E.sel_x, ay = E.sel_y, bx = E.cursor_x, by = E.cursor_y;
+    if (ay > by || (ay == by && ax > bx)) {
+        int t = ax; ax = bx; bx = t;
+        t = ay; ay = by; by = t;
+    }
+    if (ay >= E.numrows) return 0;
+    if (by >= E.numrows) {
+        by = E.numrows - 1;
+        bx = E.row[by].size;
+    }
+    if (ax > E.row[ay].size) ax = E.row[ay].size;
+    if (bx > E.row[by].size) bx = E.row[by].size;
+    if (ay == by && ax == bx) return 0;
+
+    *sx = ax; *sy = ay; *ex = bx; *ey = by;
+    return 1;
+}
+
+void clipboard_set(editor_row *rows, int numrows) {
+    for (int j = 0; j < C.numrows; j++)
+        free_row(&C.rows[j]);
+    for (int j = 0; j < numrows; j++) {
+        rows[j].saved = 0; // pasted, they are new lines
+        rows[j].removed = 0;
+    }
+    free(C.rows);
+    C.rows = rows;
+    C.numrows = numrows;
+    C.block = 0;
+}
+
+/**
+ * Returns the text of a range as rows, one per line it touches. Lines
+ * covered completely share their chars, only the edges are copied, so
+ * taking a million whole lines costs O(rows).
+ */
+editor_row *range_rows(int sx, int sy, int ex, int ey, int *n) {
+    *n = ey - sy + 1;
+    editor_row *rows = malloc(sizeof(editor_row) * *n);
+
+    if (sy == ey) {
+        rows[0] = row_join(&E.row[sy], 0, &E.row[sy], sx, ex);
+        return rows;
+    }
+    rows[0] = row_join(&E.row[sy], 0, &E.row[sy], sx, E.row[sy].size);
+    for (int j = sy + 1; j < ey; j++)
+        rows[j - sy] = row_share(&E.row[j]);
+    rows[*n - 1] = row_join(&E.row[ey], ex, &E.row[ey], 0, 0);
+    return rows;
+}
+
+/**
+ * Deletes a range with one splice: rows sy..ey are replaced by the joined
+ * remainder of the first and last one. The removed rows become a single
+ * UNDO_ROWS record.
+ */
+void delete_range(int sx, int sy, int ex, int ey) {
+    editor_row joined = row_join(&E.row[sy], sx, &E.row[ey], ex, E.row[ey].size);
+    editor_row *removed;
+
+    row_splice(sy, ey - sy + 1, &joined, 1, &removed);
+    undo_push((undo_t){ UNDO_ROWS, sx, sy, NULL, ey - sy + 1, removed, 1, NULL });
+
+    E.cursor_x = sx;
+    E.cursor_y = sy;
+    E.sel_active = 0;
+}
+
+void selection_copy(int cut) {
+    int sx, sy, ex, ey, n;
+    if (!selection_range(&sx, &sy, &ex, &ey)) {
+        set_prompt_message("Nothing selected (^B or Shift+arrows)");
+        return;
+    }
+
+    editor_row *rows = range_rows(sx, sy, ex, ey, &n);
+    clipboard_set(rows, n);
+    if (cut) {
+        delete_range(sx, sy, ex, ey);
+    } else {
+        E.sel_active = 0;
+        set_prompt_message("%d line%s copied", n, n == 1 ? "" : "s");
+    }
+}
+
+/**
+ * Inserts the clipboard at the cursor. The cursor row is split around the
+ * clipboard's first and last line, the lines in between are shared into
+ * the buffer, and the whole paste is one splice and one undo record.
+ */
+void clipboard_paste() {
+    if (C.block) {
+        block_paste();
+        return;
+    }
+    if (C.numrows == 0 || (C.numrows == 1 && C.rows[0].size == 0)) return;
+
+    editor_row empty = { 0 };
+    empty.chars = "";
+    int y = E.cursor_y;
+    int ndel = (y < E.numrows) ? 1 : 0;
+    editor_row *cur = ndel ? &E.row[y] : &empty;
+    int cx = E.cursor_x < cur->size ? E.cursor_x : cur->size;
+
+    int n = C.numrows;
+    editor_row *first = &C.rows[0], *last = &C.rows[n - 1];
+    editor_row *rows = malloc(sizeof(editor_row) * n);
+
+    rows[0] = row_join(cur, cx, first, 0, first->size);
+    if (n == 1) {
+        if (cx < cur->size) {
+            editor_row *row = &rows[0];
+            row_own(row);
+            row->chars = realloc(row->chars, row->size + cur->size - cx + 1);
+            memcpy(&row->chars[row->size], &cur->chars[cx], cur->size - cx + 1);
+            row->size += cur->size - cx;
+        }
+    } else {
+        for (int j = 1; j < n - 1; j++)
+            rows[j] = row_share(&C.rows[j]);
+        rows[n - 1] = row_join(last, last->size, cur, cx, cur->size);
+    }
+
+    editor_row *removed;
+    row_splice(y, ndel, rows, n, &removed);
+    free(rows);
+    undo_push((undo_t){ UNDO_ROWS, cx, y, NULL, ndel, removed, n, NULL });
+
+    E.cursor_y = y + n - 1;
+    E.cursor_x = (n == 1) ? cx + first->size : last->size;
+    E.sel_active = 0;
+}
+/*** Multiple cursors ***/
+
+/**
+ * Extra cursors are kept in E.cursors, sorted by position; the primary one
+ * is still E.cursor_x/y. Typing, deleting and moving apply to all of them
+ * as one batch: a row is rebuilt, rendered and highlighted once per key
+ * however many cursors sit on it, and the whole key is one undo step.
+ */
+
+int cursor_cmp(const void *a, const void *b) {
+    const struct cursor *p = a, *q = b;
+    if (p->y != q->y) return p->y < q->y ? -1 : 1;
+    return (p->x > q->x) - (p->x < q->x);
+}
+
+void cursors_reserve(int n) {
+    if (n <= E.cursorcap) return;
+    if (E.cursorcap == 0) E.cursorcap = 16;
+    while (E.cursorcap < n) E.cursorcap *= 2;
+    E.cursors = realloc(E.cursors, sizeof(struct cursor) * E.cursorcap);
+}
+
+// Index of the first extra cursor on row y or after it
+int cursors_first_on(int y) {
+    int lo = 0, hi = E.ncursors;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (E.cursors[mid].y < y) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// All cursors, the primary one flagged, sorted by position
+struct cursor *cursors_gather(int *n) {
+    *n = E.ncursors + 1;
+    struct cursor *all = malloc(sizeof(struct cursor) * *n);
+    memcpy(all, E.cursors, sizeof(struct cursor) * E.ncursors);
+    all[E.ncursors] = (struct cursor){ E.cursor_x, E.cursor_y, 1 };
+    qsort(all, *n, sizeof(struct cursor), cursor_cmp);
+    return all;
+}
+
+// Stores sorted cursors back, merging the ones that ended up on one spot
+void cursors_scatter(struct cursor *all, int n) {
+    cursors_reserve(n);
+    E.ncursors = 0;
+    for (int j = 0; j < n; j++) {
+        if (j + 1 < n && all[j].x == all[j + 1].x && all[j].y == all[j + 1].y) {
+            all[j + 1].primary |= all[j].primary;
+            continue;
+        }
+        if (all[j].primary) {
+            E.cursor_x = all[j].x;
+            E.cursor_y = all[j].y;
+        } else {
+            E.cursors[E.ncursors++] = all[j];
+        }
+    }
+    free(all);
+}
+
+/**
+ * Adds cursors at the primary cursor's column: one on every selected line
+ * when there is a selection, else one on the line below the lowest cursor.
+ */
+void cursors_add() {
+    if (E.cursor_y >= E.numrows) return;
+    int rx = row_cx_to_rx(&E.row[E.cursor_y], E.cursor_x);
+
+    int sx, sy, ex, ey;
+    if (!selection_range(&sx, &sy, &ex, &ey)) {
+        sy = E.cursor_y;
+        if (E.ncursors > 0 && E.cursors[E.ncursors - 1].y > sy)
+            sy = E.cursors[E.ncursors - 1].y;
+        sy = ey = sy + 1;
+        if (sy >= E.numrows) return;
+    }
+    E.sel_active = 0;
+
+    cursors_reserve(E.ncursors + ey - sy + 1);
+    for (int y = sy; y <= ey; y++) {
+        if (y == E.cursor_y) continue;
+        E.cursors[E.ncursors++] = (struct cursor){ row_rx_to_cx(&E.row[y], rx), y, 0 };
+    }
+
+    int n;
+    struct cursor *all = cursors_gather(&n);
+    cursors_scatter(all, n);
+    set_prompt_message("%d cursors (ESC drops them)", E.ncursors + 1);
+}
+
+void cursors_move(int key) {
+    int n;
+    struct cursor *all = cursors_gather(&n);
+
+    for (int j = 0; j < n; j++) {
+        E.cursor_x = all[j].x;
+        E.cursor_y = all[j].y;
+        if (key == HOME_KEY)
+            E.cursor_x = 0;
+        else if (key == END_KEY)
+            E.cursor_x = E.cursor_y < E.numrows ? E.row[E.cursor_y].size : 0;
+        else
+            move_cursor(key);
+        all[j].x = E.cursor_x;
+        all[j].y = E.cursor_y;
+    }
+
+    qsort(all, n, sizeof(struct cursor), cursor_cmp);
+    cursors_scatter(all, n);
+    E.cursors_undo = -1;
+}
+
+/**
+ * Builds the new chars of a row after applying key at the sorted cursor
+ * columns xs, which are moved to where the cursors end up.
+ */
+char *cursors_edit_row(editor_row *row, int *xs, int n, int key, int *size) {
+    char *chars = malloc(row->size + n + 1);
+    int len = 0, k = 0;
+
+    for (int j = 0; j <= row->size; j++) {
+        int skip = 0;
+        for (; k < n && xs[k] == j; k++) {
+            if (key == BACKSPACE) {
+                if (len > 0) len--;
+            } else if (key == DELETE_KEY) {
+                skip = (j < row->size);
+            } else {
+                chars[len++] = key;
+            }
+            xs[k] = len;
+        }
+        if (j < row->size && !skip)
+            chars[len++] = row->chars[j];
+    }
+    chars[len] = '\0';
+    *size = len;
+    return chars;
+}
+
+/**
+ * Applies a typed character, BACKSPACE or DELETE_KEY at every cursor.
+ * Each touched row gets new chars and its old struct goes into a single
+ * UNDO_LINES record. Further keys on the same lines keep that record
+ * instead of adding one per key, so undo takes back the whole run.
+ */
+void cursors_edit(int key) {
+    int n;
+    struct cursor *all = cursors_gather(&n);
+    int *lines = malloc(sizeof(int) * n);
+    int *xs = malloc(sizeof(int) * n);
+    editor_row *saved = malloc(sizeof(editor_row) * n);
+    int nlines = 0;
+    int undo_x = E.cursor_x, undo_y = E.cursor_y;
+
+    for (int j = 0, m; j < n; j = m) {
+        int y = all[j].y;
+        for (m = j; m < n && all[m].y == y; m++)
+            xs[m - j] = all[m].x;
+        if (y >= E.numrows) continue;
+
+        int size;
+        char *chars = cursors_edit_row(&E.row[y], xs, m - j, key, &size);
+        row_swap_chars(&E.row[y], chars, size, &saved[nlines]);
+        lines[nlines++] = y;
+        for (int k = j; k < m; k++)
+            all[k].x = xs[k - j];
+    }
+    free(xs);
+    cursors_scatter(all, n);
+
+    if (nlines == 0) {
+        free(lines);
+        free(saved);
+        return;
+    }
+
+    lines_updated(lines, nlines);
+
+    undo_t *top = E.undo_len > 0 ? &E.undo_stack[E.undo_len - 1] : NULL;
+    if (top && E.cursors_undo == E.undo_len && top->type == UNDO_LINES &&
+        top->len == nlines && memcmp(top->lines, lines, sizeof(int) * nlines) == 0) {
+        // the record from the first key of the run already has the old rows
+        for (int k = 0; k < nlines; k++)
+            free_row(&saved[k]);
+        free(saved);
+        free(lines);
+    } else {
+        undo_push((undo_t){ UNDO_LINES, undo_x, undo_y, NULL, nlines, saved, 0, lines });
+    }
+    E.cursors_undo = E.undo_len;
+}
+
+/**
+ * Handles a key while there are extra cursors. Returns 0 for keys that are
+ * not batched, those drop the extra cursors and act on the primary one.
+ */
+int cursors_keypress(int c) {
+    switch (c) {
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case HOME_KEY:
+        case END_KEY:
+            cursors_move(c);
+            return 1;
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+            cursors_edit(BACKSPACE);
+            return 1;
+        case DELETE_KEY:
+            cursors_edit(DELETE_KEY);
+            return 1;
+        case CTRL_KEY('d'):
+            return 0;
+    }
+    if (c == '\t' || (c >= 32 && c < 127)) {
+        cursors_edit(c);
+        return 1;
+    }
+
+    E.ncursors = 0;
+    return 0;
+}
+
+/*** Block selection ***/
+
+/**
+ * ^W makes the selection rectangular: the rows between the mark and the
+ * cursor, and the screen columns between theirs. Every operation rebuilds
+ * each row of the block once, mapping the columns with row_rx_to_cx() so
+ * tabs are handled, and is recorded as one UNDO_LINES entry.
+ */
+
+// Gets the block as rows sy..ey and render columns [left, right)
+int block_range(int *sy, int *ey, int *left, int *right) {
+    if (!E.sel_active || !E.sel_block || E.numrows == 0) return 0;
+
+    int ay = E.sel_y < E.numrows ? E.sel_y : E.numrows - 1;
+    int by = E.cursor_y < E.numrows ? E.cursor_y : E.numrows - 1;
+    int ax = E.sel_x < E.row[ay].size ? E.sel_x : E.row[ay].size;
+    int bx = E.cursor_x < E.row[by].size ? E.cursor_x : E.row[by].size;
+    int arx = row_cx_to_rx(&E.row[ay], ax);
+    int brx = row_cx_to_rx(&E.row[by], bx);
+
+    *sy = ay < by ? ay : by;
+    *ey = ay < by ? by : ay;
+    *left = arx < brx ? arx : brx;
+    *right = arx < brx ? brx : arx;
+    return 1;
+}
+
+/**
+ * Replaces columns [left, right) of rows sy..ey with the matching row of
+ * ins, or with nothing when ins is NULL. Rows too short to reach left are
+ * padded with spaces before inserting. Each changed row gets its new chars
+ * in one allocation, and all of them go into one undo record.
+ */
+void block_splice(int sy, int ey, int left, int right, editor_row *ins) {
+    int n = ey - sy + 1;
+    int *lines = malloc(sizeof(int) * n);
+    editor_row *saved = malloc(sizeof(editor_row) * n);
+    int nlines = 0;
+
+    for (int y = sy; y <= ey; y++) {
+        editor_row *row = &E.row[y];
+        int cx0 = row_rx_to_cx(row, left);
+        int cx1 = row_rx_to_cx(row, right);
+        int inslen = ins ? ins[y - sy].size : 0;
+        if (cx0 == cx1 && inslen == 0) continue;
+
+        int pad = 0;
+        if (inslen > 0 && cx0 == row->size) {
+            pad = left - row_cx_to_rx(row, row->size);
+            if (pad < 0) pad = 0;
+        }
+
+        int size = row->size - (cx1 - cx0) + pad + inslen;
+        char *chars = malloc(size + 1);
+        memcpy(chars, row->chars, cx0);
+        memset(&chars[cx0], ' ', pad);
+        if (inslen > 0)
+            memcpy(&chars[cx0 + pad], ins[y - sy].chars, inslen);
+        memcpy(&chars[cx0 + pad + inslen], &row->chars[cx1], row->size - cx1);
+        chars[size] = '\0';
+
+        row_swap_chars(row, chars, size, &saved[nlines]);
+        lines[nlines++] = y;
+    }
+
+    if (nlines == 0) {
+        free(lines);
+        free(saved);
+        return;
+    }
+    // highlighted when drawn, like ex_substitute()
+    words_lines(lines, nlines);
+    E.dirty++;
+    macro_touched(lines[0], lines[nlines - 1] + 1);
+    highlight_stale(lines[0]);
+    undo_push((undo_t){ UNDO_LINES, E.cursor_x, E.cursor_y, NULL, nlines, saved, 0, lines });
+}
+
+// Puts the cursor on row y at screen column rx and drops the selection
+void block_leave(int y, int rx) {
+    E.cursor_y = y;
+    E.cursor_x = row_rx_to_cx(&E.row[y], rx);
+    E.sel_active = 0;
+}
+
+void block_copy(int cut) {
+    int sy, ey, left, right;
+    if (!block_range(&sy, &ey, &left, &right)) return;
+
+    int n = ey - sy + 1;
+    editor_row *rows = malloc(sizeof(editor_row) * n);
+    for (int y = sy; y <= ey; y++) {
+        editor_row *row = &E.row[y];
+        rows[y - sy] = row_join(row, 0, row, row_rx_to_cx(row, left), row_rx_to_cx(row, right));
+    }
+    clipboard_set(rows, n);
+    C.block = 1;
+
+    if (cut) {
+        block_splice(sy, ey, left, right, NULL);
+        block_leave(sy, left);
+    } else {
+        E.sel_active = 0;
+        set_prompt_message("%d x %d block copied", n, right - left);
+    }
+}
+
+// Inserts a block from the clipboard at the cursor's column, one line per row
+void block_paste() {
+    if (E.cursor_y >= E.numrows) return;
+
+    editor_row *row = &E.row[E.cursor_y];
+    int left = row_cx_to_rx(row, E.cursor_x < row->size ? E.cursor_x : row->size);
+    int ey = E.cursor_y + C.numrows - 1;
+    if (ey >= E.numrows) {
+        ey = E.numrows - 1;
+        set_prompt_message("Block cut short at the end of the file");
+    }
+    block_splice(E.cursor_y, ey, left, left, C.rows);
+}
+
+/**
+ * Turns the block into one cursor per row at its left edge, first deleting
+ * its contents if delete is set, so typing goes into every row.
+ */
+void block_to_cursors(int delete) {
+    int sy, ey, left, right;
+    if (!block_range(&sy, &ey, &left, &right)) return;
+    if (delete && right > left)
+        block_splice(sy, ey, left, right, NULL);
+
+    int primary = E.cursor_y < sy ? sy : (E.cursor_y > ey ? ey : E.cursor_y);
+    block_leave(primary, left);
+
+    cursors_reserve(ey - sy + 1);
+    E.ncursors = 0;
+    for (int y = sy; y <= ey; y++)
+        if (y != primary)
+            E.cursors[E.ncursors++] = (struct cursor){ row_rx_to_cx(&E.row[y], left), y, 0 };
+    E.cursors_undo = -1;
+}
+
+/**
+ * Handles a key while a block is selected. Returns 0 for keys that are not
+ * block operations, movement then resizes the block as usual.
+ */
+int block_keypress(int c) {
+    int sy, ey, left, right;
+    if (!block_range(&sy, &ey, &left, &right)) return 0;
+
+    switch (c) {
+        case CTRL_KEY('c'):
+        case CTRL_KEY('x'):
+            block_copy(c == CTRL_KEY('x'));
+            return 1;
+        case CTRL_KEY('k'):
+            delete_lines(sy, ey - sy + 1);
+            E.sel_active = 0;
+            return 1;
+        case CTRL_KEY('d'):
+            block_to_cursors(0);
+            return 1;
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+        case DELETE_KEY:
+            if (right > left) {
+                block_splice(sy, ey, left, right, NULL);
+                block_leave(E.cursor_y < E.numrows ? E.cursor_y : ey, left);
+            } else {
+                block_to_cursors(0);
+                cursors_edit(c == DELETE_KEY ? DELETE_KEY : BACKSPACE);
+            }
+            return 1;
+    }
+    if (c == '\t' || (c >= 32 && c < 127)) {
+        block_to_cursors(1);
+        cursors_edit(c);
+        return 1;
+    }
+    return 0;
+}
+
+/*** Macros ***/
+
+/**
+ * Records what a replay touches: rows [from, numrows - tail) cover every
+ * change so far. Counting the end from the bottom of the buffer keeps it
+ * right when rows are inserted or deleted above it. Returns 1 while a macro
+ * replays, in which case the caller skips highlighting.
+ */
+int macro_touched(int from, int to) {
+    if (!M.replaying) return 0;
+
+    if (from < M.from) M.from = from;
+    if (E.numrows - to < M.tail) M.tail = E.numrows - to;
+    return 1;
+}
+
+void macro_record(int c) {
+    if (M.len == M.cap) {
+        M.cap = M.cap ? M.cap * 2 : 64;
+        M.keys = realloc(M.keys, sizeof(int) * M.cap);
+    }
+    M.keys[M.len++] = c;
+}
+
+// ^T starts recording, the next ^T stops it
+void macro_toggle() {
+    if (M.recording) {
+        M.recording = 0;
+        M.len--; // the ^T that stopped it
+        set_prompt_message("Macro recorded, %d keys. ^U replays it", M.len);
+    } else {
+        M.recording = 1;
+        M.len = 0;
+        set_prompt_message("Recording macro, ^T stops");
+    }
+}
+
+void macro_run_once() {
+    M.pos = 0;
+    while (M.pos < M.len)
+        process_keypress();
+}
+
+/**
+ * Replays the macro `times` times from the cursor, or once on every line
+ * from the cursor down when times is -1 (starting at the beginning of the
+ * line, and skipping the lines a run inserts).
+ *
+ * Nothing is drawn during the replay, rows are rendered but not
+ * highlighted, and the keys don't push undo records. All rows are shared
+ * into a snapshot first (no text is copied); at the end only the touched
+ * range [M.from, numrows - M.tail) is highlighted, once, and its old rows
+ * from the snapshot become a single undo record.
+ */
+void macro_replay(int times) {
+    int numrows = E.numrows;
+    editor_row *snapshot = malloc(sizeof(editor_row) * (numrows > 0 ? numrows : 1));
+    for (int j = 0; j < numrows; j++)
+        snapshot[j] = row_share(&E.row[j]);
+
+    M.replaying = 1;
+    M.from = INT_MAX;
+    M.tail = INT_MAX;
+    if (times < 0) {
+        int y = E.cursor_y;
+        while (y < E.numrows) {
+            int before = E.numrows;
+            E.cursor_y = y;
+            E.cursor_x = 0;
+            macro_run_once();
+            int step = 1 + E.numrows - before;
+            y += step > 0 ? step : 0;
+        }
+    } else {
+        while (times--)
+            macro_run_once();
+    }
+    M.replaying = 0;
+
+    if (M.from == INT_MAX) { // nothing changed
+        for (int j = 0; j < numrows; j++)
+            free_row(&snapshot[j]);
+        free(snapshot);
+        return;
+    }
+    int end = E.numrows - M.tail, old_end = numrows - M.tail;
+    if (end < M.from) end = M.from;
+    if (old_end < M.from) old_end = M.from;
+
+    for (int j = 0; j < numrows; j++)
+        if (j < M.from || j >= old_end)
+            free_row(&snapshot[j]);
+    editor_row *rows = malloc(sizeof(editor_row) * (old_end > M.from ? old_end - M.from : 1));
+    memcpy(rows, &snapshot[M.from], sizeof(editor_row) * (old_end - M.from));
+    free(snapshot);
+
+    update_row_range(M.from, end);
+    undo_push((undo_t){ UNDO_ROWS, 0, M.from, NULL, old_end - M.from, rows, end - M.from, NULL });
+}
+
+void macro_prompt() {
+    if (M.recording) {
+        M.len--; // the ^U itself
+        set_prompt_message("Stop recording (^T) before replaying");
+        return;
+    }
+    if (M.len == 0) {
+        set_prompt_message("No macro recorded, ^T starts recording");
+        return;
+    }
+
+    char *answer = get_user_input("Replay macro how many times (* = on every line below): %s", NULL);
+    if (answer == NULL) return;
+
+    if (strcmp(answer, "*") == 0)
+        macro_replay(-1);
+    else if (atoi(answer) > 0)
+        macro_replay(atoi(answer));
+    free(answer);
+}
+
+/*** Sort ***/
+
+/**
+ * :sort and :uniq work on row structs, never on text. The sort is a stable
+ * merge sort of small keys: each thread builds the keys for its slice of
+ * the range and sorts it, then the slices are merged pairwise, every merge
+ * split between threads along its merge path. The result is one
+ * permutation, applied to E.row in one pass and kept as the undo record.
+ */
+#define SORT_MAX_THREADS 16
+#define SORT_MIN_SLICE 16384
+
+enum sort_flags {
+    SORT_NUMERIC = 1,
+    SORT_REVERSE = 2
+};
+
+struct sort_key {
+    int row;    // index in E.row
+    int off;    // where the compared text starts (the column for k)
+    double num; // SORT_NUMERIC: the number found there
+};
+
+struct sort_job {
+    struct sort_key *a, *b, *out, *tmp;
+    int na, nb;
+    int from, to; // the slice of out this job writes
+    int column;   // key building: 1-based column, 0 for the whole line
+};
+
+int sort_flags;
+
+int sort_cmp(const struct sort_key *x, const struct sort_key *y) {
+    int c;
+    if (sort_flags & SORT_NUMERIC) {
+        c = (x->num > y->num) - (x->num < y->num);
+    } else {
+        editor_row *rx = &E.row[x->row], *ry = &E.row[y->row];
+        int lx = rx->size - x->off, ly = ry->size - y->off;
+        c = memcmp(rx->chars + x->off, ry->chars + y->off, lx < ly ? lx : ly);
+        if (c == 0) c = (lx > ly) - (lx < ly);
+    }
+    return (sort_flags & SORT_REVERSE) ? -c : c;
+}
+
+void sort_key_build(struct sort_key *k, int row, int column) {
+    editor_row *r = &E.row[row];
+    int off = 0;
+
+    if (column > 0) {
+        while (off < r->size && isspace((unsigned char)r->chars[off])) off++;
+        for (int f = 1; f < column && off < r->size; f++) {
+            while (off < r->size && !isspace((unsigned char)r->chars[off])) off++;
+            while (off < r->size && isspace((unsigned char)r->chars[off])) off++;
+        }
+    }
+    k->row = row;
+    k->off = off;
+    k->num = -HUGE_VAL;
+    if (sort_flags & SORT_NUMERIC) {
+        // rows without a number sort first, in their old order
+        char *p = r->chars + off, *end;
+        while (*p && !isdigit((unsigned char)*p) &&
+               !((*p == '-' || *p == '.') && isdigit((unsigned char)p[1])))
+            p++;
+        double num = strtod(p, &end);
+        if (end != p) k->num = num;
+    }
+}
+
+// Stable merge of a and b into out
+void sort_merge(const struct sort_key *a, int na, const struct sort_key *b, int nb,
+                struct sort_key *out) {
+    int i = 0, j = 0, k = 0;
+    while (i < na && j < nb)
+        out[k++] = (sort_cmp(&b[j], &a[i]) < 0) ? b[j++] : a[i++];
+    while (i < na) out[k++] = a[i++];
+    while (j < nb) out[k++] = b[j++];
+}
+
+// Sorts keys[0..n) using tmp, leaving the result in keys
+void sort_keys(struct sort_key *keys, struct sort_key *tmp, int n) {
+    if (n < 2) return;
+    if (n <= 16) {
+        for (int i = 1; i < n; i++) {
+            struct sort_key k = keys[i];
+            int j = i;
+            for (; j > 0 && sort_cmp(&k, &keys[j - 1]) < 0; j--)
+                keys[j] = keys[j - 1];
+            keys[j] = k;
+        }
+        return;
+    }
+    int half = n / 2;
+    sort_keys(keys, tmp, half);
+    sort_keys(keys + half, tmp + half, n - half);
+    if (sort_cmp(&keys[half], &keys[half - 1]) >= 0) return;
+    sort_merge(keys, half, keys + half, n - half, tmp);
+    memcpy(keys, tmp, sizeof(struct sort_key) * n);
+}
+
+/**
+ * How many of the first d merged keys come from a: the first i for which
+ * a[i] no longer goes before b[d - i - 1]. Ties go to a, as in sort_merge().
+ */
+int sort_split(const struct sort_key *a, int na, const struct sort_key *b, int nb, int d) {
+    int lo = d > nb ? d - nb : 0, hi = d < na ? d : na;
+    while (lo < hi) {
+        int i = lo + (hi - lo) / 2;
+        if (sort_cmp(&b[d - i - 1], &a[i]) >= 0)
+            lo = i + 1;
+        else
+            hi = i;
+    }
+    return lo;
+}
+
+void *sort_slice_thread(void *arg) {
+    struct sort_job *job = arg;
+    for (int j = 0; j < job->na; j++)
+        sort_key_build(&job->a[j], job->from + j, job->column);
+    sort_keys(job->a, job->tmp, job->na);
+    return NULL;
+}
+
+void *sort_merge_thread(void *arg) {
+    struct sort_job *job = arg;
+    int i0 = sort_split(job->a, job->na, job->b, job->nb, job->from);
+    int i1 = sort_split(job->a, job->na, job->b, job->nb, job->to);
+    int j0 = job->from - i0, j1 = job->to - i1;
+    sort_merge(job->a + i0, i1 - i0, job->b + j0, j1 - j0, job->out + job->from);
+    return NULL;
+}
+
+// Runs the jobs on up to n threads, doing the last one on this thread
+void sort_run(void *(*fn)(void *), struct sort_job *jobs, int n) {
+    pthread_t threads[SORT_MAX_THREADS];
+    int started = 0;
+    for (int t = 0; t < n - 1; t++) {
+        if (pthread_create(&threads[t], NULL, fn, &jobs[t]) != 0) break;
+        started++;
+    }
+    for (int t = started; t < n; t++)
+        fn(&jobs[t]);
+    for (int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+}
+
+/**
+ * Returns the order of rows [from, to) sorted by flags and column, as
+ * offsets from `from`. The caller frees it.
+ */
+int *sort_order(int from, int to, int flags, int column) {
+    int n = to - from;
+    struct sort_key *keys = malloc(sizeof(struct sort_key) * n);
+    struct sort_key *tmp = malloc(sizeof(struct sort_key) * n);
+    struct sort_job jobs[SORT_MAX_THREADS];
+    int bounds[SORT_MAX_THREADS + 1];
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = cores < 1 ? 1 : (cores > SORT_MAX_THREADS ? SORT_MAX_THREADS : cores);
+    if (nthreads > n / SORT_MIN_SLICE) nthreads = n / SORT_MIN_SLICE > 0 ? n / SORT_MIN_SLICE : 1;
+    sort_flags = flags;
+
+    int nslices = nthreads;
+    for (int t = 0; t <= nslices; t++)
+        bounds[t] = (int)((long long)n * t / nslices);
+    for (int t = 0; t < nslices; t++)
+        jobs[t] = (struct sort_job){ keys + bounds[t], NULL, NULL, tmp + bounds[t],
+                                     bounds[t + 1] - bounds[t], 0,
+                                     from + bounds[t], 0, column };
+    sort_run(sort_slice_thread, jobs, nslices);
+
+    // merge neighbouring runs until one is left, swapping keys and tmp
+    while (nslices > 1) {
+        int njobs = 0, nruns = 0;
+        int per = nthreads / (nslices / 2);
+        if (per < 1) per = 1;
+        for (int s = 0; s + 1 < nslices; s += 2) {
+            int lo = bounds[s], mid = bounds[s + 1], hi = bounds[s + 2];
+            for (int p = 0; p < per; p++)
+                jobs[njobs++] = (struct sort_job){ keys + lo, keys + mid, tmp + lo, NULL,
+                                                   mid - lo, hi - mid,
+                                                   (int)((long long)(hi - lo) * p / per),
+                                                   (int)((long long)(hi - lo) * (p + 1) / per), 0 };
+            bounds[nruns++] = lo;
+        }
+        if (nslices % 2) {
+            int lo = bounds[nslices - 1], hi = bounds[nslices];
+            memcpy(tmp + lo, keys + lo, sizeof(struct sort_key) * (hi - lo));
+            bounds[nruns++] = lo;
+        }
+        bounds[nruns] = n;
+        sort_run(sort_merge_thread, jobs, njobs);
+        nslices = nruns;
+
+        struct sort_key *swap = keys;
+        keys = tmp;
+        tmp = swap;
+    }
+
+    int *order = malloc(sizeof(int) * (n > 0 ? n : 1));
+    for (int j = 0; j < n; j++)
+        order[j] = keys[j].row - from;
+    free(keys);
+    free(tmp);
+    return order;
+}
+
+/**
+ * Puts rows [at, at + n) in the given order: the row that ends up at
+ * at + j is the one at at + order[j] (or the other way round, inverse).
+ */
+void rows_permute(int at, int n, const int *order, int inverse) {
+    editor_row *rows = malloc(sizeof(editor_row) * (n > 0 ? n : 1));
+    for (int j = 0; j < n; j++) {
+        if (inverse) {
+            rows[order[j]] = E.row[at + j];
+            rows[order[j]].moved += order[j] - j;
+        } else {
+            rows[j] = E.row[at + order[j]];
+            rows[j].moved += j - order[j];
+        }
+    }
+    for (int j = 0; j < n; j++) {
+        E.row[at + j] = rows[j];
+        E.row[at + j].index = at + j;
+    }
+    free(rows);
+    row_trees_drop(at);
+    E.dirty++;
+    macro_touched(at, at + n);
+    highlight_stale(at);
+}
+
+void sort_lines(int from, int to, int flags, int column) {
+    int n = to - from;
+    if (n < 2) return;
+
+    int *order = sort_order(from, to, flags, column);
+    int moved = 0;
+    for (int j = 0; j < n && !moved; j++)
+        moved = order[j] != j;
+    if (!moved) {
+        free(order);
+        set_prompt_message("%d lines already sorted", n);
+        return;
+    }
+
+    rows_permute(from, n, order, 0);
+    undo_push((undo_t){ UNDO_SORT, 0, from, NULL, n, NULL, 0, order });
+    E.cursor_y = from;
+    E.cursor_x = 0;
+    set_prompt_message("%d lines sorted", n);
+}
+
+// Deletes each row in [from, to) that repeats the one before it
+void uniq_lines(int from, int to) {
+    unsigned char *drop = calloc(E.numrows > 0 ? E.numrows : 1, 1);
+    editor_row *last = NULL;
+
+    for (int j = from; j < to; j++) {
+        editor_row *row = &E.row[j];
+        if (last && last->size == row->size &&
+            (last->chars == row->chars || memcmp(last->chars, row->chars, row->size) == 0))
+            drop[j] = 1;
+        else
+            last = row;
+    }
+
+    int n = remove_marked_rows(drop);
+    free(drop);
+    if (n == 0) {
+        set_prompt_message("No duplicate lines");
+        return;
+    }
+    E.cursor_y = from < E.numrows ? from : E.numrows;
+    E.cursor_x = 0;
+    set_prompt_message("%d duplicate lines deleted", n);
+}
+
+/*** Filter ***/
+
+/**
+ * :!cmd pipes rows through `sh -c cmd` and replaces them with its output.
+ * The rows are written straight from their chars with writev() while the
+ * output is read and split into new rows as it arrives. Both pipe ends
+ * are non-blocking and served by one poll() loop, so a command that
+ * writes before it has read all its input can't deadlock with us, and
+ * nothing is staged in a temp file or a joined copy of the text.
+ */
+#define FILTER_IOV 64
+#define FILTER_CHUNK (1 << 16)
+#define FILTER_LONG 4096
+
+struct filter_output {
+    editor_row *rows;
+    int numrows, cap;
+    char *partial; // a line still waiting for its '\n'
+    size_t plen, pcap;
+};
+
+void filter_add_row(struct filter_output *o, const char *s, size_t len) {
+    if (len > 0 && s[len - 1] == '\r') len--;
+    if (o->numrows == o->cap) {
+        o->cap = o->cap ? o->cap * 2 : 1024;
+        o->rows = realloc(o->rows, sizeof(editor_row) * o->cap);
+    }
+    o->rows[o->numrows++] = row_from(s, len);
+}
+
+void filter_partial(struct filter_output *o, const char *s, size_t len) {
+    if (o->plen + len > o->pcap) {
+        o->pcap = (o->plen + len) * 2;
+        o->partial = realloc(o->partial, o->pcap);
+    }
+    memcpy(&o->partial[o->plen], s, len);
+    o->plen += len;
+}
+
+// Splits a chunk of output into rows
+void filter_take(struct filter_output *o, const char *buf, size_t len) {
+    const char *p = buf, *end = buf + len;
+
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        if (nl == NULL) {
+            filter_partial(o, p, end - p);
+            break;
+        }
+        if (o->plen > 0) {
+            filter_partial(o, p, nl - p);
+            filter_add_row(o, o->partial, o->plen);
+            o->plen = 0;
+        } else {
+            filter_add_row(o, p, nl - p);
+        }
+        p = nl + 1;
+    }
+}
+
+/**
+ * Writes as much of rows [*row, to) as the pipe takes, *off being how much
+ * of row *row (counting its '\n') is already out. Short rows are packed
+ * into stage, a FILTER_CHUNK buffer, so the kernel isn't handed an iovec
+ * per line; long ones go out straight from their chars. Returns -1 once
+ * the command stops reading.
+ */
+int filter_write(int fd, int *row, size_t *off, int to, char *stage) {
+    struct iovec iov[FILTER_IOV];
+    int n = 0;
+    size_t used = 0, queued = 0, seg = 0; // seg: start of the open stage run
+
+    for (int j = *row; j < to && queued < FILTER_CHUNK && n + 3 <= FILTER_IOV; j++) {
+        editor_row *r = &E.row[j];
+        size_t skip = (j == *row) ? *off : 0;
+        size_t len = skip < (size_t)r->size ? r->size - skip : 0;
+
+        if (len >= FILTER_LONG) {
+            if (used > seg) iov[n++] = (struct iovec){ stage + seg, used - seg };
+            iov[n++] = (struct iovec){ r->chars + skip, len };
+            seg = used;
+        } else {
+            if (used + len + 1 > FILTER_CHUNK) break;
+            memcpy(stage + used, r->chars + skip, len);
+            used += len;
+        }
+        stage[used++] = '\n';
+        queued += len + 1;
+    }
+    if (used > seg) iov[n++] = (struct iovec){ stage + seg, used - seg };
+
+    ssize_t written = writev(fd, iov, n);
+    if (written == -1)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+    while (written > 0) {
+        size_t left = E.row[*row].size + 1 - *off;
+        if ((size_t)written >= left) {
+            written -= left;
+            (*row)++;
+            *off = 0;
+        } else {
+            *off += written;
+            written = 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Replaces rows [from, to) with the output of cmd, fed those rows on its
+ * stdin: one splice and one undo record. The buffer is left alone if the
+ * command can't be run, or fails without printing anything.
+ */
+void filter_rows(int from, int to, const char *cmd) {
+    int in[2], out[2];
+    if (pipe(in) == -1) {
+        set_prompt_message("pipe: %s", strerror(errno));
+        return;
+    }
+    if (pipe(out) == -1) {
+        set_prompt_message("pipe: %s", strerror(errno));
+        close(in[0]);
+        close(in[1]);
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        if (null != -1) dup2(null, STDERR_FILENO);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    if (pid == -1) {
+        set_prompt_message("fork: %s", strerror(errno));
+        close(in[1]);
+        close(out[0]);
+        return;
+    }
+
+    // a command that exits without reading must not kill us with SIGPIPE
+    void (*old_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+    fcntl(in[1], F_SETFL, O_NONBLOCK);
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+
+    struct filter_output o = { 0 };
+    char *buf = malloc(FILTER_CHUNK), *stage = malloc(FILTER_CHUNK);
+    int wfd = in[1], rfd = out[0];
+    int row = from;
+    size_t off = 0;
+    if (row >= to) {
+        close(wfd);
+        wfd = -1;
+    }
+
+    while (rfd != -1) {
+        struct pollfd fds[2] = {
+            { rfd, POLLIN, 0 },
+            { wfd, POLLOUT, 0 }
+        };
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (wfd != -1 && fds[1].revents) {
+            if (filter_write(wfd, &row, &off, to, stage) == -1 || row >= to) {
+                close(wfd);
+                wfd = -1;
+            }
+        }
+        if (fds[0].revents) {
+            ssize_t nread = read(rfd, buf, FILTER_CHUNK);
+            if (nread > 0) {
+                filter_take(&o, buf, nread);
+            } else if (nread == 0 || (errno != EAGAIN && errno != EINTR)) {
+                close(rfd);
+                rfd = -1;
+            }
+        }
+    }
+    if (wfd != -1) close(wfd);
+    if (rfd != -1) close(rfd);
+    free(buf);
+    free(stage);
+    if (o.plen > 0)
+        filter_add_row(&o, o.partial, o.plen);
+    free(o.partial);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    signal(SIGPIPE, old_sigpipe);
+
+    int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    if (code == 127 || (code != 0 && o.numrows == 0)) {
+        for (int j = 0; j < o.numrows; j++)
+            free_row(&o.rows[j]);
+        free(o.rows);
+        set_prompt_message("Command failed (exit %d), nothing changed", code);
+        return;
+    }
+
+    editor_row *removed;
+    row_splice(from, to - from, o.rows, o.numrows, &removed);
+    free(o.rows);
+    undo_push((undo_t){ UNDO_ROWS, 0, from, NULL, to - from, removed, o.numrows, NULL });
+
+    E.cursor_y = from;
+    E.cursor_x = 0;
+    E.sel_active = 0;
+    if (code != 0)
+        set_prompt_message("%d lines in, %d out (exit %d)", to - from, o.numrows, code);
+    else
+        set_prompt_message("%d lines in, %d out", to - from, o.numrows);
+}
+
+/*** Ex commands ***/
+
+/**
+ * ^E opens a command line for whole-buffer batch operations:
+ *
+ *   :g/pat/d        delete the lines matching pat (:g!/pat/d, :v/pat/d the others)
+ *   :%s/a/b/[g]     substitute on every line (:s on the cursor line, :N,Ms on a range)
+ *   :N              go to line N
+ *   :!cmd           filter the selected lines, or all of them, through cmd
+ *   :sort [nr][kN]  sort them: numerically, in reverse, by the Nth column
+ *   :uniq           delete the ones that repeat the line before
+ *   :N,Mfold        fold lines N+1..M under line N (:fold toggles the cursor's)
+ *   :fold all       fold every block (:fold indent by indentation), :unfold
+ *   :goto N         go to byte offset N, counted from 0 (:goto shows the cursor's)
+ *   :diff           show the changes against the file on disk, see Diff
+ *
+ * Each runs as a single pass over E.row. Deletions build the surviving
+ * rows as a new array that replaces E.row at once; substitutions only give
+ * new chars to the rows that change. Neither highlights anything, they mark
+ * the rows stale and draw_rows() catches up on what ends up on screen.
+ */
+
+// Plain text is searched with memmem(), anything else as a POSIX ERE
+struct ex_pattern {
+    char *text;
+    int len;
+    int is_regex;
+    regex_t re;
+};
+
+int ex_pattern_compile(struct ex_pattern *p, char *text) {
+    p->text = text;
+    p->len = strlen(text);
+    p->is_regex = (strpbrk(text, ".[]*^$\\+?(){}|") != NULL);
+    if (p->is_regex && regcomp(&p->re, text, REG_EXTENDED) != 0) {
+        set_prompt_message("Bad pattern: %s", text);
+        return -1;
+    }
+    return 0;
+}
+
+void ex_pattern_free(struct ex_pattern *p) {
+    if (p->is_regex) regfree(&p->re);
+}
+
+// Finds p in row chars from `from` on, setting [*start, *end) of the match
+int ex_match(struct ex_pattern *p, editor_row *row, int from, int *start, int *end) {
+    if (!p->is_regex) {
+        char *m = memmem(&row->chars[from], row->size - from, p->text, p->len);
+        if (m == NULL) return 0;
+        *start = m - row->chars;
+        *end = *start + p->len;
+        return 1;
+    }
+
+    regmatch_t m;
+    if (regexec(&p->re, &row->chars[from], 1, &m, from > 0 ? REG_NOTBOL : 0) != 0)
+        return 0;
+    *start = from + m.rm_so;
+    *end = from + m.rm_eo;
+    return 1;
+}
+
+/**
+ * Reads a field up to the next unescaped delim and advances *s past it.
+ * An escaped delimiter loses its backslash, other escapes are kept for
+ * the regex.
+ */
+char *ex_field(char **s, char delim) {
+    char *out = malloc(strlen(*s) + 1);
+    int len = 0;
+    char *p = *s;
+
+    while (*p && *p != delim) {
+        if (p[0] == '\\' && p[1] == delim)
+            p++;
+        out[len++] = *p++;
+    }
+    out[len] = '\0';
+    *s = *p ? p + 1 : p;
+    return out;
+}
+
+// Deletes the lines that match p (or that don't, when keep_matching)
+void ex_global(struct ex_pattern *p, int keep_matching) {
+    unsigned char *drop = malloc(E.numrows > 0 ? E.numrows : 1);
+    int start, end;
+
+    for (int j = 0; j < E.numrows; j++)
+        drop[j] = ex_match(p, &E.row[j], 0, &start, &end) != keep_matching;
+
+    int n = remove_marked_rows(drop);
+    free(drop);
+    if (n == 0) {
+        set_prompt_message("No lines deleted");
+        return;
+    }
+    if (E.cursor_y > E.numrows) E.cursor_y = E.numrows;
+    E.cursor_x = 0;
+    set_prompt_message("%d lines deleted", n);
+}
+
+/**
+ * Builds the chars of a row with the matches of p replaced by rep, the
+ * first one only unless global. Returns NULL when nothing matched.
+ */
+char *ex_substitute_row(struct ex_pattern *p, editor_row *row, const char *rep, int global, int *size, int *count) {
+    int replen = strlen(rep);
+    int cap = row->size + replen + 1, len = 0, from = 0, start, end;
+    char *chars = NULL;
+
+    while (from <= row->size && ex_match(p, row, from, &start, &end)) {
+        if (chars == NULL) chars = malloc(cap);
+        int need = len + (start - from) + replen + (row->size - end) + 2;
+        if (need > cap) {
+            while (cap < need) cap *= 2;
+            chars = realloc(chars, cap);
+        }
+        memcpy(&chars[len], &row->chars[from], start - from);
+        len += start - from;
+        memcpy(&chars[len], rep, replen);
+        len += replen;
+        (*count)++;
+
+        from = end;
+        if (start == end) { // an empty match, step over one char
+            if (end < row->size) chars[len++] = row->chars[end];
+            from = end + 1;
+        }
+        if (!global) break;
+    }
+    if (chars == NULL) return NULL;
+
+    if (from < row->size) {
+        memcpy(&chars[len], &row->chars[from], row->size - from);
+        len += row->size - from;
+    }
+    chars[len] = '\0';
+    *size = len;
+    return chars;
+}
+
+// Substitutes on rows [from, to), all changed rows are one undo record
+void ex_substitute(struct ex_pattern *p, const char *rep, int global, int from, int to) {
+    int cap = 64, n = 0, count = 0;
+    int *lines = malloc(sizeof(int) * cap);
+    editor_row *saved = malloc(sizeof(editor_row) * cap);
+
+    for (int j = from; j < to; j++) {
+        int size;
+        char *chars = ex_substitute_row(p, &E.row[j], rep, global, &size, &count);
+        if (chars == NULL) continue;
+
+        if (n == cap) {
+            cap *= 2;
+            lines = realloc(lines, sizeof(int) * cap);
+            saved = realloc(saved, sizeof(editor_row) * cap);
+        }
+        row_swap_chars(&E.row[j], chars, size, &saved[n]);
+        lines[n++] = j;
+    }
+
+    if (n == 0) {
+        free(lines);
+        free(saved);
+        set_prompt_message("Pattern not found: %s", p->text);
+        return;
+    }
+
+    words_lines(lines, n);
+    E.dirty++;
+    macro_touched(lines[0], lines[n - 1] + 1);
+    highlight_stale(lines[0]);
+    undo_push((undo_t){ UNDO_LINES, E.cursor_x, E.cursor_y, NULL, n, saved, 0, lines });
+    if (E.cursor_y < E.numrows && E.cursor_x > E.row[E.cursor_y].size)
+        E.cursor_x = E.row[E.cursor_y].size;
+    set_prompt_message("%d substitutions on %d lines", count, n);
+}
+
+void ex_run(char *cmd) {
+    while (*cmd == ':' || *cmd == ' ') cmd++;
+    if (*cmd == '\0') return;
+
+    if (isdigit(*cmd) && cmd[strspn(cmd, "0123456789")] == '\0') {
+        int line = atoi(cmd);
+        E.cursor_y = line < 1 ? 0 : (line > E.numrows ? E.numrows : line - 1);
+        E.cursor_x = 0;
+        return;
+    }
+
+    // range: % for all lines, N,M, or the cursor line by default
+    int from = E.cursor_y, to = E.cursor_y + 1, ranged = 1;
+    if (*cmd == '%') {
+        from = 0;
+        to = E.numrows;
+        cmd++;
+    } else if (isdigit(*cmd)) {
+        from = strtol(cmd, &cmd, 10) - 1;
+        to = from + 1;
+        if (*cmd == ',') to = strtol(cmd + 1, &cmd, 10);
+    } else {
+        ranged = 0;
+    }
+    if (from < 0) from = 0;
+    if (to > E.numrows) to = E.numrows;
+
+    // without a range these work on the selected lines, else on all of them
+    int whole = *cmd == '!' || strncmp(cmd, "sort", 4) == 0 || strcmp(cmd, "uniq") == 0;
+    if (whole && !ranged) {
+        int sx, sy, ex, ey, left, right;
+        if (selection_range(&sx, &sy, &ex, &ey) || block_range(&sy, &ey, &left, &right)) {
+            from = sy;
+            to = ey + 1;
+        } else {
+            from = 0;
+            to = E.numrows;
+        }
+    }
+    if (whole) E.sel_active = 0;
+    if (from > to) return;
+
+    if (*cmd == '!') {
+        if (cmd[1] == '\0')
+            set_prompt_message("Usage: :!command");
+        else
+            filter_rows(from, to, cmd + 1);
+        return;
+    }
+    if (strncmp(cmd, "sort", 4) == 0) {
+        int flags = 0, column = 0;
+        for (cmd += 4; *cmd; cmd++) {
+            if (*cmd == 'n') flags |= SORT_NUMERIC;
+            else if (*cmd == 'r') flags |= SORT_REVERSE;
+            else if (*cmd == 'k') column = strtol(cmd + 1, &cmd, 10), cmd--;
+            else if (*cmd != ' ') break;
+        }
+        if (*cmd)
+            set_prompt_message("Usage: :sort [n] [r] [k N]");
+        else
+            sort_lines(from, to, flags, column);
+        return;
+    }
+    if (strcmp(cmd, "uniq") == 0) {
+        uniq_lines(from, to);
+        return;
+    }
+    if (strncmp(cmd, "fold", 4) == 0) {
+        cmd += 4;
+        while (*cmd == ' ') cmd++;
+        if (strcmp(cmd, "all") == 0 || strcmp(cmd, "indent") == 0)
+            fold_all(*cmd == 'i');
+        else if (*cmd == '\0' && ranged)
+            fold_set(from, to - from - 1);
+        else if (*cmd == '\0')
+            fold_toggle();
+        else
+            set_prompt_message("Usage: :fold [all|indent], :N,Mfold");
+        return;
+    }
+    if (strcmp(cmd, "unfold") == 0) {
+        unfold_all();
+        return;
+    }
+    if (strncmp(cmd, "goto", 4) == 0) {
+        cmd += 4;
+        while (*cmd == ' ') cmd++;
+        if (*cmd == '\0') {
+            set_prompt_message("Byte %lld of %lld", row_offset(E.cursor_y, E.cursor_x), E.stats.bytes);
+        } else if (isdigit(*cmd) && cmd[strspn(cmd, "0123456789")] == '\0') {
+            E.cursor_y = offset_row(strtoll(cmd, NULL, 10), &E.cursor_x);
+        } else {
+            set_prompt_message("Usage: :goto [byte offset]");
+        }
+        return;
+    }
+
+    if (strcmp(cmd, "diff") == 0) {
+        diff_show();
+        return;
+    }
+
+    char op = *cmd++;
+    int invert = 0;
+    if (op == 'g' && *cmd == '!') {
+        invert = 1;
+        cmd++;
+    }
+    if ((op != 'g' && op != 'v' && op != 's') || *cmd == '\0' || isalnum(*cmd)) {
+        set_prompt_message("Unknown command, try :g/pat/d :v/pat/d :%%s/a/b/g :sort :uniq :fold :!cmd :N :goto :diff");
+        return;
+    }
+
+    char delim = *cmd++;
+    char *pat = ex_field(&cmd, delim);
+    char *rep = (op == 's') ? ex_field(&cmd, delim) : NULL;
+    struct ex_pattern p;
+
+    if (op != 's' && strcmp(cmd, "d") != 0) {
+        set_prompt_message("Only :%c/pat/d is supported", op);
+    } else if (*pat == '\0') {
+        set_prompt_message("Empty pattern");
+    } else if (ex_pattern_compile(&p, pat) == 0) {
+        if (op == 's')
+            ex_substitute(&p, rep, strchr(cmd, 'g') != NULL, from, to);
+        else
+            ex_global(&p, op == 'v' || invert);
+        ex_pattern_free(&p);
+    }
+    free(pat);
+    free(rep);
+}
+
+void ex_prompt() {
+    char *cmd = get_user_input(":%s", NULL);
+    if (cmd == NULL) return;
+    ex_run(cmd);
+    free(cmd);
+}
+
+/*** file i/o ***/
+
+/**
+ * Converts the rows of the editor into a single string.
+ *
+ * This function calculates the total length of a concatenated string
+ * from multiple rows of text, including newline characters at the end
+ * of each row. It saves the total length into `buflen` to inform the
+ * caller of the string's length.
+ *
+ * After allocating the required memory, it loops through the rows,
+ * using `memcpy()` to copy the contents of each row to the buffer,
+ * appending a newline character after each row.
+ *
+ * The function returns the buffer, and it is the caller's responsibility
+ * to free the allocated memory.
+ *
+ * @param buflen Pointer where the total length of the resulting string will be stored.
+ * @return Pointer to the newly allocated string.
+ */
+char *rows_to_string(int *buflen) {
+    int totallen = E.stats.bytes;
+    int j;
+
+    *buflen = totallen;
+
+    char *buf = malloc(totallen);
+    char *p = buf;
+
+    for (j = 0; j < E.numrows; j++) {
+        memcpy(p, E.row[j].chars, E.row[j].size);
+        p += E.row[j].size;
+        *p = '\n';
+        p++;
+    }
+
+    return buf;
+}
+
+/**
+ * Appends raw file bytes to the end of the buffer as rows.
+ *
+ * Each '\n' terminated line becomes a new row (with a trailing '\r'
+ * dropped, like open_editor() does). When *open_tail is set the last row
+ * was not terminated yet, so the first line of buf continues it instead
+ * of starting a new row. On return *open_tail tells whether buf ended in
+ * the middle of a line. Only the touched rows are rendered and highlighted.
+ *
+ * @param buf The bytes to append.
+ * @param len Number of bytes in buf.
+ * @param open_tail In/out flag for an unterminated last row.
+ */
+void append_text(const char *buf, size_t len, int *open_tail) {
+    const char *p = buf;
+    const char *end = buf + len;
+
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        size_t linelen = (nl ? nl : end) - p;
+        if (nl && linelen > 0 && p[linelen - 1] == '\r')
+            linelen--;
+
+        if (*open_tail && E.numrows > 0) {
+            editor_row *row = &E.row[E.numrows - 1];
+            row_add_string(row, (char *)p, linelen);
+            if (nl && row->size > 0 && row->chars[row->size - 1] == '\r')
+                row_delete_char(row, row->size - 1);
+        } else {
+            insert_row(E.numrows, (char *)p, linelen);
+        }
+
+        *open_tail = (nl == NULL);
+        if (!nl) break;
+        p = nl + 1;
+    }
+}
+
+/**
+ * The fast load path: maps the file and splits it with memchr() into a new
+ * array of rows, without touching E. Trailing '\r's are dropped like
+ * before. The rows are not rendered yet, so they can be spliced into E.row
+ * in one go with row_splice(), which highlights them in one pass.
+ *
+ * @param filename The file to read.
+ * @param numrows Where the number of rows is stored.
+ * @param loaded If not NULL, receives the number of bytes read, which a
+ *        growing file may already have outgrown.
+ * @return The rows (caller owns them), or NULL with errno set.
+ */
+editor_row *load_rows(char *filename, int *numrows, off_t *loaded) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    char *map = NULL;
+    size_t size = st.st_size;
+    if (size > 0) {
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return NULL;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    // A line index left by the viewer tells us how many rows to expect
+    long cap = index_cache_lines(filename);
+    if (cap < 64) cap = 64;
+    editor_row *rows = malloc(sizeof(editor_row) * cap);
+    int n = 0;
+
+    const char *p = map;
+    const char *end = map + size;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        size_t len = (nl ? nl : end) - p;
+        while (len > 0 && p[len - 1] == '\r') len--;
+
+        if (n == cap) {
+            cap *= 2;
+            rows = realloc(rows, sizeof(editor_row) * cap);
+        }
+        rows[n++] = row_from(p, len);
+
+        if (!nl) break;
+        p = nl + 1;
+    }
+
+    if (map) munmap(map, size);
+    *numrows = n;
+    if (loaded) *loaded = size;
+    return rows;
+}
+
+void open_editor(char *filename) {
+    free(E.filename);
+    // copies a given str, allocating required memory
+    E.filename = strdup(filename);
+
+    select_highlight();
+
+    int n;
+    editor_row *rows = load_rows(filename, &n, &E.follow.offset); // see follow_start()
+    if (rows == NULL) die("open");
+
+    row_splice(E.numrows, 0, rows, n, NULL);
+    free(rows);
+    rows_saved(0, E.numrows);
+    E.dirty = 0;
+}
+
+/**
+ * Reads a file into the buffer at the cursor: above the cursor row when
+ * the cursor is at column 0, below it otherwise. The rows are loaded and
+ * spliced in as one block, highlighted in one pass and undone as one step.
+ */
+void insert_file() {
+    char *filename = get_user_input("Insert file: %s (ESC to cancel)", NULL);
+    if (filename == NULL) return;
+
+    int n;
+    editor_row *rows = load_rows(filename, &n, NULL);
+    if (rows == NULL) {
+        set_prompt_message("Can't read %s: %s", filename, strerror(errno));
+        free(filename);
+        return;
+    }
+
+    int at = (E.cursor_x == 0 || E.cursor_y >= E.numrows) ? E.cursor_y : E.cursor_y + 1;
+    if (n > 0) {
+        row_splice(at, 0, rows, n, NULL);
+        undo_push((undo_t){ UNDO_ROWS, 0, at, NULL, 0, NULL, n, NULL });
+    }
+    free(rows);
+
+    E.cursor_y = at;
+    E.cursor_x = 0;
+    set_prompt_message("%d lines inserted from %s", n, filename);
+    free(filename);
+}
+
+/**
+ * @brief Saves the current content of the editor to a file.
+ *
+ * The function converts the editor's rows into a string and writes it to the file.
+ * The file is opened with read and write permissions (`O_RDWR`),
+ * and if it doesn't exist, it is created with standard permissions (`0644`).
+ * The file size is adjusted to match the content length using `ftruncate()`,
+ * ensuring that no leftover data remains. Truncating ourselves
+ * (not using O_TRUNC flag in open()) is safer in case the ftruncate() call succeeds
+ * but the write() call fails. In that case, the file would still contain
+ * most of the data it had before.
+ * After writing the content to the file, the allocated buffer is freed.
+ */
+void save() {
+    if (E.filename == NULL) {
+        E.filename = get_user_input("Save as: %s (ESC to cancel)", NULL);
+        if (E.filename == NULL) {
+            set_prompt_message("Save aborted");
+            return;
+        }
+        select_highlight();
+    }
+
+    int len;
+    char *buf = rows_to_string(&len);
+
+    int file = open(E.filename, O_RDWR | O_CREAT, 0644);
+    if (file != -1) {
+        if (ftruncate(file, len) != -1){
+            if (write(file, buf, len) == len) {
+                close(file);
+                free(buf);
+                E.dirty = 0;
+                rows_saved(0, E.numrows);
+                set_prompt_message("%d bytes written to disk", len);
+                return;
+            }
+        }
+        close(file);
+    }
+
+    free(buf);
+    set_prompt_message("Can't save! I/O error: %s", strerror(errno));
+}
+
+/*** Follow ***/
+
+/**
+ * Starts following the currently opened file, like `tail -f`.
+ *
+ * open_editor() just read the file and left the number of bytes it turned
+ * into rows in f->offset; we only find out whether the last of them ended
+ * its line. From then on follow_poll() reads just the bytes past the
+ * offset whenever inotify reports a change, and once right away for
+ * whatever was appended while the file was loading.
+ */
+void follow_start() {
+    struct follow_state *f = &E.follow;
+
+    if (E.filename == NULL) return;
+
+    f->fd = open(E.filename, O_RDONLY);
+    if (f->fd == -1) {
+        set_prompt_message("Can't follow %s: %s", E.filename, strerror(errno));
+        return;
+    }
+
+    // out of inotify instances or watches (ENOSPC): the file stays open, unfollowed
+    f->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (f->inotify_fd != -1)
+        f->watch = inotify_add_watch(f->inotify_fd, E.filename,
+                                     IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+    if (f->inotify_fd == -1 || f->watch == -1) {
+        set_prompt_message("Can't follow %s: %s", E.filename, strerror(errno));
+        if (f->inotify_fd != -1) close(f->inotify_fd);
+        close(f->fd);
+        f->inotify_fd = f->fd = -1;
+        return;
+    }
+
+    char last = '\n';
+    if (f->offset > 0 && pread(f->fd, &last, 1, f->offset - 1) != 1)
+        last = '\n';
+
+    f->open_tail = (last != '\n');
+    f->unread = 1;
+    f->new_from = E.numrows;
+    f->pipe = 0;
+    f->enabled = 1;
+}
+
+/**
+ * Starts reading the document from a pipe (ccode -). Rows are appended by
+ * stream_poll() as the producer writes them, so the part that arrived can
+ * be browsed while the rest is still coming.
+ */
+void stream_start(int fd) {
+    struct follow_state *f = &E.follow;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    f->fd = fd;
+    f->pipe = 1;
+    f->inotify_fd = -1;
+    f->offset = 0;
+    f->open_tail = 0;
+    f->new_from = 0;
+    f->enabled = 1;
+}
+
+/**
+ * Re-attaches to the path after the followed file was rotated or removed.
+ * Returns 0 when there is nothing at the path (yet).
+ */
+int follow_reopen() {
+    struct follow_state *f = &E.follow;
+
+    int fd = open(E.filename, O_RDONLY);
+    if (fd == -1) return 0;
+
+    inotify_rm_watch(f->inotify_fd, f->watch);
+    f->watch = inotify_add_watch(f->inotify_fd, E.filename,
+                                 IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+    close(f->fd);
+    f->fd = fd;
+    f->offset = 0;
+    f->open_tail = 0;
+    return 1;
+}
+
+/**
+ * Bookkeeping after rows were appended at the end: marks them for the green
+ * gutter and keeps the view at the end if the cursor was on the last row.
+ * Returns 1 when anything was added.
+ */
+int follow_appended(int old_numrows, int at_bottom) {
+    struct follow_state *f = &E.follow;
+
+    if (E.numrows == old_numrows && !f->open_tail) return 0;
+
+    f->new_from = old_numrows;
+    if (f->new_from > 0 && E.numrows == old_numrows) f->new_from--;
+    rows_saved(old_numrows > 0 ? old_numrows - 1 : 0, E.numrows); // they are the file
+    if (at_bottom && E.numrows > 0) {
+        E.cursor_y = E.numrows - 1;
+        E.cursor_x = 0;
+    }
+    return 1;
+}
+
+/**
+ * Appends what the producer wrote to the pipe since the last call. At most
+ * a few MB are taken per call so keypresses are still served in between.
+ */
+int stream_poll() {
+    struct follow_state *f = &E.follow;
+    char buf[65536];
+    size_t budget = 8 << 20;
+    ssize_t n = 0;
+
+    int saved_dirty = E.dirty;
+    int old_numrows = E.numrows;
+    int at_bottom = (E.numrows > 0 && E.cursor_y >= E.numrows - 1);
+
+    while (budget >= sizeof(buf) && (n = read(f->fd, buf, sizeof(buf))) > 0) {
+        append_text(buf, n, &f->open_tail);
+        f->offset += n;
+        budget -= sizeof(buf);
+    }
+    E.dirty = saved_dirty;
+
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+        close(f->fd);
+        f->enabled = 0;
+        set_prompt_message("stdin: %d lines, %lld bytes (end of input)",
+                           E.numrows, (long long)f->offset);
+        return 1;
+    }
+    return follow_appended(old_numrows, at_bottom);
+}
+
+/**
+ * Drains pending inotify events and appends whatever was written to the
+ * file since the last call. Returns 1 when rows were added (the caller
+ * should redraw), 0 otherwise. The amount of work is proportional to the
+ * appended bytes only; the existing rows are never touched again.
+ */
+int follow_poll() {
+    struct follow_state *f = &E.follow;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0, rotated = 0;
+    ssize_t n;
+
+    if (!f->enabled) return 0;
+    if (f->pipe) return stream_poll();
+
+    while ((n = read(f->inotify_fd, events, sizeof(events))) > 0) {
+        char *p = events;
+        while (p < events + n) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) rotated = 1;
+            changed = 1;
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    if (!changed && !f->unread) return 0;
+    f->unread = 0;
+
+    struct stat st;
+    if (fstat(f->fd, &st) == -1) return 0;
+
+    int saved_dirty = E.dirty;
+    if (st.st_size < f->offset) {
+        // the file starts over and so do the rows; undo brings the old ones back
+        editor_row *old;
+        int nold = E.numrows;
+        row_splice(0, nold, NULL, 0, &old);
+        undo_push((undo_t){ UNDO_ROWS, 0, 0, NULL, nold, old, 0, NULL });
+        E.cursor_x = E.cursor_y = 0;
+        E.rowoff = 0;
+        E.sel_active = 0;
+        E.ncursors = 0;
+        set_prompt_message("%s: file truncated", E.filename);
+        f->offset = 0;
+        f->open_tail = 0;
+    }
+
+    int old_numrows = E.numrows;
+    int at_bottom = (E.cursor_y >= E.numrows - 1);
+    char buf[65536];
+
+    while ((n = pread(f->fd, buf, sizeof(buf), f->offset)) > 0) {
+        append_text(buf, n, &f->open_tail);
+        f->offset += n;
+    }
+    E.dirty = saved_dirty;
+
+    if (rotated) {
+        if (follow_reopen()) set_prompt_message("%s: file rotated", E.filename);
+        else set_prompt_message("%s: file removed", E.filename);
+    }
+
+    return follow_appended(old_numrows, at_bottom);
+}
+
+/*** Buffers ***/
+
+// Bytes held by the render and highlight caches of rows
+size_t rows_cache_bytes(editor_row *rows, int numrows) {
+    size_t total = 0;
+    for (int j = 0; j < numrows; j++)
+        if (rows[j].render) total += 2 * (size_t)rows[j].rsize + 1;
+    return total;
+}
+
+/**
+ * Drops the render and highlight caches of a background buffer. The chars
+ * and hl_open_comment of each row are kept, so update_row() can rebuild a
+ * row exactly once it is drawn or searched again.
+ */
+void buffer_evict(struct editor_buffer *b) {
+    editor_row *rows = b->state.row;
+    for (int j = 0; j < b->state.numrows; j++) {
+        free(rows[j].render);
+        free(rows[j].highlight);
+        rows[j].render = NULL;
+        rows[j].highlight = NULL;
+        rows[j].rsize = 0;
+    }
+    b->cache_bytes = 0;
+}
+
+void buffers_init() {
+    B.list = malloc(sizeof(struct editor_buffer));
+    B.list[0].loaded = 1;
+    B.list[0].cache_bytes = 0;
+    B.list[0].last_used = 0;
+    B.count = 1;
+    B.current = 0;
+    B.clock = 0;
+}
+
+// Registers a background buffer for filename, the file is read on first switch
+int buffer_add(char *filename) {
+    struct editor_settings active = E;
+
+    init_buffer();
+    E.filename = filename ? strdup(filename) : NULL;
+
+    B.list = realloc(B.list, sizeof(struct editor_buffer) * (B.count + 1));
+    B.list[B.count].state = E;
+    B.list[B.count].loaded = 0;
+    B.list[B.count].cache_bytes = 0;
+    B.list[B.count].last_used = 0;
+
+    E = active;
+    return B.count++;
+}
+
+// Reads the file of a buffer visited for the first time. Returns 0 (errno set) if it can't
+int buffer_load() {
+    select_highlight();
+    if (E.filename == NULL || access(E.filename, F_OK) != 0) return 1; // a new file
+
+    int n;
+    editor_row *rows = load_rows(E.filename, &n, NULL);
+    if (rows == NULL) return 0;
+
+    row_splice(E.numrows, 0, rows, n, NULL);
+    free(rows);
+    rows_saved(0, E.numrows);
+    E.dirty = 0;
+    return 1;
+}
+
+/**
+ * Makes buffer n (wrapping around) the active one. The outgoing buffer is
+ * parked with its rows and caches intact, so switching back and forth is
+ * just two struct copies; only a never visited buffer pays for loading.
+ */
+void buffer_switch(int n) {
+    n = (n % B.count + B.count) % B.count;
+    if (n == B.current) return;
+
+    struct editor_buffer *out = &B.list[B.current];
+    out->state = E;
+    out->cache_bytes = (size_t)-1; // measured later by buffers_idle()
+    out->last_used = ++B.clock;
+
+    struct editor_settings screen = E;
+    E = B.list[n].state;
+    E.screenrows = screen.screenrows;
+    E.screencols = screen.screencols;
+    E.terminal_settings = screen.terminal_settings;
+    B.current = n;
+
+    if (!B.list[n].loaded) {
+        B.list[n].loaded = 1;
+        if (!buffer_load()) {
+            set_prompt_message("Can't read %s: %s", E.filename, strerror(errno));
+            return;
+        }
+    }
+    set_prompt_message("[%d/%d] %s", n + 1, B.count, E.filename ? E.filename : "[No Name]");
+}
+
+void buffer_open() {
+    char *filename = get_user_input("Open: %s (ESC to cancel)", NULL);
+    if (filename == NULL) return;
+
+    buffer_switch(buffer_add(filename));
+    free(filename);
+}
+
+int buffers_dirty() {
+    if (E.dirty) return 1;
+    for (int j = 0; j < B.count; j++)
+        if (j != B.current && B.list[j].state.dirty) return 1;
+    return 0;
+}
+
+/**
+ * Keeps the caches of background buffers under CCODE_CACHE_BUDGET by
+ * evicting the least recently used one. At most one buffer is measured or
+ * evicted per call so a keypress never waits for a big sweep.
+ */
+void buffers_idle() {
+    size_t total = 0;
+    int lru = -1;
+
+    for (int j = 0; j < B.count; j++) {
+        struct editor_buffer *b = &B.list[j];
+        if (j == B.current || !b->loaded) continue;
+
+        if (b->cache_bytes == (size_t)-1) {
+            b->cache_bytes = rows_cache_bytes(b->state.row, b->state.numrows);
+            return;
+        }
+        total += b->cache_bytes;
+        if (b->cache_bytes && (lru == -1 || b->last_used < B.list[lru].last_used))
+            lru = j;
+    }
+
+    if (total > CCODE_CACHE_BUDGET && lru != -1)
+        buffer_evict(&B.list[lru]);
+}
+
+// Descriptor the background work is waiting on, or -1
+int editor_wait_fd() {
+    if (!E.follow.enabled) return -1;
+    return E.follow.pipe ? E.follow.fd : E.follow.inotify_fd;
+}
+
+/**
+ * Called whenever we are waiting for a keypress and none arrived within
+ * the terminal read timeout. Returns 1 if the screen needs a redraw.
+ */
+int editor_idle() {
+    int redraw = follow_poll();
+    redraw |= viewer_idle();
+    buffers_idle();
+    words_idle();
+    return redraw;
+}
+
+/*** Diff ***/
+
+/**
+ * :diff shows what saving would change: a unified diff of the file on
+ * disk against the rows, in a buffer of its own. The common head and tail
+ * are skipped by comparing the mapped file with the rows directly. The
+ * lines in between are hashed and compared, by their hashes and those the
+ * rows keep, with Myers' O(ND) algorithm in its linear-space form: the
+ * middle snake of each part is found by searching from both ends at once,
+ * and the parts on either side of it are diffed the same way. Apart from
+ * the hashes the memory is O(D), the diagonals searched and the edits.
+ */
+#define DIFF_CONTEXT 3
+
+// del lines of the file at x are replaced by ins rows at y
+struct diff_edit {
+    int x, y, del, ins;
+};
+
+struct diff_state {
+    uint64_t *a, *b;    // hashes of the untrimmed lines and rows
+    int *fwd, *bwd;     // furthest x reached on each diagonal, see diff_middle()
+    int vcap;           // diagonals -vcap..vcap fit in them
+    struct diff_edit *edits;
+    int nedits, editcap;
+    int prefix;         // lines in the common head
+    size_t mid;         // offset of the first line after it
+    int lines;          // lines in the file
+};
+
+void diff_add(struct diff_state *d, int x, int y, int del, int ins) {
+    struct diff_edit *last = d->nedits ? &d->edits[d->nedits - 1] : NULL;
+    if (last && last->x + last->del == x && last->y + last->ins == y) {
+        last->del += del;
+        last->ins += ins;
+        return;
+    }
+    if (d->nedits == d->editcap) {
+        d->editcap = d->editcap ? d->editcap * 2 : 64;
+        d->edits = realloc(d->edits, sizeof(struct diff_edit) * d->editcap);
+    }
+    d->edits[d->nedits++] = (struct diff_edit){ x, y, del, ins };
+}
+
+// Makes room for diagonals -need..need, keeping what is stored
+void diff_grow(struct diff_state *d, int need) {
+    if (need <= d->vcap) return;
+    int cap = d->vcap * 2 > need ? d->vcap * 2 : need;
+    int *v[2] = { d->fwd, d->bwd };
+
+    for (int s = 0; s < 2; s++) {
+        int *grown = malloc(sizeof(int) * (2 * cap + 1));
+        for (int k = 0; k < 2 * cap + 1; k++) grown[k] = -1;
+        if (v[s]) memcpy(grown + cap - d->vcap, v[s], sizeof(int) * (2 * d->vcap + 1));
+        free(v[s]);
+        v[s] = grown;
+    }
+    d->fwd = v[0];
+    d->bwd = v[1];
+    d->vcap = cap;
+}
+
+void diff_compare(struct diff_state *d, int x0, int x1, int y0, int y1);
+
+/**
+ * Finds where a shortest edit script of a[x0, x1) into b[y0, y1) crosses
+ * its middle, by extending the furthest reaching paths from the start
+ * (fwd) and from the end (bwd) one edit at a time until they overlap, and
+ * diffs the two halves. fwd[k] is the x reached on diagonal k = x - y,
+ * bwd[k] the same counted back from the ends. Diagonals that left the
+ * grid are dropped from the search (kstart, kend).
+ */
+void diff_middle(struct diff_state *d, int x0, int x1, int y0, int y1) {
+    const uint64_t *a = d->a + x0, *b = d->b + y0;
+    int n = x1 - x0, m = y1 - y0;
+    int delta = n - m, front = delta & 1, max_d = (n + m + 1) / 2;
+    int fstart = 0, fend = 0, bstart = 0, bend = 0;
+
+    diff_grow(d, 2);
+    int *fwd = d->fwd + d->vcap, *bwd = d->bwd + d->vcap;
+    fwd[-1] = fwd[0] = bwd[-1] = bwd[0] = -1;
+    fwd[1] = bwd[1] = 0;
+
+    for (int e = 0; e < max_d; e++) {
+        if (e > 0) {
+            diff_grow(d, e + 1);
+            fwd = d->fwd + d->vcap;
+            bwd = d->bwd + d->vcap;
+            fwd[e + 1] = fwd[-e - 1] = bwd[e + 1] = bwd[-e - 1] = -1;
+        }
+
+        for (int k = -e + fstart; k <= e - fend; k += 2) {
+            int x = (k == -e || (k != e && fwd[k - 1] < fwd[k + 1])) ? fwd[k + 1] : fwd[k - 1] + 1;
+            int y = x - k;
+            while (x < n && y < m && a[x] == b[y]) x++, y++;
+            fwd[k] = x;
+            if (x > n) {
+                fend += 2;
+            } else if (y > m) {
+                fstart += 2;
+            } else if (front) {
+                int kb = delta - k;
+                if (kb >= -e - 1 && kb <= e + 1 && bwd[kb] != -1 && x >= n - bwd[kb]) {
+                    diff_compare(d, x0, x0 + x, y0, y0 + y);
+                    diff_compare(d, x0 + x, x1, y0 + y, y1);
+                    return;
+                }
+            }
+        }
+
+        for (int k = -e + bstart; k <= e - bend; k += 2) {
+            int x = (k == -e || (k != e && bwd[k - 1] < bwd[k + 1])) ? bwd[k + 1] : bwd[k - 1] + 1;
+            int y = x - k;
+            while (x < n && y < m && a[n - x - 1] == b[m - y - 1]) x++, y++;
+            bwd[k] = x;
+            if (x > n) {
+                bend += 2;
+            } else if (y > m) {
+                bstart += 2;
+            } else if (!front) {
+                int kf = delta - k;
+                if (kf >= -e - 1 && kf <= e + 1 && fwd[kf] != -1 && fwd[kf] >= n - x) {
+                    int fx = fwd[kf];
+                    diff_compare(d, x0, x0 + fx, y0, y0 + fx - kf);
+                    diff_compare(d, x0 + fx, x1, y0 + fx - kf, y1);
+                    return;
+                }
+            }
+        }
+    }
+    diff_add(d, x0, y0, n, m); // nothing in common
+}
+
+// Diffs a[x0, x1) against b[y0, y1), appending the edits in order
+void diff_compare(struct diff_state *d, int x0, int x1, int y0, int y1) {
+    while (x0 < x1 && y0 < y1 && d->a[x0] == d->b[y0]) x0++, y0++;
+    while (x0 < x1 && y0 < y1 && d->a[x1 - 1] == d->b[y1 - 1]) x1--, y1--;
+
+    if (x0 == x1 || y0 == y1) {
+        if (x0 < x1 || y0 < y1) diff_add(d, x0, y0, x1 - x0, y1 - y0);
+        return;
+    }
+    diff_middle(d, x0, x1, y0, y1);
+}
+
+// The line of map starting at off, and where the next one starts
+size_t diff_line(const char *map, size_t size, size_t off, size_t *len) {
+    const char *nl = memchr(map + off, '\n', size - off);
+    size_t end = nl ? (size_t)(nl - map) : size;
+    *len = end - off;
+    while (*len > 0 && map[off + *len - 1] == '\r') (*len)--;
+    return nl ? end + 1 : size;
+}
+
+int diff_same(const char *s, size_t len, editor_row *row) {
+    return (size_t)row->size == len && memcmp(row->chars, s, len) == 0;
+}
+
+/**
+ * Diffs the file mapped at map against E.row, splitting it into lines the
+ * way load_rows() does. Edits are counted from the first line and row.
+ */
+void diff_file(struct diff_state *d, const char *map, size_t size) {
+    int prefix = 0, suffix = 0;
+    size_t mid = 0, tail = size, len;
+
+    while (prefix < E.numrows && mid < size) {
+        size_t next = diff_line(map, size, mid, &len);
+        if (!diff_same(map + mid, len, &E.row[prefix])) break;
+        prefix++;
+        mid = next;
+    }
+
+    // the tail, walking back from the last line while it is still after mid
+    if (mid < size) {
+        size_t end = map[size - 1] == '\n' ? size - 1 : size;
+        while (suffix < E.numrows - prefix) {
+            const char *nl = end > mid ? memrchr(map + mid, '\n', end - mid) : NULL;
+            size_t start = nl ? (size_t)(nl - map) + 1 : mid;
+            len = end - start;
+            while (len > 0 && map[start + len - 1] == '\r') len--;
+            if (!diff_same(map + start, len, &E.row[E.numrows - 1 - suffix])) break;
+            suffix++;
+            tail = start;
+            if (start == mid) break;
+            end = start - 1;
+        }
+    }
+
+    int na = 0, cap = 1024, nb = E.numrows - prefix - suffix;
+    d->a = malloc(sizeof(uint64_t) * cap);
+    for (size_t off = mid; off < tail; na++) {
+        size_t next = diff_line(map, size, off, &len);
+        if (na == cap) {
+            cap *= 2;
+            d->a = realloc(d->a, sizeof(uint64_t) * cap);
+        }
+        d->a[na] = line_hash(map + off, len);
+        off = next;
+    }
+    d->b = malloc(sizeof(uint64_t) * (nb > 0 ? nb : 1));
+    for (int j = 0; j < nb; j++)
+        d->b[j] = E.row[prefix + j].hash;
+
+    diff_compare(d, 0, na, 0, nb);
+    for (int j = 0; j < d->nedits; j++) {
+        d->edits[j].x += prefix;
+        d->edits[j].y += prefix;
+    }
+    d->prefix = prefix;
+    d->mid = mid;
+    d->lines = prefix + na + suffix;
+
+    free(d->a);
+    free(d->b);
+    free(d->fwd);
+    free(d->bwd);
+    d->a = d->b = NULL;
+    d->fwd = d->bwd = NULL;
+    d->vcap = 0;
+}
+
+// A row of the diff: tag followed by the line
+editor_row diff_row(char tag, const char *s, size_t len) {
+    editor_row row = { 0 };
+    row.size = len + 1;
+    row.chars = malloc(len + 2);
+    row.chars[0] = tag;
+    memcpy(row.chars + 1, s, len);
+    row.chars[len + 1] = '\0';
+    return row;
+}
+
+void diff_push(struct filter_output *o, editor_row row) {
+    if (o->numrows == o->cap) {
+        o->cap = o->cap ? o->cap * 2 : 1024;
+        o->rows = realloc(o->rows, sizeof(editor_row) * o->cap);
+    }
+    o->rows[o->numrows++] = row;
+}
+
+/**
+ * Writes the edits as unified diff hunks with DIFF_CONTEXT lines around
+ * them. Context and added lines come from the rows; removed lines are
+ * read from the mapping with one forward walk, since hunks are in order.
+ */
+void diff_hunks(struct diff_state *d, const char *map, size_t size, struct filter_output *o) {
+    size_t off = d->mid, len;
+    int line = d->prefix;
+    char head[96];
+
+    for (int j = 0; j < d->nedits;) {
+        struct diff_edit *first = &d->edits[j];
+        int last = j;
+        while (last + 1 < d->nedits &&
+               d->edits[last + 1].x - (d->edits[last].x + d->edits[last].del) <= 2 * DIFF_CONTEXT)
+            last++;
+
+        int before = first->x < DIFF_CONTEXT ? first->x : DIFF_CONTEXT;
+        int xend = d->edits[last].x + d->edits[last].del;
+        int yend = d->edits[last].y + d->edits[last].ins;
+        int after = d->lines - xend < DIFF_CONTEXT ? d->lines - xend : DIFF_CONTEXT;
+        int oldn = xend + after - (first->x - before), newn = yend + after - (first->y - before);
+        int hlen = snprintf(head, sizeof(head), "@@ -%d,%d +%d,%d @@",
+                            oldn ? first->x - before + 1 : first->x - before, oldn,
+                            newn ? first->y - before + 1 : first->y - before, newn);
+        diff_push(o, row_from(head, hlen));
+
+        int y = first->y - before;
+        for (int k = j; k <= last; k++) {
+            struct diff_edit *ed = &d->edits[k];
+            for (; y < ed->y; y++)
+                diff_push(o, diff_row(' ', E.row[y].chars, E.row[y].size));
+            for (; line < ed->x; line++)
+                off = diff_line(map, size, off, &len);
+            for (int r = 0; r < ed->del; r++, line++) {
+                size_t next = diff_line(map, size, off, &len);
+                diff_push(o, diff_row('-', map + off, len));
+                off = next;
+            }
+            for (; y < ed->y + ed->ins; y++)
+                diff_push(o, diff_row('+', E.row[y].chars, E.row[y].size));
+        }
+        for (; y < yend + after; y++)
+            diff_push(o, diff_row(' ', E.row[y].chars, E.row[y].size));
+        j = last + 1;
+    }
+}
+
+/**
+ * Opens the diff of the buffer against its file. The view is one unnamed
+ * buffer that later diffs replace, as an undoable step, so it can be
+ * saved as a patch or compared with an earlier diff.
+ */
+void diff_show() {
+    static int view = -1;
+
+    if (E.filename == NULL) {
+        set_prompt_message("No file to diff against");
+        return;
+    }
+
+    char *map = NULL;
+    size_t size = 0;
+    int fd = open(E.filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 && errno != ENOENT) {
+        set_prompt_message("Can't read %s: %s", E.filename, strerror(errno));
+        return;
+    }
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        size = st.st_size;
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            set_prompt_message("Can't map %s: %s", E.filename, strerror(errno));
+            close(fd);
+            return;
+        }
+    }
+    if (fd != -1) close(fd);
+
+    struct diff_state d = { 0 };
+    diff_file(&d, map, size);
+
+    struct filter_output o = { 0 };
+    int removed = 0, added = 0;
+    for (int j = 0; j < d.nedits; j++) {
+        removed += d.edits[j].del;
+        added += d.edits[j].ins;
+    }
+    if (d.nedits > 0) {
+        char head[PATH_MAX + 32];
+        int hlen = snprintf(head, sizeof(head), "--- %s (on disk)", E.filename);
+        diff_push(&o, row_from(head, hlen));
+        hlen = snprintf(head, sizeof(head), "+++ %s (buffer)", E.filename);
+        diff_push(&o, row_from(head, hlen));
+        diff_hunks(&d, map, size, &o);
+    }
+    if (map) munmap(map, size);
+    free(d.edits);
+
+    if (d.nedits == 0) {
+        set_prompt_message("No changes against %s", E.filename);
+        return;
+    }
+
+    char *name = strdup(E.filename);
+    if (view > 0 && view < B.count && view != B.current && B.list[view].state.filename == NULL) {
+        buffer_switch(view);
+        editor_row *old;
+        int nold = E.numrows;
+        row_splice(0, nold, o.rows, o.numrows, &old);
+        undo_push((undo_t){ UNDO_ROWS, 0, 0, NULL, nold, old, o.numrows, NULL });
+    } else {
+        view = buffer_add(NULL);
+        buffer_switch(view);
+        row_splice(0, 0, o.rows, o.numrows, NULL);
+    }
+    free(o.rows);
+    E.dirty = 0;
+    E.cursor_x = E.cursor_y = 0;
+    E.rowoff = 0;
+    set_prompt_message("%s: -%d +%d lines in %d changes", name, removed, added, d.nedits);
+    free(name);
+}
+
+/*** Find ***/
+void find_callback(char *query, int key) {
+    static int last_match = -1;
+    static int direction = 1;
+    static int saved_highlight_row;
+    static char *saved_highlight = NULL;
+
+    if (saved_highlight) {
+        memcpy(E.row[saved_highlight_row].highlight, saved_highlight, E.row[saved_highlight_row].rsize);
+        free(saved_highlight);
+        saved_highlight = NULL;
+    }
+
+    if (key == '\r' || key == '\x1b') {
+        last_match = -1;
+        direction = 1;
+        return;
+    } else if (key == ARROW_RIGHT || key == ARROW_DOWN ) {
+        direction = 1;
+    } else if (key == ARROW_LEFT || key == ARROW_UP) {
+        direction = -1;
+    } else {
+        last_match = -1;
+        direction = 1;
+    }
+
+    if (last_match == -1) direction = 1;
+    int current = last_match;
+
+    int i;
+    for (i = 0; i < E.numrows; i++) {
+        current += direction;
+        if (current == -1) current = E.numrows -1;
+        else if (current == E.numrows) current = 0;
+
+        editor_row *row = &E.row[current];
+        if (row->render == NULL) update_row(row);
+        char *match = strstr(row->render, query);
+        if (match) {
+            last_match = current;
+            E.cursor_y = current;
+            E.cursor_x = row_rx_to_cx(row, match - row->render);
+            E.rowoff = E.numrows;
+
+            saved_highlight_row = current;
+            saved_highlight = malloc(row->rsize);
+            memcpy(saved_highlight, row->highlight, row->size);
+            memset(&row->highlight[match - row->render], HL_FIND, strlen(query));
+            break;
+        }
+    }
+}
+
+void find() {
+    int saved_cursor_x = E.cursor_x;
+    int saved_cursor_y = E.cursor_y;
+    int saved_colloff = E.coloff;
+    int saved_rowoff = E.rowoff;
+
+    char *query = get_user_input("Search: %s (ESC/Arrows/Enter)", find_callback);
+
+    if (query) {
+        free(query);
+    } else {
+        E.cursor_x = saved_cursor_x;
+        E.cursor_y = saved_cursor_y;
+        E.coloff = saved_colloff;
+        E.rowoff = saved_rowoff;
+    }
+}
+
+/*** Append buffer ***/
+struct abuf
+{
+    char *b;
+    int len;
+};
+#define ABUF_INIT {NULL, 0}
+
+void abAppend(struct abuf *ab, const char *s, int len)
+{
+    char *new = realloc(ab->b, ab->len + len);
+
+    if (new == NULL)
+        return;
+    memcpy(&new[ab->len], s, len);
+    ab->b = new;
+    ab->len += len;
+}
+
+void abFree(struct abuf *ab)
+{
+    free(ab->b);
+}
+
+/*** Output ***/
+
+void scroll() {
+    E.rx = 0;
+    if (E.cursor_y < E.numrows) {
+        E.rx = row_cx_to_rx(&E.row[E.cursor_y], E.cursor_x);
+    }
+
+    // rows are counted in visible rows, which skips folds
+    if (fold_hidden(E.cursor_y))
+        fold_reveal(E.cursor_y);
+    int cursor = fold_rank(E.cursor_y), top = fold_rank(E.rowoff);
+    if (cursor < top) {
+        top = cursor;
+    }
+    if (cursor >= top + E.screenrows) {
+        top = cursor - E.screenrows + 1;
+    }
+    E.rowoff = fold_row(top);
+    if (E.rx < E.coloff) {
+        E.coloff = E.rx;
+    }
+    if (E.rx >= E.coloff + E.screencols) {
+        E.coloff = E.rx - E.screencols + 1;
+    }
+}
+
+// Draws the visible part (E.coloff, E.screencols wide) of a rendered row
+/**
+ * Draws the visible part of a row. Screen columns set in mark (may be NULL)
+ * are shown inverted, for the selection and extra cursors; mark has one
+ * more entry than the screen is wide, for the end of the line.
+ */
+void draw_row_text(struct abuf *ab, editor_row *row, const char *mark)
+{
+    int len = row->rsize - E.coloff;
+    if (len < 0) len = 0;
+    if(len > E.screencols) len = E.screencols;
+
+    char *c = &row->render[E.coloff];
+    unsigned char *highlight = &row->highlight[E.coloff];
+    int current_color = -1; // This will be -1 for default color
+    int selected = 0;
+
+    int j;
+    for (j = 0; j < len; j++) {
+        int in_sel = mark && mark[j];
+        if (in_sel != selected) {
+            abAppend(ab, in_sel ? "\x1b[7m" : "\x1b[27m", in_sel ? 4 : 5);
+            selected = in_sel;
+        }
+
+        if (highlight[j] == HL_FIND) {
+            // Special case for HL_FIND: yellow background, black text
+            abAppend(ab, "\x1b[43m\x1b[30m", 10);
+            abAppend(ab, &c[j], 1);
+            abAppend(ab, "\x1b[49m\x1b[39m", 10); // reset bg and fg
+            current_color = -1;
+            continue;
+        }
+
+        if (iscntrl(c[j])) {
+            /** Check if the current character is a control character. If so, we translate it into a printable character
+             * by adding its value to '@' (in ASCII, the capital letters of the alphabet come after the @ character),
+             * or using the '?' character if it’s not in the alphabetic range.
+            */
+            char sym = (c[j] <= 26) ? '@' + c[j] : '?';
+            abAppend(ab, "\x1b[7m", 4);
+            abAppend(ab, &sym, 1);
+            abAppend(ab, "\x1b[m", 3);
+            if (selected)
+                abAppend(ab, "\x1b[7m", 4);
+            if (current_color != -1) {
+                char buf[16];
+                int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
+                abAppend(ab, buf, clen);
+            }
+        }
+        else if (highlight[j] == HL_NORMAL) {
+            if (current_color != -1) {
+                abAppend(ab, "\x1b[39m", 5);
+                current_color = -1;
+            }
+            abAppend(ab, &c[j], 1);
+        } else {
+            int color = highlight_to_color(highlight[j]);
+            if (color != current_color) {
+                current_color = color;
+                char buf[16];
+                int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+                abAppend(ab, buf, clen);
+            }
+            abAppend(ab, &c[j], 1);
+        }
+    }
+    if (selected)
+        abAppend(ab, "\x1b[27m", 5);
+    if (mark && j < E.screencols && mark[j])
+        abAppend(ab, "\x1b[7m \x1b[27m", 10);
+    abAppend(ab, "\x1b[39m", 5);
+}
+
+void draw_rows(struct abuf *ab)
+{
+    int sx, sy, ex, ey;
+    int has_sel = selection_range(&sx, &sy, &ex, &ey);
+    int by, bey, left, right;
+    int has_block = block_range(&by, &bey, &left, &right);
+    char *mark = malloc(E.screencols + 1);
+    int i;
+
+    int top = fold_rank(E.rowoff);
+    highlight_catch_up(fold_row(top + E.screenrows - 1) + 1);
+    int py1, prx1, py2, prx2;
+    int has_pair = bracket_pair(&py1, &prx1, &py2, &prx2);
+    for (i = 0; i < E.screenrows; i++)
+    {
+        int fileditor_row = fold_row(top + i);
+
+        if (fileditor_row < E.numrows) {
+            char linenum[16];
+            snprintf(linenum, sizeof(linenum), "%4d", fileditor_row + 1);
+            // rows that just arrived in follow mode get a green line number
+            if (E.follow.enabled && fileditor_row >= E.follow.new_from)
+                abAppend(ab, "\x1b[32m", LINENUM_WIDTH);
+            else
+                abAppend(ab, "\x1b[90m", LINENUM_WIDTH);
+            abAppend(ab, linenum, strlen(linenum));
+            // changes since the file was saved, see Change marks
+            char mark = E.filename ? row_mark(&E.row[fileditor_row]) : ' ';
+            if (mark == '+')
+                abAppend(ab, "\x1b[32m+", 6);
+            else if (mark == '~')
+                abAppend(ab, "\x1b[33m~", 6);
+            else if (mark != ' ')
+                abAppend(ab, mark == '_' ? "\x1b[31m_" : "\x1b[31m^", 6);
+            else
+                abAppend(ab, " ", 1);
+            abAppend(ab, "\x1b[39m", LINENUM_WIDTH);
+        } else {
+	    abAppend(ab, "     ", LINENUM_WIDTH);
+	}
+
+        if(fileditor_row >= E.numrows) {
+            if (E.numrows == 0 && i == E.screenrows / 3)
+            {
+                char welcome[80];
+                int welcomelen = snprintf(welcome, sizeof(welcome),
+                                        "CCode editor -- version %s", CCODE_VERSION);
+                if (welcomelen > E.screencols)
+                    welcomelen = E.screencols;
+                int padding = (E.screencols - welcomelen) / 2;
+                if (padding)
+                {
+                    abAppend(ab, "-", 1);
+                    padding--;
+                }
+                while (padding--)
+                    abAppend(ab, " ", 1);
+                abAppend(ab, welcome, welcomelen);
+            }
+            else
+            {
+                abAppend(ab, "-", 1);
+            }
+        } else {
+            editor_row *row = &E.row[fileditor_row];
+            if (row->render == NULL)
+                update_row(row);
+
+            int marked = 0;
+            memset(mark, 0, E.screencols + 1);
+            if (has_sel && fileditor_row >= sy && fileditor_row <= ey) {
+                // the newline of a selected line shows as one more cell
+                int from = (fileditor_row == sy) ? row_cx_to_rx(row, sx) : 0;
+                int to = (fileditor_row == ey) ? row_cx_to_rx(row, ex) : row->rsize + 1;
+                for (int rx = from; rx < to; rx++)
+                    if (rx >= E.coloff && rx <= E.coloff + E.screencols)
+                        mark[rx - E.coloff] = marked = 1;
+            }
+            if (has_block && fileditor_row >= by && fileditor_row <= bey) {
+                // an empty block still shows its column
+                for (int rx = left; rx < right || rx == left; rx++)
+                    if (rx >= E.coloff && rx <= E.coloff + E.screencols)
+                        mark[rx - E.coloff] = marked = 1;
+            }
+            for (int k = cursors_first_on(fileditor_row);
+                 k < E.ncursors && E.cursors[k].y == fileditor_row; k++) {
+                int rx = row_cx_to_rx(row, E.cursors[k].x) - E.coloff;
+                if (rx >= 0 && rx <= E.screencols)
+                    mark[rx] = marked = 1;
+            }
+            if (has_pair && fileditor_row == py1 && prx1 >= E.coloff &&
+                prx1 <= E.coloff + E.screencols)
+                mark[prx1 - E.coloff] = marked = 1;
+            if (has_pair && fileditor_row == py2 && prx2 >= E.coloff &&
+                prx2 <= E.coloff + E.screencols)
+                mark[prx2 - E.coloff] = marked = 1;
+            draw_row_text(ab, row, marked ? mark : NULL);
+            if (row->fold > 0) {
+                int used = row->rsize - E.coloff;
+                used = used < 0 ? 0 : (used > E.screencols ? E.screencols : used);
+                char folded[32];
+                int len = snprintf(folded, sizeof(folded), " +%d lines", row->fold);
+                if (len > E.screencols - used) len = E.screencols - used;
+                abAppend(ab, "\x1b[90m", 5);
+                abAppend(ab, folded, len);
+                abAppend(ab, "\x1b[39m", 5);
+            }
+        }
+        abAppend(ab, "\x1b[K]", 3);
+        abAppend(ab, "\r\n", 2);
+    }
+    free(mark);
+}
+
+/**
+ * The m command (Selected Graphic Rendition) is used to change the text's
+ * appearance in the terminal - bold (1), underline (4) or inverted (7).
+ * Effects can be combined, reseting text back - <esc>[m.
+ * http://vt100.net/docs/vt100-ug/chapter3.html#SGR
+ *
+ * Current line is in E.cursor_y. Aligning the 2nd string,
+ * spaces are printed until the right edge of screen.
+ */
+void draw_status_bar(struct abuf *ab) {
+    // Switch to inverted colors with: <esc>[7m
+    abAppend(ab, "\x1b[7m", 4);
+
+    char status[80], rstatus[240], counts[160] = "";
+    char bufnum[32] = "";
+    if (B.count > 1)
+        snprintf(bufnum, sizeof(bufnum), "[%d/%d] ", B.current + 1, B.count);
+    int len = snprintf(status, sizeof(status), "%s%.20s - %d lines %s",
+        bufnum, E.filename ? E.filename : "[No Name]", E.numrows,
+        E.dirty ? "(modified)" : "");
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+        E.syntax ? E.syntax->filetype : "no ft", E.cursor_y + 1, E.numrows);
+
+    // word, char and byte counts (of the selection too) when they fit
+    struct text_stats sel;
+    int sel_lines, clen = 0;
+    if (selection_stats(&sel, &sel_lines))
+        clen = snprintf(counts, sizeof(counts), "sel %d lines %lldw %lldc %lldB | ",
+            sel_lines, sel.words, sel.chars, sel.bytes);
+    clen += snprintf(&counts[clen], sizeof(counts) - clen, "%lldw %lldc %lldB | ",
+        E.stats.words, E.stats.chars, E.stats.bytes);
+    if (len + clen + rlen <= E.screencols && clen + rlen < (int)sizeof(rstatus)) {
+        memmove(&rstatus[clen], rstatus, rlen + 1);
+        memcpy(rstatus, counts, clen);
+        rlen += clen;
+    }
+
+    if (len > E.screencols) len = E.screencols;
+    abAppend(ab, status, len);
+
+    while (len < E.screencols) {
+        if (E.screencols - len == rlen) {
+            abAppend(ab, rstatus, rlen);
+            break;
+        } else {
+            abAppend(ab, " ", 1);
+            len++;
+        }
+    }
+
+    // Switch back to normal colors(formatting) with: <esc>[m
+    abAppend(ab, "\x1b[m", 3);
+    abAppend(ab, "\r\n", 2);
+}
+
+/**
+ * Clear the msg bar with <esc>[K. We make sure msg fits the
+ * with of screen and then display msg, only if it is 5 sec old.
+ */
+void draw_prompt_bar(struct abuf *ab) {
+    abAppend(ab, "\x1b[K", 3);
+    int msglen = strlen(E.status_prompt);
+    if (msglen > E.screencols) msglen = E.screencols;
+
+    if (msglen && time(NULL) - E.status_prompt_time < 5)
+        abAppend(ab, E.status_prompt, msglen);
+}
+
+void refresh_screen()
+{
+    if (M.replaying) return;
+
+    double started = D.enabled ? headless_now() : 0;
+    struct abuf ab = ABUF_INIT;
+
+    abAppend(&ab, "\x1b[?25l", 6);
+    abAppend(&ab, "\x1b[H", 3);
+
+    if (H.enabled) {
+        hex_draw(&ab);
+    } else if (V.enabled) {
+        viewer_draw(&ab);
+    } else {
+        scroll();
+        draw_rows(&ab);
+        draw_status_bar(&ab);
+    }
+    draw_prompt_bar(&ab);
+
+    char buf[32];
+    if (H.enabled) {
+        int y, x;
+        hex_cursor_position(&y, &x);
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y, x);
+    } else if (V.enabled)
+        snprintf(buf, sizeof(buf), "\x1b[1;%dH", 1 + LINENUM_WIDTH);
+    else
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cursor_y - E.rowoff) + 1,
+                                                  (E.rx - E.coloff) + 1 + LINENUM_WIDTH);
+    abAppend(&ab, buf, strlen(buf));
+
+    abAppend(&ab, "\x1b[?25h", 6); // Show the cursor
+
+    screen_write(ab.b, ab.len);
+    abFree(&ab);
+    if (D.enabled) headless_frame(started);
+}
+
+/**
+ * Like printf() style function for printing status message.
+ * This is a variadic function, takes any number of args.
+ * https://en.wikipedia.org/wiki/Variadic_function
+ */
+void set_prompt_message(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+
+    vsnprintf(E.status_prompt, sizeof(E.status_prompt), fmt, ap);
+
+    va_end(ap);
+    E.status_prompt_time = time(NULL);
+}
+
+/*** Input ***/
+char *get_user_input(char *prompt, void (*callback)(char *, int)) {
+    size_t bufsize = 128;
+    char *buf = malloc(bufsize);
+
+    size_t buflen = 0;
+    buf[0] = '\0';
+
+    while (1) {
+        set_prompt_message(prompt, buf);
+        refresh_screen();
+
+        int c = read_keypress();
+        if (c == DELETE_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+            if (buflen != 0) buf[--buflen] = '\0';
+        } else if (c == '\x1b') {
+            set_prompt_message("");
+            if (callback) callback(buf, c);
+            free(buf);
+            return NULL;
+        } else if (c == '\r') {
+            if (buflen != 0) {
+                set_prompt_message("");
+                if (callback) callback(buf, c);
+                return buf;
+            }
+        } else if (!iscntrl(c) && c < 128) {
+            if (buflen == bufsize - 1) {
+                bufsize *= 2;
+                buf = realloc(buf, bufsize);
+            }
+            buf[buflen++] = c;
+            buf[buflen] = '\0';
+        }
+        if (callback) callback(buf, c);
+    }
+}
+
+void move_cursor(int key)
+{
+    editor_row *row = (E.cursor_y > E.numrows) ? NULL : &E.row[E.cursor_y];
+
+    switch (key)
+    {
+    case ARROW_LEFT:
+        if (E.cursor_x != 0) {
+            E.cursor_x--;
+        } else if (E.cursor_y > 0) {
+            E.cursor_y = fold_step(E.cursor_y, -1);
+            E.cursor_x = E.row[E.cursor_y].size;
+        }
+        break;
+    case ARROW_RIGHT:
+        if(row && E.cursor_x < row->size) {
+            E.cursor_x++;
+        } else if (row && E.cursor_x == row->size) {
+            E.cursor_y = fold_row(fold_rank(E.cursor_y) + 1);
+            E.cursor_x = 0;
+        }
+        break;
+    case ARROW_UP:
+        if (E.cursor_y != 0)
+            E.cursor_y = fold_step(E.cursor_y, -1);
+        break;
+    case ARROW_DOWN:
+        if (E.cursor_y < E.numrows - 1)
+            E.cursor_y = fold_step(E.cursor_y, 1);
+        break;
+    }
+
+    row = (E.cursor_y >= E.numrows) ? NULL : &E.row[E.cursor_y];
+    int rowlen = row ? row->size : 0;
+    if (E.cursor_x > rowlen) {
+        E.cursor_x = rowlen;
+    }
+}
+
+void process_keypress()
+{
+    static int quit_times = CCODE_QUIT_TIMES;
+
+    int c = read_keypress();
+
+    if ((E.ncursors > 0 && cursors_keypress(c)) ||
+        (E.sel_active && E.sel_block && block_keypress(c))) {
+        quit_times = CCODE_QUIT_TIMES;
+        return;
+    }
+
+    switch (c) {
+        case '\r': // Enter key
+            E.sel_active = 0;
+            insert_new_line();
+            break;
+        case CTRL_KEY('q'):
+            if (buffers_dirty() && quit_times > 0) {
+                set_prompt_message("Warning!!! File was not saved! "
+                    "Press Ctrl-Q %d more times to quit.", quit_times);
+                quit_times--;
+                return;
+            }
+            screen_write("\x1b[2j]", 4);
+            screen_write("\x1b[H", 3);
+            exit(0);
+            break;
+
+        case CTRL_KEY('s'):
+            save();
+            break;
+        case CTRL_KEY('z'):
+            E.sel_active = 0;
+            undo_operation();
+            break;
+        case CTRL_KEY('y'):
+            E.sel_active = 0;
+            redo_operation();
+            break;
+        case CTRL_KEY('b'):
+            E.sel_active = !E.sel_active;
+            E.sel_block = 0;
+            E.sel_x = E.cursor_x;
+            E.sel_y = E.cursor_y;
+            break;
+        case CTRL_KEY('w'):
+            if (E.sel_active) {
+                E.sel_block = !E.sel_block;
+            } else {
+                E.sel_active = E.sel_block = 1;
+                E.sel_x = E.cursor_x;
+                E.sel_y = E.cursor_y;
+            }
+            break;
+        case CTRL_KEY('c'):
+        case CTRL_KEY('x'):
+            selection_copy(c == CTRL_KEY('x'));
+            break;
+        case CTRL_KEY('v'):
+            clipboard_paste();
+            break;
+        case CTRL_KEY('d'):
+            cursors_add();
+            break;
+        case CTRL_KEY('t'):
+            if (!M.replaying) macro_toggle();
+            break;
+        case CTRL_KEY('e'):
+            ex_prompt();
+            break;
+        case CTRL_KEY('j'):
+            bracket_jump();
+            break;
+        case CTRL_KEY('a'):
+            fold_toggle();
+            break;
+        case CTRL_KEY(']'):
+            symbol_find();
+            break;
+        case CTRL_KEY(' '):
+            word_complete();
+            break;
+        case CTRL_KEY('u'):
+            if (!M.replaying) macro_prompt();
+            break;
+        case HOME_KEY:
+            E.cursor_x = 0;
+            break;
+        case END_KEY:
+            if (E.cursor_y < E.numrows) {
+                E.cursor_x = E.row[E.cursor_y].size;
+            }
+            break;
+        case CTRL_KEY('f'):
+            find();
+            break;
+        case CTRL_KEY('n'):
+            buffer_switch(B.current + 1);
+            break;
+        case CTRL_KEY('p'):
+            buffer_switch(B.current - 1);
+            break;
+        case CTRL_KEY('o'):
+            buffer_open();
+            break;
+        case CTRL_KEY('r'):
+            insert_file();
+            break;
+        case CTRL_KEY('k'):
+            {
+                int sx, sy, ex, ey;
+                if (selection_range(&sx, &sy, &ex, &ey)) {
+                    delete_lines(sy, ey - sy + 1);
+                    E.sel_active = 0;
+                } else {
+                    delete_lines(E.cursor_y, 1);
+                }
+            }
+            break;
+        case ALT_ARROW_UP:
+            if (E.cursor_y > 0 && E.cursor_y < E.numrows) {
+                move_lines(E.cursor_y, 1, E.cursor_y - 1);
+                E.cursor_y--;
+            }
+            break;
+        case ALT_ARROW_DOWN:
+            if (E.cursor_y < E.numrows - 1) {
+                move_lines(E.cursor_y, 1, E.cursor_y + 1);
+                E.cursor_y++;
+            }
+            break;
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+        case DELETE_KEY:
+            {
+                int sx, sy, ex, ey;
+                if (selection_range(&sx, &sy, &ex, &ey)) {
+                    delete_range(sx, sy, ex, ey);
+                    break;
+                }
+            }
+            if (c == DELETE_KEY) move_cursor(ARROW_RIGHT);
+            delete_char();
+            break;
+        case PAGE_UP:
+        case PAGE_DOWN:
+            {
+                // a screen up or down in visible rows, folds count as one
+                if (c == PAGE_UP)
+                    E.cursor_y = fold_step(E.rowoff, -E.screenrows);
+                else
+                    E.cursor_y = fold_step(E.rowoff, 2 * E.screenrows - 1);
+                if (E.cursor_y < E.numrows && E.cursor_x > E.row[E.cursor_y].size)
+                    E.cursor_x = E.row[E.cursor_y].size;
+            }
+            break;
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+            move_cursor(c);
+            break;
+        case SHIFT_ARROW_UP:
+        case SHIFT_ARROW_DOWN:
+        case SHIFT_ARROW_LEFT:
+        case SHIFT_ARROW_RIGHT:
+            if (!E.sel_active) {
+                E.sel_active = 1;
+                E.sel_block = 0;
+                E.sel_x = E.cursor_x;
+                E.sel_y = E.cursor_y;
+            }
+            move_cursor(ARROW_LEFT + (c - SHIFT_ARROW_LEFT));
+            break;
+        case '\x1b': // Escape key F1-F12 included
+            E.sel_active = 0;
+            E.ncursors = 0;
+            break;
+        case CTRL_KEY('l'): // Tipically used to refresh screen
+            break;
+        default:
+            E.sel_active = 0;
+            insert_char(c);
+            break;
+    }
+    quit_times = CCODE_QUIT_TIMES;
+}
+
+/*** Line index cache ***/
+
+/**
+ * The viewer's line index is persisted in ~/.cache/ccode (or
+ * $XDG_CACHE_HOME/ccode), one file per indexed path. A sidecar is trusted
+ * when path, inode, size and mtime match and a hash of a few sampled blocks
+ * still agrees. If the file only grew, the sampled prefix still matches and
+ * the index is extended from where it stopped instead of rebuilt.
+ */
+#define INDEX_MAGIC "CCIDX01"
+#define INDEX_SAMPLES 16
+#define INDEX_SAMPLE_SIZE 4096
+
+struct index_header {
+    char magic[8];
+    uint64_t ino;
+    uint64_t size;        // bytes covered by the index
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t sample;      // index_sample_hash() of those bytes
+    uint64_t lines;       // newlines within them
+    uint64_t ncheck;
+    uint32_t stride;
+    uint32_t pathlen;     // followed by the path, then ncheck offsets
+};
+
+uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t j = 0; j < len; j++) {
+        h ^= p[j];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Hash of INDEX_SAMPLES blocks spread evenly over the first size bytes
+uint64_t index_sample_hash(int fd, size_t size) {
+    uint64_t h = fnv1a(14695981039346656037ULL, &size, sizeof(size));
+    char block[INDEX_SAMPLE_SIZE];
+
+    for (int j = 0; j < INDEX_SAMPLES; j++) {
+        size_t off = (size > INDEX_SAMPLE_SIZE) ?
+            (size - INDEX_SAMPLE_SIZE) / (INDEX_SAMPLES - 1) * j : 0;
+        size_t len = size - off < INDEX_SAMPLE_SIZE ? size - off : INDEX_SAMPLE_SIZE;
+        ssize_t n = pread(fd, block, len, off);
+        if (n > 0) h = fnv1a(h, block, n);
+    }
+    return h;
+}
+
+// Sidecar file for path, allocated. The cache directory is created on demand.
+char *index_cache_path(const char *path) {
+    char dir[PATH_MAX];
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    if (xdg && *xdg) {
+        snprintf(dir, sizeof(dir), "%s", xdg);
+    } else if (home && *home) {
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    } else {
+        return NULL;
+    }
+    mkdir(dir, 0755);
+    strncat(dir, "/ccode", sizeof(dir) - strlen(dir) - 1);
+    mkdir(dir, 0755);
+
+    char *sidecar = malloc(PATH_MAX + 32);
+    snprintf(sidecar, PATH_MAX + 32, "%s/%016llx.idx", dir,
+             (unsigned long long)fnv1a(14695981039346656037ULL, path, strlen(path)));
+    return sidecar;
+}
+
+/**
+ * Looks up the sidecar for filename, opened as fd. Fills hdr and, when
+ * checkpoints isn't NULL, the stored offsets (caller frees).
+ * Returns 0 if there is no usable index, 1 if it covers the whole file,
+ * 2 if it covers a prefix of a file that has grown since.
+ */
+int index_cache_load(const char *filename, int fd, struct index_header *hdr,
+                     off_t **checkpoints) {
+    char path[PATH_MAX];
+    struct stat st;
+    int result = 0;
+
+    if (realpath(filename, path) == NULL || fstat(fd, &st) == -1) return 0;
+
+    char *sidecar = index_cache_path(path);
+    if (sidecar == NULL) return 0;
+    FILE *fp = fopen(sidecar, "r");
+    free(sidecar);
+    if (!fp) return 0;
+
+    char stored[PATH_MAX];
+    if (fread(hdr, sizeof(*hdr), 1, fp) != 1 ||
+        memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) ||
+        hdr->stride != VIEW_STRIDE || hdr->pathlen >= sizeof(stored) ||
+        fread(stored, 1, hdr->pathlen, fp) != hdr->pathlen)
+        goto out;
+    stored[hdr->pathlen] = '\0';
+
+    // one checkpoint per VIEW_STRIDE lines and line 0's, less the last when
+    // the file ended right before it (see viewer_open())
+    if (strcmp(stored, path) || hdr->ino != (uint64_t)st.st_ino ||
+        hdr->size > (uint64_t)st.st_size || hdr->lines > hdr->size ||
+        hdr->ncheck < 1 || hdr->ncheck < hdr->lines / VIEW_STRIDE ||
+        hdr->ncheck > hdr->lines / VIEW_STRIDE + 1)
+        goto out;
+
+    if (hdr->size == (uint64_t)st.st_size) {
+        if (hdr->mtime_sec != st.st_mtim.tv_sec || hdr->mtime_nsec != st.st_mtim.tv_nsec)
+            goto out;
+        result = 1;
+    } else {
+        result = 2;
+    }
+    if (index_sample_hash(fd, hdr->size) != hdr->sample) {
+        result = 0;
+        goto out;
+    }
+
+    if (checkpoints) {
+        *checkpoints = malloc(sizeof(off_t) * (hdr->ncheck ? hdr->ncheck : 1));
+        int ok = fread(*checkpoints, sizeof(off_t), hdr->ncheck, fp) == hdr->ncheck &&
+                 (*checkpoints)[0] == 0;
+        // a corrupt offset would send viewer_decode() past the mapping
+        for (uint64_t k = 1; ok && k < hdr->ncheck; k++)
+            ok = (*checkpoints)[k] > (*checkpoints)[k - 1] &&
+                 (uint64_t)(*checkpoints)[k] < hdr->size;
+        if (!ok) {
+            free(*checkpoints);
+            result = 0;
+        }
+    }
+
+out:
+    fclose(fp);
+    return result;
+}
+
+// Writes the index of the first size bytes of filename next to the others
+void index_cache_store(const char *filename, int fd, struct stat *st, size_t size,
+                       long lines, off_t *checkpoints, size_t ncheck) {
+    char path[PATH_MAX];
+    if (realpath(filename, path) == NULL) return;
+
+    char *sidecar = index_cache_path(path);
+    if (sidecar == NULL) return;
+
+    struct index_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.ino = st->st_ino;
+    hdr.size = size;
+    hdr.mtime_sec = st->st_mtim.tv_sec;
+    hdr.mtime_nsec = st->st_mtim.tv_nsec;
+    hdr.sample = index_sample_hash(fd, size);
+    hdr.lines = lines;
+    hdr.ncheck = ncheck;
+    hdr.stride = VIEW_STRIDE;
+    hdr.pathlen = strlen(path);
+
+    // Write a temporary and rename it, so readers never see half an index
+    char tmp[PATH_MAX + 16];
+    snprintf(tmp, sizeof(tmp), "%s.%d", sidecar, (int)getpid());
+    FILE *fp = fopen(tmp, "w");
+    if (fp) {
+        int ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+                 fwrite(path, 1, hdr.pathlen, fp) == hdr.pathlen &&
+                 fwrite(checkpoints, sizeof(off_t), ncheck, fp) == ncheck;
+        if (fclose(fp) == 0 && ok)
+            rename(tmp, sidecar);
+        else
+            unlink(tmp);
+    }
+    free(sidecar);
+}
+
+// Line count of filename from a still valid sidecar, or -1
+long index_cache_lines(const char *filename) {
+    struct index_header hdr;
+    long lines = -1;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) return -1;
+    if (index_cache_load(filename, fd, &hdr, NULL) == 1)
+        lines = hdr.lines + 1;
+    close(fd);
+    return lines;
+}
+
+/*** Symbols ***/
+
+/**
+ * The scanner reads a C file as one buffer with the comment delimiters of
+ * its highlight rules, skipping comments and literals and tracking brace
+ * depth. At file scope it recognizes a name followed by a parameter list
+ * and a body, struct/union/enum tags followed by a body, and the name that
+ * ends a typedef; #define is picked up at any depth. Files are scanned by
+ * a pool of threads, each taking the next unscanned file from a shared
+ * counter, and the results are merged in path order.
+ */
+#define SYMBOL_MAGIC "CCSYM01"
+#define SYMBOL_MAX_THREADS 16
+#define SYMBOL_MIN_SLICE 65536 // symbols worth a thread when matching
+
+char *SYMBOL_types[] = { ".c", ".h", NULL };
+
+// Symbols of one file and their names, as a worker finds them
+struct symbol_scan {
+    struct symbol *syms;
+    int n, cap;
+    char *names;
+    size_t len, namecap;
+};
+
+struct symbol_job {
+    char *path;
+    struct stat st;
+    int old;            // index in S.files of the same path, or -1
+    int reuse;          // the file hasn't changed since it was indexed
+    struct symbol_scan scan;
+};
+
+struct symbol_pool {
+    struct symbol_job *jobs;
+    int njobs;
+    int next;           // next job to take
+    pthread_mutex_t lock;
+    struct syntax_config *syntax;
+};
+
+struct symbol_header {
+    char magic[8];
+    uint32_t nfiles;
+    uint32_t nsyms;
+    uint64_t nameslen;
+    uint32_t rootlen;   // followed by the root, the files with their paths,
+    uint32_t pad;       // the symbols and the names
+};
+
+struct symbol_file_record {
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+    uint32_t first, count;
+    uint32_t pathlen;
+    uint32_t pad;
+};
+
+// Bit set of the letters (either case), digits and underscores in s
+uint64_t symbol_mask(const char *s, int len) {
+    uint64_t mask = 0;
+    for (int j = 0; j < len; j++) {
+        unsigned char c = s[j];
+        if (isalpha(c)) mask |= 1ULL << (tolower(c) - 'a');
+        else if (isdigit(c)) mask |= 1ULL << (26 + c - '0');
+        else if (c == '_') mask |= 1ULL << 36;
+    }
+    return mask;
+}
+
+void symbol_add(struct symbol_scan *out, const char *name, int len, int line, char kind) {
+    if (len <= 0 || len > 0xffff) return;
+    if (out->n == out->cap) {
+        out->cap = out->cap ? out->cap * 2 : 64;
+        out->syms = realloc(out->syms, sizeof(struct symbol) * out->cap);
+    }
+    if (out->len + len > out->namecap) {
+        while (out->len + len > out->namecap)
+            out->namecap = out->namecap ? out->namecap * 2 : 1024;
+        out->names = realloc(out->names, out->namecap);
+    }
+    memcpy(out->names + out->len, name, len);
+    out->syms[out->n++] = (struct symbol){ symbol_mask(name, len), out->len, 0, line, len, kind };
+    out->len += len;
+}
+
+int symbol_ident(int c) {
+    return isalnum(c) || c == '_';
+}
+
+int symbol_word(const char *w, int len, const char *word) {
+    return (int)strlen(word) == len && memcmp(w, word, len) == 0;
+}
+
+void symbol_scan_text(const char *s, size_t n, struct syntax_config *syntax, struct symbol_scan *out) {
+    const char *scs = syntax->sl_comment_start;
+    const char *mcs = syntax->multiline_comment_start;
+    const char *mce = syntax->multiline_comment_end;
+    size_t scs_len = scs ? strlen(scs) : 0;
+    size_t mcs_len = mcs ? strlen(mcs) : 0;
+    size_t mce_len = mce ? strlen(mce) : 0;
+
+    int line = 1, bol = 1, depth = 0, paren = 0;
+    // the file scope statement being read
+    const char *last = NULL, *fn = NULL, *tag = NULL;
+    int last_len = 0, last_line = 0, fn_len = 0, fn_line = 0, tag_line = 0, tag_len = 0;
+    int fn_ready = 0, tag_word = 0, is_typedef = 0, assign = 0, is_extern = 0;
+    int extern_c = 0, body = 0, prev_ident = 0;
+    size_t i = 0;
+
+#define SYMBOL_RESET() (last = fn = tag = NULL, fn_ready = tag_word = is_typedef = 0, \
+                        assign = is_extern = extern_c = paren = 0)
+
+    while (i < n) {
+        unsigned char c = s[i];
+        if (c == '\n') {
+            line++;
+            bol = 1;
+            i++;
+            continue;
+        }
+        if (isspace(c)) {
+            i++;
+            continue;
+        }
+        if (scs_len && i + scs_len <= n && memcmp(s + i, scs, scs_len) == 0) {
+            while (i < n && s[i] != '\n') i++;
+            continue;
+        }
+        if (mcs_len && mce_len && i + mcs_len <= n && memcmp(s + i, mcs, mcs_len) == 0) {
+            for (i += mcs_len; i < n && !(i + mce_len <= n && memcmp(s + i, mce, mce_len) == 0); i++)
+                if (s[i] == '\n') line++;
+            i += mce_len;
+            continue;
+        }
+        if (c == '#' && bol) {
+            for (i++; i < n && (s[i] == ' ' || s[i] == '\t'); i++);
+            size_t w = i;
+            while (i < n && symbol_ident(s[i])) i++;
+            if (symbol_word(s + w, i - w, "define")) {
+                while (i < n && (s[i] == ' ' || s[i] == '\t')) i++;
+                size_t name = i;
+                while (i < n && symbol_ident(s[i])) i++;
+                symbol_add(out, s + name, i - name, line, 'd');
+            }
+            // the rest of the directive, with its continuation lines
+            for (; i < n && s[i] != '\n'; i++)
+                if (s[i] == '\\' && i + 1 < n && s[i + 1] == '\n') {
+                    i++;
+                    line++;
+                }
+            continue;
+        }
+        bol = 0;
+
+        if (c == '"' || c == '\'') {
+            for (i++; i < n && s[i] != c && s[i] != '\n'; i++)
+                if (s[i] == '\\' && i + 1 < n && s[++i] == '\n') line++;
+            i++;
+            if (depth == 0 && is_extern) extern_c = 1;
+            prev_ident = tag_word = 0;
+            tag = NULL;
+            continue;
+        }
+
+        if (isalpha(c) || c == '_') {
+            size_t w = i;
+            while (i < n && symbol_ident(s[i])) i++;
+            if (depth > 0) continue;
+
+            int len = i - w;
+            tag = tag_word ? s + w : NULL;
+            tag_len = len;
+            tag_line = line;
+            tag_word = symbol_word(s + w, len, "struct") || symbol_word(s + w, len, "union") ||
+                       symbol_word(s + w, len, "enum");
+            if (symbol_word(s + w, len, "typedef")) is_typedef = 1;
+            if (symbol_word(s + w, len, "extern")) is_extern = 1;
+            if (paren == 0) {
+                last = s + w;
+                last_len = len;
+                last_line = line;
+            }
+            prev_ident = 1;
+            continue;
+        }
+
+        i++;
+        if (depth > 0) {
+            if (c == '{') {
+                depth++;
+            } else if (c == '}' && --depth == 0 && body) {
+                body = 0;
+                SYMBOL_RESET();
+            }
+            continue;
+        }
+
+        switch (c) {
+            case '(':
+                if (paren++ == 0 && prev_ident && !assign && last) {
+                    fn = last;
+                    fn_len = last_len;
+                    fn_line = last_line;
+                    fn_ready = 0;
+                }
+                break;
+            case ')':
+                if (paren > 0 && --paren == 0 && fn) fn_ready = 1;
+                break;
+            case '{':
+                if (extern_c) { // extern "C" { ... } doesn't nest
+                    SYMBOL_RESET();
+                    break;
+                }
+                if (tag) {
+                    symbol_add(out, tag, tag_len, tag_line, 's');
+                } else if (fn && fn_ready && !assign && !is_typedef) {
+                    symbol_add(out, fn, fn_len, fn_line, 'f');
+                    body = 1;
+                }
+                depth++;
+                break;
+            case ';':
+                if (is_typedef && last)
+                    symbol_add(out, last, last_len, last_line, 't');
+                SYMBOL_RESET();
+                break;
+            case '=':
+                assign = 1;
+                break;
+            case ',':
+                if (paren == 0) fn = NULL;
+                break;
+        }
+        prev_ident = tag_word = 0;
+        tag = NULL;
+    }
+#undef SYMBOL_RESET
+}
+
+int symbol_is_source(const char *name) {
+    const char *ext = strrchr(name, '.');
+    for (int j = 0; ext && SYMBOL_types[j]; j++)
+        if (strcmp(ext, SYMBOL_types[j]) == 0) return 1;
+    return 0;
+}
+
+// Collects the C files below dir ("" for the working directory), skipping hidden ones
+void symbol_walk(const char *dir, char ***paths, int *n, int *cap) {
+    DIR *d = opendir(*dir ? dir : ".");
+    if (d == NULL) return;
+
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.') continue;
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%s%s", dir, *dir ? "/" : "", ent->d_name);
+        int type = ent->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (lstat(path, &st) == -1) continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN);
+        }
+
+        if (type == DT_DIR) {
+            symbol_walk(path, paths, n, cap);
+        } else if (type == DT_REG && symbol_is_source(ent->d_name)) {
+            if (*n == *cap) {
+                *cap = *cap ? *cap * 2 : 256;
+                *paths = realloc(*paths, sizeof(char *) * *cap);
+            }
+            (*paths)[(*n)++] = strdup(path);
+        }
+    }
+    closedir(d);
+}
+
+int symbol_path_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Index in S.files of path, or -1
+int symbol_file_find(const char *path) {
+    int lo = 0, hi = S.nfiles;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int c = strcmp(S.files[mid].path, path);
+        if (c == 0) return mid;
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return -1;
+}
+
+void symbol_scan_file(struct symbol_job *job, struct syntax_config *syntax) {
+    int fd = open(job->path, O_RDONLY);
+    if (fd == -1) return;
+    if (job->st.st_size > 0) {
+        char *map = mmap(NULL, job->st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            symbol_scan_text(map, job->st.st_size, syntax, &job->scan);
+            munmap(map, job->st.st_size);
+        }
+    }
+    close(fd);
+}
+
+void *symbol_thread(void *arg) {
+    struct symbol_pool *pool = arg;
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        int k = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (k >= pool->njobs) return NULL;
+
+        struct symbol_job *job = &pool->jobs[k];
+        if (stat(job->path, &job->st) == -1) continue;
+        struct symbol_file *old = job->old >= 0 ? &S.files[job->old] : NULL;
+        if (old && old->mtime_sec == job->st.st_mtim.tv_sec &&
+            old->mtime_nsec == job->st.st_mtim.tv_nsec && old->size == (uint64_t)job->st.st_size)
+            job->reuse = 1;
+        else
+            symbol_scan_file(job, pool->syntax);
+    }
+}
+
+void symbols_free() {
+    for (int j = 0; j < S.nfiles; j++)
+        free(S.files[j].path);
+    free(S.files);
+    free(S.syms);
+    free(S.names);
+    free(S.folded);
+    free(S.cand);
+    free(S.cand_query);
+    S.files = NULL;
+    S.syms = NULL;
+    S.names = NULL;
+    S.folded = NULL;
+    S.cand = NULL;
+    S.cand_query = NULL;
+    S.nfiles = S.nsyms = S.ncand = S.nshow = 0;
+    S.nameslen = 0;
+}
+
+// Sidecar of the index of the working directory, allocated
+char *symbol_cache_path(char *root) {
+    if (getcwd(root, PATH_MAX) == NULL) return NULL;
+    return index_cache_path(root);
+}
+
+void symbols_load() {
+    char root[PATH_MAX], stored[PATH_MAX];
+    char *sidecar = symbol_cache_path(root);
+    if (sidecar == NULL) return;
+    FILE *fp = fopen(sidecar, "r");
+    free(sidecar);
+    if (!fp) return;
+
+    struct symbol_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, SYMBOL_MAGIC, sizeof(hdr.magic)) ||
+        hdr.rootlen >= sizeof(stored) ||
+        fread(stored, 1, hdr.rootlen, fp) != hdr.rootlen) {
+        fclose(fp);
+        return;
+    }
+    stored[hdr.rootlen] = '\0';
+    if (strcmp(stored, root) != 0) {
+        fclose(fp);
+        return;
+    }
+
+    int ok = 1;
+    S.files = calloc(hdr.nfiles ? hdr.nfiles : 1, sizeof(struct symbol_file));
+    for (uint32_t j = 0; ok && j < hdr.nfiles; j++) {
+        struct symbol_file_record rec;
+        ok = fread(&rec, sizeof(rec), 1, fp) == 1 && rec.pathlen < PATH_MAX &&
+             (uint64_t)rec.first + rec.count <= hdr.nsyms;
+        if (!ok) break;
+        struct symbol_file *f = &S.files[S.nfiles++];
+        f->path = malloc(rec.pathlen + 1);
+        ok = fread(f->path, 1, rec.pathlen, fp) == rec.pathlen;
+        f->path[rec.pathlen] = '\0';
+        f->mtime_sec = rec.mtime_sec;
+        f->mtime_nsec = rec.mtime_nsec;
+        f->size = rec.size;
+        f->first = rec.first;
+        f->count = rec.count;
+    }
+    if (ok) {
+        S.syms = malloc(sizeof(struct symbol) * (hdr.nsyms ? hdr.nsyms : 1));
+        S.names = malloc(hdr.nameslen ? hdr.nameslen : 1);
+        ok = fread(S.syms, sizeof(struct symbol), hdr.nsyms, fp) == hdr.nsyms &&
+             fread(S.names, 1, hdr.nameslen, fp) == hdr.nameslen;
+        S.nsyms = hdr.nsyms;
+        S.nameslen = hdr.nameslen;
+    }
+    // a corrupt entry would point outside names or files: drop the cache
+    for (int j = 0; ok && j < S.nsyms; j++) {
+        struct symbol *sym = &S.syms[j];
+        ok = (uint64_t)sym->name + sym->len <= S.nameslen &&
+             sym->file < (uint32_t)S.nfiles && sym->line >= 1 && sym->line <= INT_MAX;
+    }
+    fclose(fp);
+    if (!ok) symbols_free();
+}
+
+void symbols_store() {
+    char root[PATH_MAX];
+    char *sidecar = symbol_cache_path(root);
+    if (sidecar == NULL) return;
+
+    struct symbol_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SYMBOL_MAGIC, sizeof(hdr.magic));
+    hdr.nfiles = S.nfiles;
+    hdr.nsyms = S.nsyms;
+    hdr.nameslen = S.nameslen;
+    hdr.rootlen = strlen(root);
+
+    // Write a temporary and rename it, like index_cache_store()
+    char tmp[PATH_MAX + 48];
+    snprintf(tmp, sizeof(tmp), "%s.%d", sidecar, (int)getpid());
+    FILE *fp = fopen(tmp, "w");
+    if (fp) {
+        int ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+                 fwrite(root, 1, hdr.rootlen, fp) == hdr.rootlen;
+        for (int j = 0; ok && j < S.nfiles; j++) {
+            struct symbol_file *f = &S.files[j];
+            struct symbol_file_record rec = { f->mtime_sec, f->mtime_nsec, f->size,
+                                              f->first, f->count, strlen(f->path), 0 };
+            ok = fwrite(&rec, sizeof(rec), 1, fp) == 1 &&
+                 fwrite(f->path, 1, rec.pathlen, fp) == rec.pathlen;
+        }
+        ok = ok && fwrite(S.syms, sizeof(struct symbol), S.nsyms, fp) == (size_t)S.nsyms &&
+             fwrite(S.names, 1, S.nameslen, fp) == S.nameslen;
+        if (fclose(fp) == 0 && ok)
+            rename(tmp, sidecar);
+        else
+            unlink(tmp);
+    }
+    free(sidecar);
+}
+
+/**
+ * Brings the index up to date with the files under the working directory.
+ * Unchanged files keep the symbols they had, only new and modified ones
+ * are read. Returns the number of files that were scanned.
+ */
+int symbols_update() {
+    if (!S.loaded) {
+        symbols_load();
+        S.loaded = 1;
+    }
+
+    char **paths = NULL;
+    int npaths = 0, cap = 0;
+    symbol_walk("", &paths, &npaths, &cap);
+    qsort(paths, npaths, sizeof(char *), symbol_path_cmp);
+
+    struct symbol_pool pool = { calloc(npaths > 0 ? npaths : 1, sizeof(struct symbol_job)), npaths, 0,
+                                PTHREAD_MUTEX_INITIALIZER, &HLDB[0] };
+    for (int j = 0; j < npaths; j++) {
+        pool.jobs[j].path = paths[j];
+        pool.jobs[j].old = symbol_file_find(paths[j]);
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = cores < 1 ? 1 : (cores > SYMBOL_MAX_THREADS ? SYMBOL_MAX_THREADS : cores);
+    pthread_t threads[SYMBOL_MAX_THREADS];
+    int started = 0;
+    for (int t = 0; t < nthreads - 1 && t < npaths - 1; t++) {
+        if (pthread_create(&threads[t], NULL, symbol_thread, &pool) != 0) break;
+        started++;
+    }
+    symbol_thread(&pool);
+    for (int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+
+    // merge in path order: reused files copy their old range
+    int nsyms = 0, scanned = 0;
+    size_t nameslen = 0;
+    for (int j = 0; j < npaths; j++) {
+        struct symbol_job *job = &pool.jobs[j];
+        if (job->reuse) {
+            struct symbol_file *old = &S.files[job->old];
+            nsyms += old->count;
+            for (uint32_t k = 0; k < old->count; k++)
+                nameslen += S.syms[old->first + k].len;
+        } else {
+            nsyms += job->scan.n;
+            nameslen += job->scan.len;
+            scanned++;
+        }
+    }
 
-    for (j = 0; j < E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+    struct symbol_file *files = malloc(sizeof(struct symbol_file) * (npaths > 0 ? npaths : 1));
+    struct symbol *syms = malloc(sizeof(struct symbol) * (nsyms > 0 ? nsyms : 1));
+    char *names = malloc(nameslen ? nameslen : 1);
+    int at = 0;
+    size_t nat = 0;
+    for (int j = 0; j < npaths; j++) {
+        struct symbol_job *job = &pool.jobs[j];
+        struct symbol_file *f = &files[j];
+        f->path = job->path;
+        f->first = at;
+
+        struct symbol *from = job->reuse ? &S.syms[S.files[job->old].first] : job->scan.syms;
+        const char *pool_names = job->reuse ? S.names : job->scan.names;
+        int count = job->reuse ? (int)S.files[job->old].count : job->scan.n;
+        for (int k = 0; k < count; k++) {
+            syms[at] = from[k];
+            syms[at].file = j;
+            syms[at].name = nat;
+            memcpy(names + nat, pool_names + from[k].name, from[k].len);
+            nat += from[k].len;
+            at++;
+        }
+        f->count = count;
+        f->mtime_sec = job->st.st_mtim.tv_sec;
+        f->mtime_nsec = job->st.st_mtim.tv_nsec;
+        f->size = job->st.st_size;
+        free(job->scan.syms);
+        free(job->scan.names);
     }
 
-    return buf;
+    int changed = scanned > 0 || npaths != S.nfiles;
+    symbols_free();
+    S.files = files;
+    S.nfiles = npaths;
+    S.syms = syms;
+    S.nsyms = nsyms;
+    S.names = names;
+    S.nameslen = nameslen;
+    if (changed) symbols_store();
+
+    S.folded = malloc(nameslen ? nameslen : 1);
+    for (size_t j = 0; j < nameslen; j++)
+        S.folded[j] = tolower((unsigned char)names[j]);
+
+    free(pool.jobs);
+    free(paths);
+    return scanned;
 }
 
-void open_editor(char *filename) {
-    free(E.filename);
-    // copies a given str, allocating required memory
-    E.filename = strdup(filename);
-
-    select_highlight();
+/**
+ * Fuzzy match: the characters of query (lowercase) appear in the name in
+ * order, looked up in the lowercased copy of the names. Runs of
+ * consecutive characters, matches at the start of a word and short names
+ * score higher. Returns -1 when it doesn't match.
+ */
+int symbol_score(struct symbol *sym, const char *query) {
+    const char *name = S.names + sym->name;
+    const char *folded = S.folded + sym->name;
+    int len = sym->len, score = 0, prev = -2, run = 0;
+
+    for (int j = 0; *query; query++, j++) {
+        while (j < len && folded[j] != *query) j++;
+        if (j == len) return -1;
+        run = (j == prev + 1) ? run + 1 : 0;
+        score += 1 + 2 * run;
+        if (j == 0 || name[j - 1] == '_' || (name[j] != folded[j] && name[j - 1] == folded[j - 1]))
+            score += 3;
+        prev = j;
+    }
+    return score * 64 - len;
+}
 
-    FILE *fp = fopen(filename, "r");
-    if(!fp) die("fopen");
+// Puts symbol k with score into the sorted best list if it makes it
+void symbol_rank(int *show, int *scores, int *nshow, int k, int score) {
+    if (*nshow == SYMBOL_SHOW && score <= scores[SYMBOL_SHOW - 1]) return;
+    int at = *nshow < SYMBOL_SHOW ? (*nshow)++ : SYMBOL_SHOW - 1;
+    while (at > 0 && scores[at - 1] < score) {
+        scores[at] = scores[at - 1];
+        show[at] = show[at - 1];
+        at--;
+    }
+    scores[at] = score;
+    show[at] = k;
+}
 
-    char *line = 0;
-    size_t linecap = 0;
-    ssize_t linelen;
+// A slice of the symbols (or of the previous matches) for one thread
+struct symbol_match_job {
+    const char *query;
+    uint64_t mask;
+    int narrow;         // look at S.cand[from, to) instead of S.syms
+    int from, to;
+    int n;              // matches, written to S.cand from `from` on
+    int show[SYMBOL_SHOW];
+    int scores[SYMBOL_SHOW];
+    int nshow;
+};
 
-    while((linelen = getline(&line, &linecap, fp)) != -1) {
-        while(linelen > 0 && (line[linelen - 1] == '\n' ||
-                              line[linelen - 1] == '\r'))
-            linelen--;
-        insert_row(E.numrows, line, linelen);
+void *symbol_match_thread(void *arg) {
+    struct symbol_match_job *job = arg;
+    int *out = S.cand + job->from;
+    uint64_t mask = job->mask;
+    int n = 0, nshow = 0;
+    for (int j = job->from; j < job->to; j++) {
+        int k = job->narrow ? S.cand[j] : j;
+        struct symbol *sym = &S.syms[k];
+        if ((sym->mask & mask) != mask) continue;
+        int score = symbol_score(sym, job->query);
+        if (score < 0) continue;
+        out[n++] = k;
+        symbol_rank(job->show, job->scores, &nshow, k, score);
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    job->n = n;
+    job->nshow = nshow;
+    return NULL;
 }
 
 /**
- * @brief Saves the current content of the editor to a file.
- *
- * The function converts the editor's rows into a string and writes it to the file.
- * The file is opened with read and write permissions (`O_RDWR`),
- * and if it doesn't exist, it is created with standard permissions (`0644`).
- * The file size is adjusted to match the content length using `ftruncate()`,
- * ensuring that no leftover data remains. Truncating ourselves
- * (not using O_TRUNC flag in open()) is safer in case the ftruncate() call succeeds
- * but the write() call fails. In that case, the file would still contain
- * most of the data it had before.
- * After writing the content to the file, the allocated buffer is freed.
+ * Finds the best SYMBOL_SHOW symbols for query. All matches are kept, so
+ * typing one more character only has to look at the previous matches.
+ * Big lists are split between threads, each with its own best list.
  */
-void save() {
-    if (E.filename == NULL) {
-        E.filename = get_user_input("Save as: %s (ESC to cancel)", NULL);
-        if (E.filename == NULL) {
-            set_prompt_message("Save aborted");
-            return;
-        }
-        select_highlight();
+void symbol_match(const char *typed) {
+    char query[256];
+    int qlen = 0;
+    for (; typed[qlen] && qlen < (int)sizeof(query) - 1; qlen++)
+        query[qlen] = tolower((unsigned char)typed[qlen]);
+    query[qlen] = '\0';
+
+    S.nshow = 0;
+    S.pick = 0;
+    if (qlen == 0) return;
+
+    int narrow = S.cand_query && strncmp(query, S.cand_query, strlen(S.cand_query)) == 0;
+    int n = narrow ? S.ncand : S.nsyms;
+    if (!narrow) S.cand = realloc(S.cand, sizeof(int) * (S.nsyms > 0 ? S.nsyms : 1));
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = cores < 1 ? 1 : (cores > SYMBOL_MAX_THREADS ? SYMBOL_MAX_THREADS : cores);
+    if (nthreads > n / SYMBOL_MIN_SLICE) nthreads = n / SYMBOL_MIN_SLICE > 0 ? n / SYMBOL_MIN_SLICE : 1;
+
+    struct symbol_match_job jobs[SYMBOL_MAX_THREADS];
+    pthread_t threads[SYMBOL_MAX_THREADS];
+    int started = 0;
+    for (int t = 0; t < nthreads; t++) {
+        jobs[t].query = query;
+        jobs[t].mask = symbol_mask(query, qlen);
+        jobs[t].narrow = narrow;
+        jobs[t].from = (int)((long long)n * t / nthreads);
+        jobs[t].to = (int)((long long)n * (t + 1) / nthreads);
     }
+    for (int t = 0; t < nthreads - 1; t++) {
+        if (pthread_create(&threads[t], NULL, symbol_match_thread, &jobs[t]) != 0) break;
+        started++;
+    }
+    for (int t = started; t < nthreads; t++)
+        symbol_match_thread(&jobs[t]);
+    for (int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+
+    // close the gaps between the slices and merge their best lists
+    int ncand = 0, scores[SYMBOL_SHOW];
+    for (int t = 0; t < nthreads; t++) {
+        memmove(S.cand + ncand, S.cand + jobs[t].from, sizeof(int) * jobs[t].n);
+        ncand += jobs[t].n;
+        for (int k = 0; k < jobs[t].nshow; k++)
+            symbol_rank(S.show, scores, &S.nshow, jobs[t].show[k], jobs[t].scores[k]);
+    }
+    S.ncand = ncand;
+    free(S.cand_query);
+    S.cand_query = strdup(query);
+}
 
-    int len;
-    char *buf = rows_to_string(&len);
+// Opens the file of sym, in the buffer already holding it if there is one
+void symbol_goto(struct symbol *sym) {
+    char *path = S.files[sym->file].path;
+    char want[PATH_MAX], have[PATH_MAX];
+    int target = -1;
 
-    int file = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (file != -1) {
-        if (ftruncate(file, len) != -1){
-            if (write(file, buf, len) == len) {
-                close(file);
-                free(buf);
-                E.dirty = 0;
-                set_prompt_message("%d bytes written to disk", len);
-                return;
-            }
+    if (realpath(path, want)) {
+        for (int j = 0; j < B.count && target == -1; j++) {
+            char *name = (j == B.current) ? E.filename : B.list[j].state.filename;
+            if (name && realpath(name, have) && strcmp(have, want) == 0) target = j;
         }
-        close(file);
     }
+    if (target == -1) target = buffer_add(path);
+    buffer_switch(target);
 
-    free(buf);
-    set_prompt_message("Can't save! I/O error: %s", strerror(errno));
+    int y = (int)sym->line - 1;
+    E.cursor_y = y < E.numrows ? y : (E.numrows > 0 ? E.numrows - 1 : 0);
+    E.cursor_x = 0;
+    E.rowoff = E.numrows;
+    set_prompt_message("%.*s  %s:%u", sym->len, S.names + sym->name, path, sym->line);
 }
 
-/*** Find ***/
-void find_callback(char *query, int key) {
-    static int last_match = -1;
-    static int direction = 1;
-    static int saved_highlight_row;
-    static char *saved_highlight = NULL;
+char symbol_prompt[PATH_MAX + 256];
+
+// Shows the picked match after the query, '%' escaped for the prompt format
+void symbol_show_pick() {
+    char pick[PATH_MAX + 128] = "";
+    if (S.nshow > 0) {
+        struct symbol *sym = &S.syms[S.show[S.pick]];
+        snprintf(pick, sizeof(pick), " -> %.*s  %s:%u  [%d/%d of %d]", sym->len,
+                 S.names + sym->name, S.files[sym->file].path, sym->line,
+                 S.pick + 1, S.nshow, S.ncand);
+    } else if (S.cand_query) {
+        snprintf(pick, sizeof(pick), " (no match)");
+    }
 
-    if (saved_highlight) {
-        memcpy(E.row[saved_highlight_row].highlight, saved_highlight, E.row[saved_highlight_row].rsize);
-        free(saved_highlight);
-        saved_highlight = NULL;
+    int len = snprintf(symbol_prompt, sizeof(symbol_prompt), "Symbol: %%s");
+    for (char *p = pick; *p && len < (int)sizeof(symbol_prompt) - 3; p++) {
+        if (*p == '%') symbol_prompt[len++] = '%';
+        symbol_prompt[len++] = *p;
     }
+    symbol_prompt[len] = '\0';
+}
 
-    if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = 1;
-        return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN ) {
-        direction = 1;
-    } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
+void symbol_callback(char *query, int key) {
+    if (key == '\r' || key == '\x1b') return;
+
+    if (key == ARROW_DOWN || key == ARROW_RIGHT) {
+        if (S.nshow) S.pick = (S.pick + 1) % S.nshow;
+    } else if (key == ARROW_UP || key == ARROW_LEFT) {
+        if (S.nshow) S.pick = (S.pick + S.nshow - 1) % S.nshow;
     } else {
-        last_match = -1;
-        direction = 1;
+        symbol_match(query);
     }
+    symbol_show_pick();
+}
 
-    if (last_match == -1) direction = 1;
-    int current = last_match;
-
-    int i;
-    for (i = 0; i < E.numrows; i++) {
-        current += direction;
-        if (current == -1) current = E.numrows -1;
-        else if (current == E.numrows) current = 0;
+/**
+ * ^] asks for a symbol with fuzzy matching, arrows cycle through the best
+ * matches and Enter opens the file at the definition.
+ */
+void symbol_find() {
+    int scanned = symbols_update();
+    free(S.cand_query);
+    S.cand_query = NULL;
+    S.nshow = 0;
+
+    snprintf(symbol_prompt, sizeof(symbol_prompt), "Symbol: %%s (%d in %d files, %d scanned)",
+             S.nsyms, S.nfiles, scanned);
+    char *query = get_user_input(symbol_prompt, symbol_callback);
+    if (query == NULL) return;
+    free(query);
+
+    if (S.nshow == 0)
+        set_prompt_message("No symbol matches");
+    else
+        symbol_goto(&S.syms[S.show[S.pick]]);
+}
 
-        editor_row *row = &E.row[current];
-        char *match = strstr(row->render, query);
-        if (match) {
-            last_match = current;
-            E.cursor_y = current;
-            E.cursor_x = row_rx_to_cx(row, match - row->render);
-            E.rowoff = E.numrows;
+/*** Viewer ***/
 
-            saved_highlight_row = current;
-            saved_highlight = malloc(row->rsize);
-            memcpy(saved_highlight, row->highlight, row->size);
-            memset(&row->highlight[match - row->render], HL_FIND, strlen(query));
-            break;
+/**
+ * Background thread building the viewer's sparse line index. It walks the
+ * mapping once with memchr() and records the offset of every VIEW_STRIDE-th
+ * line. Progress is published once per chunk so the UI can show it and
+ * use the part that is already indexed.
+ */
+void *viewer_index_thread(void *arg) {
+    (void)arg;
+    size_t off = V.scanned;
+    long line = V.lines;
+
+    while (off < V.size) {
+        size_t chunk_end = off + (16 << 20);
+        if (chunk_end > V.size) chunk_end = V.size;
+
+        const char *p = V.map + off;
+        const char *end = V.map + chunk_end;
+        while ((p = memchr(p, '\n', end - p)) != NULL) {
+            p++;
+            line++;
+            if (line % VIEW_STRIDE == 0 && p < V.map + V.size) {
+                pthread_mutex_lock(&V.lock);
+                if (V.ncheck == V.checkcap) {
+                    V.checkcap *= 2;
+                    V.checkpoints = realloc(V.checkpoints, sizeof(off_t) * V.checkcap);
+                }
+                V.checkpoints[V.ncheck++] = p - V.map;
+                pthread_mutex_unlock(&V.lock);
+            }
         }
+
+        pthread_mutex_lock(&V.lock);
+        V.scanned = chunk_end;
+        V.lines = line;
+        pthread_mutex_unlock(&V.lock);
+        off = chunk_end;
     }
+
+    pthread_mutex_lock(&V.lock);
+    V.index_done = 1;
+    pthread_mutex_unlock(&V.lock);
+
+    index_cache_store(E.filename, V.fd, &V.st, V.size, V.lines, V.checkpoints, V.ncheck);
+    return NULL;
 }
 
-void find() {
-    int saved_cursor_x = E.cursor_x;
-    int saved_cursor_y = E.cursor_y;
-    int saved_colloff = E.coloff;
-    int saved_rowoff = E.rowoff;
+void viewer_open(char *filename) {
+    free(E.filename);
+    E.filename = strdup(filename);
 
-    char *query = get_user_input("Search: %s (ESC/Arrows/Enter)", find_callback);
+    V.fd = open(filename, O_RDONLY);
+    if (V.fd == -1) die("open");
+    if (fstat(V.fd, &V.st) == -1) die("fstat");
 
-    if (query) {
-        free(query);
-    } else {
-        E.cursor_x = saved_cursor_x;
-        E.cursor_y = saved_cursor_y;
-        E.coloff = saved_colloff;
-        E.rowoff = saved_rowoff;
+    V.size = V.st.st_size;
+    V.map = NULL;
+    if (V.size > 0) {
+        V.map = mmap(NULL, V.size, PROT_READ, MAP_PRIVATE, V.fd, 0);
+        if (V.map == MAP_FAILED) die("mmap");
     }
-}
 
-/*** Append buffer ***/
-struct abuf
-{
-    char *b;
-    int len;
-};
-#define ABUF_INIT {NULL, 0}
+    V.checkcap = 64;
+    V.checkpoints = malloc(sizeof(off_t) * V.checkcap);
+    V.checkpoints[0] = 0;
+    V.ncheck = 1;
+    V.scanned = 0;
+    V.lines = 0;
+    V.index_done = 0;
+    V.cached = 0;
+    V.top = 0;
+    V.top_line = 0;
+    pthread_mutex_init(&V.lock, NULL);
+
+    // Reuse the index from an earlier session, or the part of it that is still valid
+    struct index_header hdr;
+    off_t *stored;
+    int found = index_cache_load(filename, V.fd, &hdr, &stored);
+    if (found && hdr.ncheck > 0) {
+        free(V.checkpoints);
+        V.checkpoints = stored;
+        V.ncheck = V.checkcap = hdr.ncheck;
+        // the scan stopped at the end of line hdr.lines, a multiple of the
+        // stride, so the checkpoint of the line after it is where we resume
+        if (found == 2 && hdr.ncheck == hdr.lines / VIEW_STRIDE) {
+            V.checkpoints = realloc(V.checkpoints, sizeof(off_t) * (V.ncheck + 1));
+            V.checkpoints[V.ncheck++] = hdr.size;
+            V.checkcap = V.ncheck;
+        }
+        V.scanned = hdr.size;
+        V.lines = hdr.lines;
+        V.index_done = V.cached = (found == 1);
+    } else if (found) {
+        free(stored);
+    }
 
-void abAppend(struct abuf *ab, const char *s, int len)
-{
-    char *new = realloc(ab->b, ab->len + len);
+    if (!V.index_done && pthread_create(&V.indexer, NULL, viewer_index_thread, NULL) != 0)
+        die("pthread_create");
 
-    if (new == NULL)
-        return;
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
-    ab->len += len;
+    V.enabled = 1;
 }
 
-void abFree(struct abuf *ab)
-{
-    free(ab->b);
+// Number of lines in the file, or -1 while the index is still being built
+long viewer_total_lines() {
+    long total = -1;
+
+    pthread_mutex_lock(&V.lock);
+    if (V.index_done)
+        total = V.lines + (V.size > 0 && V.map[V.size - 1] != '\n');
+    pthread_mutex_unlock(&V.lock);
+    return total;
 }
 
-/*** Output ***/
+// Counts the newlines in [from, to) of the mapping
+long viewer_count_lines(size_t from, size_t to) {
+    long n = 0;
+    const char *p = V.map + from;
+    const char *end = V.map + to;
 
-void scroll() {
-    E.rx = 0;
-    if (E.cursor_y < E.numrows) {
-        E.rx = row_cx_to_rx(&E.row[E.cursor_y], E.cursor_x);
+    while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+        p++;
+        n++;
     }
+    return n;
+}
 
-    if (E.cursor_y < E.rowoff) {
-        E.rowoff = E.cursor_y;
+/**
+ * Returns the line number of the line starting at off, or -1 if the index
+ * hasn't reached that offset yet. Binary search over the checkpoints, then
+ * a scan of fewer than VIEW_STRIDE lines.
+ */
+long viewer_line_of(size_t off) {
+    pthread_mutex_lock(&V.lock);
+    if (!V.index_done && off > V.scanned) {
+        pthread_mutex_unlock(&V.lock);
+        return -1;
     }
-    if (E.cursor_y >= E.rowoff + E.screenrows) {
-        E.rowoff = E.cursor_y - E.screenrows + 1;
+
+    size_t lo = 0, hi = V.ncheck - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi + 1) / 2;
+        if ((size_t)V.checkpoints[mid] <= off) lo = mid;
+        else hi = mid - 1;
     }
-    if (E.rx < E.coloff) {
-        E.coloff = E.rx;
+    size_t base = V.checkpoints[lo];
+    pthread_mutex_unlock(&V.lock);
+
+    return (long)lo * VIEW_STRIDE + viewer_count_lines(base, off);
+}
+
+// Offset of the line after the one starting at off, or V.size if it is the last
+size_t viewer_next_line(size_t off) {
+    const char *nl = memchr(V.map + off, '\n', V.size - off);
+    return nl ? (size_t)(nl - V.map) + 1 : V.size;
+}
+
+// Offset of the line before the one starting at off
+size_t viewer_prev_line(size_t off) {
+    if (off <= 1) return 0;
+    const char *nl = memrchr(V.map, '\n', off - 1);
+    return nl ? (size_t)(nl - V.map) + 1 : 0;
+}
+
+// Offset of the last line, not counting the empty "line" after a final '\n'
+size_t viewer_last_line() {
+    size_t end = V.size;
+    if (end > 0 && V.map[end - 1] == '\n') end--;
+    const char *nl = end ? memrchr(V.map, '\n', end) : NULL;
+    return nl ? (size_t)(nl - V.map) + 1 : 0;
+}
+
+void viewer_goto_line(long line) {
+    if (line < 0) line = 0;
+
+    pthread_mutex_lock(&V.lock);
+    size_t k = line / VIEW_STRIDE;
+    if (k >= V.ncheck) k = V.ncheck - 1;
+    size_t off = V.checkpoints[k];
+    pthread_mutex_unlock(&V.lock);
+
+    long at = (long)k * VIEW_STRIDE;
+    size_t last = viewer_last_line();
+    while (at < line && off < last) {
+        off = viewer_next_line(off);
+        at++;
     }
-    if (E.rx >= E.coloff + E.screencols) {
-        E.coloff = E.rx - E.screencols + 1;
+    V.top = off;
+    V.top_line = at;
+}
+
+// Jumps to the line containing the byte at pct percent of the file
+void viewer_goto_percent(int pct) {
+    if (pct < 0) pct = 0;
+    if (pct > 100) pct = 100;
+
+    size_t off = (size_t)((double)V.size * pct / 100);
+    if (off > viewer_last_line()) off = viewer_last_line();
+    if (off > 0 && V.map[off - 1] != '\n') off = viewer_prev_line(off);
+    V.top = off;
+    V.top_line = viewer_line_of(off);
+}
+
+void viewer_scroll(int lines) {
+    size_t last = viewer_last_line();
+
+    while (lines > 0 && V.top < last) {
+        V.top = viewer_next_line(V.top);
+        if (V.top_line >= 0) V.top_line++;
+        lines--;
+    }
+    while (lines < 0 && V.top > 0) {
+        V.top = viewer_prev_line(V.top);
+        if (V.top_line > 0) V.top_line--;
+        lines++;
     }
 }
 
-void draw_rows(struct abuf *ab)
-{
+/**
+ * Decodes the line starting at off into a temporary row. Only the part
+ * that can reach the screen (up to E.coloff + E.screencols chars) is copied
+ * and rendered. The caller frees it with free_row().
+ */
+void viewer_decode(size_t off, editor_row *row) {
+    const char *p = V.map + off;
+    const char *nl = memchr(p, '\n', V.size - off);
+    size_t len = nl ? (size_t)(nl - p) : V.size - off;
+    if (nl && len > 0 && p[len - 1] == '\r') len--;
+    if (len > (size_t)(E.coloff + E.screencols)) len = E.coloff + E.screencols;
+
+    row->index = 0;
+    row->size = len;
+    row->chars = malloc(len + 1);
+    memcpy(row->chars, p, len);
+    row->chars[len] = '\0';
+    row->render = NULL;
+    row->highlight = NULL;
+    row->hl_open_comment = 0;
+    row->shared = NULL;
+    update_row(row);
+}
+
+void viewer_draw(struct abuf *ab) {
+    size_t off = V.top;
+    int more = (V.size > 0);
     int i;
-    for (i = 0; i < E.screenrows; i++)
-    {
-        int fileditor_row = i + E.rowoff;
 
-        if (fileditor_row < E.numrows) {
-            char linenum[16];
-            snprintf(linenum, sizeof(linenum), "%4d ", fileditor_row + 1);
+    for (i = 0; i < E.screenrows; i++) {
+        if (more) {
+            char linenum[24];
+            if (V.top_line >= 0)
+                snprintf(linenum, sizeof(linenum), "%4ld ", V.top_line + i + 1);
+            else
+                snprintf(linenum, sizeof(linenum), "%4s ", "?");
             abAppend(ab, "\x1b[90m", LINENUM_WIDTH);
             abAppend(ab, linenum, strlen(linenum));
             abAppend(ab, "\x1b[39m", LINENUM_WIDTH);
-        } else {
-	    abAppend(ab, "     ", LINENUM_WIDTH);
-	}
-
-        if(fileditor_row >= E.numrows) {
-            if (E.numrows == 0 && i == E.screenrows / 3)
-            {
-                char welcome[80];
-                int welcomelen = snprintf(welcome, sizeof(welcome),
-                                        "CCode editor -- version %s", CCODE_VERSION);
-                if (welcomelen > E.screencols)
-                    welcomelen = E.screencols;
-                int padding = (E.screencols - welcomelen) / 2;
-                if (padding)
-                {
-                    abAppend(ab, "-", 1);
-                    padding--;
-                }
-                while (padding--)
-                    abAppend(ab, " ", 1);
-                abAppend(ab, welcome, welcomelen);
-            }
-            else
-            {
-                abAppend(ab, "-", 1);
-            }
-        } else {
-            int len = E.row[fileditor_row].rsize - E.coloff;
-            if (len < 0) len = 0;
-            if(len > E.screencols) len = E.screencols;
-
-            char *c = &E.row[fileditor_row].render[E.coloff];
-            unsigned char *highlight = &E.row[fileditor_row].highlight[E.coloff];
-            int current_color = -1; // This will be -1 for default color
 
-            int j;
-            for (j = 0; j < len; j++) {
-                if (highlight[j] == HL_FIND) {
-                    // Special case for HL_FIND: yellow background, black text
-                    abAppend(ab, "\x1b[43m\x1b[30m", 10);
-                    abAppend(ab, &c[j], 1);
-                    abAppend(ab, "\x1b[49m\x1b[39m", 10); // reset bg and fg
-                    current_color = -1;
-                    continue;
-                }
+            editor_row row;
+            viewer_decode(off, &row);
+            draw_row_text(ab, &row, NULL);
+            free_row(&row);
 
-                if (iscntrl(c[j])) {
-                    /** Check if the current character is a control character. If so, we translate it into a printable character
-                     * by adding its value to '@' (in ASCII, the capital letters of the alphabet come after the @ character),
-                     * or using the '?' character if it’s not in the alphabetic range.
-                    */
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
-                    if (current_color != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        abAppend(ab, buf, clen);
-                    }
-                }
-                else if (highlight[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        abAppend(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
-                } else {
-                    int color = highlight_to_color(highlight[j]);
-                    if (color != current_color) {
-                        current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &c[j], 1);
-                }
-            }
-            abAppend(ab, "\x1b[39m", 5);
+            off = viewer_next_line(off);
+            more = (off < V.size);
+        } else {
+            abAppend(ab, "     -", LINENUM_WIDTH + 1);
         }
-        abAppend(ab, "\x1b[K]", 3);
+        abAppend(ab, "\x1b[K", 3);
         abAppend(ab, "\r\n", 2);
     }
-}
 
-/**
- * The m command (Selected Graphic Rendition) is used to change the text's
- * appearance in the terminal - bold (1), underline (4) or inverted (7).
- * Effects can be combined, reseting text back - <esc>[m.
- * http://vt100.net/docs/vt100-ug/chapter3.html#SGR
- *
- * Current line is in E.cursor_y. Aligning the 2nd string,
- * spaces are printed until the right edge of screen.
- */
-void draw_status_bar(struct abuf *ab) {
-    // Switch to inverted colors with: <esc>[7m
     abAppend(ab, "\x1b[7m", 4);
 
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-        E.filename ? E.filename : "[No Name]", E.numrows,
-        E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-        E.syntax ? E.syntax->filetype : "no ft", E.cursor_y + 1, E.numrows);
+    char status[80], rstatus[80], lines[32];
+    long total = viewer_total_lines();
+    if (total >= 0) {
+        snprintf(lines, sizeof(lines), "%ld lines", total);
+    } else {
+        pthread_mutex_lock(&V.lock);
+        int pct = V.size ? (int)((double)V.scanned * 100 / V.size) : 100;
+        pthread_mutex_unlock(&V.lock);
+        snprintf(lines, sizeof(lines), "indexing %d%%", pct);
+    }
+    int len = snprintf(status, sizeof(status), "%.20s - %s [read-only]",
+        E.filename ? E.filename : "[No Name]", lines);
+    int rlen;
+    if (V.top_line >= 0)
+        rlen = snprintf(rstatus, sizeof(rstatus), "%ld | %d%%", V.top_line + 1,
+            V.size ? (int)((double)V.top * 100 / V.size) : 100);
+    else
+        rlen = snprintf(rstatus, sizeof(rstatus), "? | %d%%",
+            V.size ? (int)((double)V.top * 100 / V.size) : 100);
 
     if (len > E.screencols) len = E.screencols;
     abAppend(ab, status, len);
-
     while (len < E.screencols) {
         if (E.screencols - len == rlen) {
             abAppend(ab, rstatus, rlen);
@@ -1164,222 +7324,426 @@ void draw_status_bar(struct abuf *ab) {
             len++;
         }
     }
-
-    // Switch back to normal colors(formatting) with: <esc>[m
     abAppend(ab, "\x1b[m", 3);
     abAppend(ab, "\r\n", 2);
 }
 
 /**
- * Clear the msg bar with <esc>[K. We make sure msg fits the
- * with of screen and then display msg, only if it is 5 sec old.
+ * Keeps the screen in sync with the indexer: redraws while it makes
+ * progress and fills in the top line number once it becomes known.
  */
-void draw_prompt_bar(struct abuf *ab) {
-    abAppend(ab, "\x1b[K", 3);
-    int msglen = strlen(E.status_prompt);
-    if (msglen > E.screencols) msglen = E.screencols;
+int viewer_idle() {
+    static int reported_done = 0;
 
-    if (msglen && time(NULL) - E.status_prompt_time < 5)
-        abAppend(ab, E.status_prompt, msglen);
+    if (!V.enabled || reported_done) return 0;
+
+    pthread_mutex_lock(&V.lock);
+    int done = V.index_done;
+    pthread_mutex_unlock(&V.lock);
+
+    if (V.top_line < 0) V.top_line = viewer_line_of(V.top);
+    if (done) reported_done = 1;
+    return 1;
 }
 
-void refresh_screen()
-{
-    scroll();
+void viewer_find() {
+    char *query = get_user_input("Search: %s (ESC to cancel)", NULL);
+    if (query == NULL) return;
 
-    struct abuf ab = ABUF_INIT;
+    size_t qlen = strlen(query);
+    size_t from = viewer_next_line(V.top);
+    char *match = NULL;
 
-    abAppend(&ab, "\x1b[?25l", 6);
-    abAppend(&ab, "\x1b[H", 3);
+    if (from < V.size)
+        match = memmem(V.map + from, V.size - from, query, qlen);
+    if (match == NULL)
+        match = memmem(V.map, V.size, query, qlen);
 
-    draw_rows(&ab);
-    draw_status_bar(&ab);
-    draw_prompt_bar(&ab);
+    if (match) {
+        size_t off = match - V.map;
+        V.top = (off > 0 && V.map[off - 1] != '\n') ? viewer_prev_line(off + 1) : off;
+        V.top_line = viewer_line_of(V.top);
+    } else {
+        set_prompt_message("Not found: %s", query);
+    }
+    free(query);
+}
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cursor_y - E.rowoff) + 1,
-                                              (E.rx - E.coloff) + 1 + LINENUM_WIDTH);
-    abAppend(&ab, buf, strlen(buf));
+void viewer_goto() {
+    char *target = get_user_input("Go to line or N%%: %s (ESC to cancel)", NULL);
+    if (target == NULL) return;
 
-    abAppend(&ab, "\x1b[?25h", 6); // Show the cursor
+    if (strchr(target, '%'))
+        viewer_goto_percent(atoi(target));
+    else
+        viewer_goto_line(atol(target) - 1);
+    free(target);
+}
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+void viewer_process_keypress() {
+    int c = read_keypress();
+
+    switch (c) {
+        case CTRL_KEY('q'):
+            screen_write("\x1b[2j]", 4);
+            screen_write("\x1b[H", 3);
+            exit(0);
+            break;
+        case ARROW_UP:
+            viewer_scroll(-1);
+            break;
+        case ARROW_DOWN:
+            viewer_scroll(1);
+            break;
+        case PAGE_UP:
+            viewer_scroll(-E.screenrows);
+            break;
+        case PAGE_DOWN:
+            viewer_scroll(E.screenrows);
+            break;
+        case ARROW_LEFT:
+            if (E.coloff > 0) E.coloff--;
+            break;
+        case ARROW_RIGHT:
+            E.coloff++;
+            break;
+        case HOME_KEY:
+            V.top = 0;
+            V.top_line = 0;
+            E.coloff = 0;
+            break;
+        case END_KEY:
+            V.top = viewer_last_line();
+            V.top_line = viewer_line_of(V.top);
+            viewer_scroll(-(E.screenrows - 1));
+            break;
+        case CTRL_KEY('g'):
+            viewer_goto();
+            break;
+        case CTRL_KEY('f'):
+            viewer_find();
+            break;
+    }
+}
+
+/*** Hex view ***/
+
+const char hex_digits[] = "0123456789abcdef";
+char hex_lut[512]; // "000102...ff", two output chars per byte value
+
+void hex_init_lut() {
+    for (int b = 0; b < 256; b++) {
+        hex_lut[b * 2] = hex_digits[b >> 4];
+        hex_lut[b * 2 + 1] = hex_digits[b & 0xf];
+    }
 }
 
 /**
- * Like printf() style function for printing status message.
- * This is a variadic function, takes any number of args.
- * https://en.wikipedia.org/wiki/Variadic_function
+ * Formats n bytes as "xx xx xx ..." into out (3 chars per byte). Table
+ * driven with fixed size copies, so the compiler can unroll and vectorize
+ * it; no division or printf per byte.
  */
-void set_prompt_message(const char *fmt, ...) {
-    va_list ap;
-    va_start(ap, fmt);
+void hex_encode(char *out, const unsigned char *in, int n) {
+    for (int j = 0; j < n; j++) {
+        memcpy(out, &hex_lut[in[j] * 2], 2);
+        out[2] = ' ';
+        out += 3;
+    }
+}
 
-    vsnprintf(E.status_prompt, sizeof(E.status_prompt), fmt, ap);
+void hex_open(char *filename) {
+    free(E.filename);
+    E.filename = strdup(filename);
 
-    va_end(ap);
-    E.status_prompt_time = time(NULL);
+    // Without write permission the view still works, saving is refused
+    H.fd = open(filename, O_RDWR);
+    if (H.fd == -1) H.fd = open(filename, O_RDONLY);
+    if (H.fd == -1) die("open");
+    H.writable = (fcntl(H.fd, F_GETFL) & O_ACCMODE) == O_RDWR;
+
+    struct stat st;
+    if (fstat(H.fd, &st) == -1) die("fstat");
+
+    H.size = st.st_size;
+    H.map = NULL;
+    if (H.size > 0) {
+        // Private and writable: edits touch only our copy of the page until saved
+        H.map = mmap(NULL, H.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, H.fd, 0);
+        if (H.map == MAP_FAILED) die("mmap");
+    }
+
+    int digits = 8;
+    while (digits < 16 && (H.size >> (digits * 4)) > 0) digits++;
+    H.offset_width = digits;
+    H.bytes_per_row = (E.screencols >= digits + 2 + 16 * 3 + 2 + 16) ? 16 : 8;
+
+    H.modified = NULL;
+    H.nmodified = 0;
+    H.modcap = 0;
+    H.cursor = 0;
+    H.nibble = 0;
+    H.ascii = 0;
+    H.top = 0;
+    hex_init_lut();
+    H.enabled = 1;
 }
 
-/*** Input ***/
-char *get_user_input(char *prompt, void (*callback)(char *, int)) {
-    size_t bufsize = 128;
-    char *buf = malloc(bufsize);
+// Index of the first entry in H.modified that is >= off
+size_t hex_modified_lower_bound(size_t off) {
+    size_t lo = 0, hi = H.nmodified;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (H.modified[mid] < off) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
 
-    size_t buflen = 0;
-    buf[0] = '\0';
+// Remembers that the byte at off differs from the file, keeping the list sorted
+void hex_mark_modified(size_t off) {
+    size_t at = hex_modified_lower_bound(off);
+    if (at < H.nmodified && H.modified[at] == off) return;
 
-    while (1) {
-        set_prompt_message(prompt, buf);
-        refresh_screen();
+    if (H.nmodified == H.modcap) {
+        H.modcap = H.modcap ? H.modcap * 2 : 64;
+        H.modified = realloc(H.modified, sizeof(size_t) * H.modcap);
+    }
+    memmove(&H.modified[at + 1], &H.modified[at], sizeof(size_t) * (H.nmodified - at));
+    H.modified[at] = off;
+    H.nmodified++;
+}
 
-        int c = read_keypress();
-        if (c == DELETE_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-            if (buflen != 0) buf[--buflen] = '\0';
-        } else if (c == '\x1b') {
-            set_prompt_message("");
-            if (callback) callback(buf, c);
-            free(buf);
-            return NULL;
-        } else if (c == '\r') {
-            if (buflen != 0) {
-                set_prompt_message("");
-                if (callback) callback(buf, c);
-                return buf;
-            }
-        } else if (!iscntrl(c) && c < 128) {
-            if (buflen == bufsize - 1) {
-                bufsize *= 2;
-                buf = realloc(buf, bufsize);
-            }
-            buf[buflen++] = c;
-            buf[buflen] = '\0';
+/**
+ * Writes the modified bytes back in place. Adjacent offsets are coalesced,
+ * so each run costs one pwrite() and the rest of the file is never touched.
+ */
+void hex_save() {
+    if (!H.writable) {
+        set_prompt_message("Can't save! %s is read-only", E.filename);
+        return;
+    }
+
+    size_t written = 0;
+    size_t i = 0;
+    while (i < H.nmodified) {
+        size_t start = H.modified[i];
+        size_t end = start + 1;
+        while (++i < H.nmodified && H.modified[i] == end) end++;
+
+        if (pwrite(H.fd, H.map + start, end - start, start) != (ssize_t)(end - start)) {
+            set_prompt_message("Can't save! I/O error: %s", strerror(errno));
+            return;
         }
-        if (callback) callback(buf, c);
+        written += end - start;
     }
+
+    H.nmodified = 0;
+    set_prompt_message("%zu bytes written to disk", written);
 }
 
-void move_cursor(int key)
-{
-    editor_row *row = (E.cursor_y > E.numrows) ? NULL : &E.row[E.cursor_y];
+void hex_draw(struct abuf *ab) {
+    int bpr = H.bytes_per_row;
+    size_t mod = hex_modified_lower_bound(H.top * bpr);
+    int i;
 
-    switch (key)
-    {
-    case ARROW_LEFT:
-        if (E.cursor_x != 0) {
-            E.cursor_x--;
-        } else if (E.cursor_y > 0) {
-            E.cursor_y--;
-            E.cursor_x = E.row[E.cursor_y].size;
+    for (i = 0; i < E.screenrows; i++) {
+        size_t off = (H.top + i) * bpr;
+        if (off >= H.size) {
+            abAppend(ab, "-\x1b[K\r\n", 6);
+            continue;
         }
-        break;
-    case ARROW_RIGHT:
-        if(row && E.cursor_x < row->size) {
-            E.cursor_x++;
-        } else if (row && E.cursor_x == row->size) {
-            E.cursor_y++;
-            E.cursor_x = 0;
+        int n = (H.size - off < (size_t)bpr) ? (int)(H.size - off) : bpr;
+        const unsigned char *bytes = (const unsigned char *)H.map + off;
+
+        char offset[24];
+        int olen = snprintf(offset, sizeof(offset), "%0*zx  ", H.offset_width, off);
+        abAppend(ab, "\x1b[90m", 5);
+        abAppend(ab, offset, olen);
+        abAppend(ab, "\x1b[39m", 5);
+
+        // Fast path: nothing modified on this row, emit the encoded row as is
+        char hex[16 * 3];
+        hex_encode(hex, bytes, n);
+        if (mod >= H.nmodified || H.modified[mod] >= off + n) {
+            abAppend(ab, hex, n * 3);
+        } else {
+            for (int j = 0; j < n; j++) {
+                int changed = (mod < H.nmodified && H.modified[mod] == off + j);
+                if (changed) {
+                    abAppend(ab, "\x1b[91m", 5);
+                    abAppend(ab, &hex[j * 3], 2);
+                    abAppend(ab, "\x1b[39m ", 6);
+                    mod++;
+                } else {
+                    abAppend(ab, &hex[j * 3], 3);
+                }
+            }
         }
-        break;
-    case ARROW_UP:
-        if (E.cursor_y != 0)
-            E.cursor_y--;
-        break;
-    case ARROW_DOWN:
-        if (E.cursor_y < E.numrows - 1)
-            E.cursor_y++;
-        break;
+        for (int j = n; j < bpr; j++)
+            abAppend(ab, "   ", 3);
+
+        char ascii[16];
+        for (int j = 0; j < n; j++)
+            ascii[j] = isprint(bytes[j]) ? bytes[j] : '.';
+        abAppend(ab, " ", 1);
+        abAppend(ab, ascii, n);
+        abAppend(ab, "\x1b[K\r\n", 5);
     }
 
-    row = (E.cursor_y >= E.numrows) ? NULL : &E.row[E.cursor_y];
-    int rowlen = row ? row->size : 0;
-    if (E.cursor_x > rowlen) {
-        E.cursor_x = rowlen;
+    abAppend(ab, "\x1b[7m", 4);
+
+    char status[80], rstatus[80];
+    int len = snprintf(status, sizeof(status), "%.20s - %zu bytes [hex%s] %s",
+        E.filename ? E.filename : "[No Name]", H.size,
+        H.writable ? "" : ", read-only", H.nmodified ? "(modified)" : "");
+    int rlen = snprintf(rstatus, sizeof(rstatus), "0x%zx | %d%%", H.cursor,
+        H.size ? (int)((double)H.cursor * 100 / H.size) : 100);
+
+    if (len > E.screencols) len = E.screencols;
+    abAppend(ab, status, len);
+    while (len < E.screencols) {
+        if (E.screencols - len == rlen) {
+            abAppend(ab, rstatus, rlen);
+            break;
+        } else {
+            abAppend(ab, " ", 1);
+            len++;
+        }
     }
+    abAppend(ab, "\x1b[m", 3);
+    abAppend(ab, "\r\n", 2);
 }
 
-void process_keypress()
-{
+// Screen position (1 based) of the cursor in the hex or the ascii column
+void hex_cursor_position(int *y, int *x) {
+    int bpr = H.bytes_per_row;
+    int col = H.cursor % bpr;
+
+    *y = (int)(H.cursor / bpr - H.top) + 1;
+    if (H.ascii)
+        *x = H.offset_width + 2 + bpr * 3 + 1 + col + 1;
+    else
+        *x = H.offset_width + 2 + col * 3 + H.nibble + 1;
+}
+
+void hex_scroll() {
+    size_t row = H.cursor / H.bytes_per_row;
+
+    if (row < H.top) H.top = row;
+    if (row >= H.top + E.screenrows) H.top = row - E.screenrows + 1;
+}
+
+void hex_move(long delta) {
+    if (H.size == 0) return;
+    if (delta < 0 && (size_t)-delta > H.cursor) H.cursor = 0;
+    else H.cursor += delta;
+    if (H.cursor >= H.size) H.cursor = H.size - 1;
+    H.nibble = 0;
+}
+
+void hex_goto() {
+    char *target = get_user_input("Go to offset (0x.., decimal or N%%): %s (ESC to cancel)", NULL);
+    if (target == NULL) return;
+
+    if (strchr(target, '%'))
+        H.cursor = (size_t)((double)H.size * atoi(target) / 100);
+    else
+        H.cursor = strtoull(target, NULL, 0);
+    hex_move(0);
+    free(target);
+}
+
+// Overwrites the byte under the cursor from a typed hex digit or character
+void hex_edit(int c) {
+    if (H.size == 0 || c > 255) return;
+
+    size_t at = H.cursor;
+    unsigned char *byte = (unsigned char *)H.map + at;
+    if (H.ascii) {
+        if (!isprint(c)) return;
+        *byte = c;
+        hex_mark_modified(at);
+        hex_move(1);
+        return;
+    }
+
+    if (!isxdigit(c)) return;
+    int v = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+    if (H.nibble == 0) *byte = (v << 4) | (*byte & 0x0f);
+    else *byte = (*byte & 0xf0) | v;
+    hex_mark_modified(at);
+
+    if (H.nibble == 0) H.nibble = 1;
+    else hex_move(1);
+}
+
+void hex_process_keypress() {
     static int quit_times = CCODE_QUIT_TIMES;
+    int bpr = H.bytes_per_row;
 
     int c = read_keypress();
 
     switch (c) {
-        case '\r': // Enter key
-            insert_new_line();
-            break;
         case CTRL_KEY('q'):
-            if (E.dirty && quit_times > 0) {
+            if (H.nmodified && quit_times > 0) {
                 set_prompt_message("Warning!!! File was not saved! "
                     "Press Ctrl-Q %d more times to quit.", quit_times);
                 quit_times--;
                 return;
             }
-            write(STDOUT_FILENO, "\x1b[2j]", 4);
-            write(STDOUT_FILENO, "\x1b[H", 3);
+            screen_write("\x1b[2j]", 4);
+            screen_write("\x1b[H", 3);
             exit(0);
             break;
-
         case CTRL_KEY('s'):
-            save();
+            hex_save();
             break;
-        case CTRL_KEY('z'):
-            undo_operation();
+        case CTRL_KEY('g'):
+            hex_goto();
             break;
-        case CTRL_KEY('y'):
-            redo_operation();
+        case '\t':
+            H.ascii = !H.ascii;
+            H.nibble = 0;
             break;
-        case HOME_KEY:
-            E.cursor_x = 0;
+        case ARROW_LEFT:
+            hex_move(-1);
             break;
-        case END_KEY:
-            if (E.cursor_y < E.numrows) {
-                E.cursor_x = E.row[E.cursor_y].size;
-            }
+        case ARROW_RIGHT:
+            hex_move(1);
             break;
-        case CTRL_KEY('f'):
-            find();
+        case ARROW_UP:
+            if (H.cursor >= (size_t)bpr) hex_move(-bpr);
             break;
-        case BACKSPACE:
-        case CTRL_KEY('h'):
-        case DELETE_KEY:
-            if (c == DELETE_KEY) move_cursor(ARROW_RIGHT);
-            delete_char();
+        case ARROW_DOWN:
+            if (H.cursor + bpr < H.size) hex_move(bpr);
             break;
         case PAGE_UP:
+            hex_move(-(long)bpr * E.screenrows);
+            break;
         case PAGE_DOWN:
-            {
-                if (c == PAGE_UP) {
-                    E.cursor_y = E.rowoff;
-                } else if (c == PAGE_DOWN) {
-                    E.cursor_y = E.rowoff + E.screenrows - 1;
-                    if (E.cursor_y > E.numrows) E.cursor_y = E.numrows;
-                }
-                int times = E.screenrows;
-                while (times--)
-                    move_cursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-            }
+            hex_move((long)bpr * E.screenrows);
             break;
-        case ARROW_UP:
-        case ARROW_DOWN:
-        case ARROW_LEFT:
-        case ARROW_RIGHT:
-            move_cursor(c);
+        case HOME_KEY:
+            hex_move(-(long)(H.cursor % bpr));
             break;
-        case CTRL_KEY('l'): // Tipically used to refresh screen
-        case '\x1b': // Escape key F1-F12 included
+        case END_KEY:
+            hex_move(bpr - 1 - (long)(H.cursor % bpr));
+            break;
+        case CTRL_KEY('l'):
+        case '\x1b':
             break;
         default:
-            insert_char(c);
+            hex_edit(c);
             break;
     }
+    hex_scroll();
     quit_times = CCODE_QUIT_TIMES;
 }
 
 /*** Init ***/
 
-void init()
+// Resets the per-buffer part of E to an empty document
+void init_buffer()
 {
     E.cursor_x = 0;
     E.cursor_y = 0;
@@ -1387,31 +7751,155 @@ void init()
     E.rowoff = 0;
     E.coloff = 0;
     E.numrows = 0;
+    E.rowcap = 0;
     E.row = NULL;
     E.dirty = 0;
     E.filename = NULL;
+    E.syntax = NULL;
+    E.follow.enabled = 0;
+    E.follow.fd = -1;
+    E.undo_stack = calloc(MAX_UNDO, sizeof(undo_t));
+    E.undo_len = 0;
+    E.redo_stack = calloc(MAX_UNDO, sizeof(undo_t));
+    E.redo_len = 0;
+    E.sel_active = 0;
+    E.sel_block = 0;
+    E.cursors = NULL;
+    E.ncursors = 0;
+    E.cursorcap = 0;
+    E.cursors_undo = -1;
+    E.hl_stale = INT_MAX;
+    E.br_tree = NULL;
+    E.br_cap = 0;
+    E.br_valid = 0;
+    E.br_gen = 0;
+    E.br_pair.y = -1;
+    E.folded = 0;
+    E.fold_tree = NULL;
+    E.fold_cap = 0;
+    E.fold_built = 0;
+    memset(&E.stats, 0, sizeof(E.stats));
+    E.stats_tree = NULL;
+    E.stats_built = 0;
+    E.stats_gen = 0;
+    E.sel_stats.sy = -1;
+    E.word_nodes = NULL;
+    E.word_count = 0;
+    E.word_cap = 0;
+    E.word_next = 0;
+}
+
+void init()
+{
+    init_buffer();
     E.status_prompt[0] = '\0';
     E.status_prompt_time = 0;
-    E.syntax = NULL;
 
-    if (get_windows_size(&E.screenrows, &E.screencols) == -1) die("get_windows_size");
+    if (D.enabled) {
+        E.screenrows = D.rows;
+        E.screencols = D.cols;
+    } else if (get_windows_size(&E.screenrows, &E.screencols) == -1) {
+        die("get_windows_size");
+    }
     E.screenrows -= 2;
 }
 
+#ifndef CCODE_NO_MAIN // bench.c has its own
 int main(int argc, char *argv[])
 {
-    enable_rawmode();
+    int follow = 0, view = 0, hex = 0;
+    char *script = NULL, *geometry = "80x24", *sink = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "fRxs:g:o:")) != -1) {
+        switch (opt) {
+            case 'f': follow = 1; break;
+            case 'R': view = 1; break;
+            case 'x': hex = 1; break;
+            case 's': script = optarg; break;
+            case 'g': geometry = optarg; break;
+            case 'o': sink = optarg; break;
+            default: optind = argc + 1; break;
+        }
+    }
+    if (optind > argc || follow + view + hex > 1 || ((view || hex) && optind >= argc) ||
+        (script && (sscanf(geometry, "%dx%d", &D.cols, &D.rows) != 2 || D.cols < 1 || D.rows < 3))) {
+        fprintf(stderr, "Usage: %s [-f] [file...]\n"
+                        "       cmd | %s [-] [file...]\n"
+                        "       %s -R file\n"
+                        "       %s -x file\n"
+                        "       %s -s script [-g COLSxROWS] [-o null|hash|file] [-R|-x] [file...]\n",
+                argv[0], argv[0], argv[0], argv[0], argv[0]);
+        exit(1);
+    }
+    if (script) {
+        script_load(script);
+        headless_sink(sink);
+        D.enabled = 1;
+        D.started = headless_now();
+        atexit(headless_report);
+    }
+
+    // ccode - : the document comes from the pipe, the keyboard from the terminal
+    int stream_fd = -1;
+    if (optind < argc && !strcmp(argv[optind], "-")) {
+        if (view || hex) {
+            fprintf(stderr, "%s: -R and -x need a file, not stdin\n", argv[0]);
+            exit(1);
+        }
+        if (D.enabled) {
+            stream_fd = STDIN_FILENO; // the keys come from the script
+        } else {
+            int tty = open("/dev/tty", O_RDWR);
+            if (tty == -1) die("/dev/tty");
+            stream_fd = dup(STDIN_FILENO);
+            if (stream_fd == -1 || dup2(tty, STDIN_FILENO) == -1) die("dup2");
+            close(tty);
+        }
+        optind++;
+    }
+
+    if (!D.enabled)
+        enable_rawmode();
     init();
-    if (argc >= 2) {
-        open_editor(argv[1]);
+    buffers_init();
+    if (view) {
+        viewer_open(argv[optind]);
+        set_prompt_message("HELP: ^Q = quit ^F = find ^G = go to line/percent");
+    } else if (hex) {
+        hex_open(argv[optind]);
+        set_prompt_message("HELP: ^S = save ^Q = quit ^G = go to offset TAB = hex/text column");
+    } else if (stream_fd != -1) {
+        stream_start(stream_fd);
+        for (int j = optind; j < argc; j++)
+            buffer_add(argv[j]);
+    } else if (optind < argc) {
+        open_editor(argv[optind]);
+        for (int j = optind + 1; j < argc; j++)
+            buffer_add(argv[j]);
     }
 
-    set_prompt_message("HELP: ^S = save ^Q = quit ^F = find ^Z = undo ^Y = Redo");
+    if (!view && !hex)
+        set_prompt_message("HELP: ^S save ^Q quit ^F find ^Z undo ^Y redo ^O open ^N/^P buffers");
+
+    if (follow && stream_fd == -1) {
+        follow_start();
+        if (E.follow.enabled) {
+            E.cursor_y = E.numrows > 0 ? E.numrows - 1 : 0;
+            set_prompt_message("Following %s (new lines are appended as they arrive)", E.filename);
+        }
+    }
 
     while (1)
     {
         refresh_screen();
-        process_keypress();
+        if (H.enabled)
+            hex_process_keypress();
+        else if (V.enabled)
+            viewer_process_keypress();
+        else
+            process_keypress();
     }
     return 0;
 }
+#endif